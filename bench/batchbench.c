@@ -0,0 +1,11 @@
+// Stand-in for a draw API, used by bench/batch.wren. Each call only touches
+// a counter so the measured time is the cost of crossing from Wren to C.
+#include <stdint.h>
+
+static volatile int64_t drawn = 0;
+
+void DrawPixel(int32_t x, int32_t y, int64_t color) { drawn += x + y + color; }
+
+void DrawPixelBatched(int32_t x, int32_t y, int64_t color) { drawn += x + y + color; }
+
+int64_t PixelsDrawn(void) { return drawn; }
@@ -0,0 +1,63 @@
+#!/bin/sh
+# Regression check of `make bench`: compares every shape of CURRENT with
+# BASELINE and fails when one got more than TOLERANCE percent slower or
+# allocates more per call. Both files are the JSON bench/calls.wren prints,
+# one shape per line. Without a BASELINE only the scalar shapes, which must
+# never allocate, are checked.
+BASELINE=$1
+CURRENT=$2
+TOLERANCE=${3:-20}
+SCALAR="noop i32 i64 f32 f64_mixed bool ptr wide8 wide12"
+
+[ -f "$BASELINE" ] || BASELINE=/dev/null
+
+awk -v tolerance="$TOLERANCE" -v scalarShapes="$SCALAR" '
+function value(line, key,    m) {
+    if (!match(line, "\"" key "\": *-?[0-9.e+-]+")) return ""
+    m = substr(line, RSTART, RLENGTH)
+    sub(/^[^:]*: */, "", m)
+    return m
+}
+function shape(line,    m) {
+    if (!match(line, /"name": *"[^"]*"/)) return ""
+    m = substr(line, RSTART, RLENGTH)
+    sub(/^[^:]*: *"/, "", m)
+    sub(/"$/, "", m)
+    return m
+}
+BEGIN {
+    n = split(scalarShapes, names, " ")
+    for (i = 1; i <= n; i++) scalar[names[i]] = 1
+}
+FILENAME == ARGV[1] {
+    name = shape($0)
+    if (name != "") {
+        baseNs[name] = value($0, "ns_per_call")
+        baseAllocs[name] = value($0, "allocs_per_call")
+    }
+    next
+}
+{
+    name = shape($0)
+    if (name == "") next
+    allocs = value($0, "allocs_per_call")
+    if ((name in scalar) && allocs + 0 > 0) {
+        printf "%-12s %8.2f allocs/call  scalar shapes must not allocate\n", name, allocs
+        failed = 1
+    }
+    if (!(name in baseNs)) next
+    ns = value($0, "ns_per_call")
+    change = baseNs[name] > 0 ? (ns - baseNs[name]) * 100 / baseNs[name] : 0
+    status = "ok"
+    if (change > tolerance) {
+        status = "slower"
+        failed = 1
+    }
+    if (allocs != "" && baseAllocs[name] != "" && allocs + 0 > baseAllocs[name] + 0.01) {
+        status = "allocates more"
+        failed = 1
+    }
+    printf "%-12s %8.2f ns/call  baseline %8.2f  %+6.1f%%  %s\n", name, ns, baseNs[name], change, status
+}
+END { exit failed }
+' "$BASELINE" "$CURRENT"
@@ -0,0 +1,131 @@
+// Test library of `make bench`: one function per signature shape the FFI
+// supports, each doing next to nothing so the time measured is the cost of
+// the call. Preloaded with LD_PRELOAD it also counts heap allocations of
+// the whole process.
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct {
+    float x;
+    float y;
+} BenchVec2;
+
+void Noop(void) {}
+
+int32_t AddI32(int32_t a, int32_t b) { return a + b; }
+
+int64_t AddI64(int64_t a, int64_t b) { return a + b; }
+
+float ScaleF32(float x, float k) { return x * k; }
+
+double MixF64(double a, int32_t b, float c) { return a + b * c; }
+
+bool IsEven(int32_t x) { return x % 2 == 0; }
+
+void* PtrOffset(void* p, int32_t n) { return (char*)p + n; }
+
+int32_t StrLen(const char* s) { return (int32_t)strlen(s); }
+
+const char* Greeting(void) { return "hello from libbench"; }
+
+int64_t Sum8(int64_t a, int64_t b, int64_t c, int64_t d, int64_t e, int64_t f, int64_t g, int64_t h) {
+    return a + b + c + d + e + f + g + h;
+}
+
+double Sum12(double a, double b, double c, double d, double e, double f,
+             double g, double h, double i, double j, double k, double l) {
+    return a + b + c + d + e + f + g + h + i + j + k + l;
+}
+
+float Vec2Dot(BenchVec2 a, BenchVec2 b) { return a.x * b.x + a.y * b.y; }
+
+BenchVec2 Vec2Scale(BenchVec2 v, float k) { return (BenchVec2){ v.x * k, v.y * k }; }
+
+// Shapes timed natively by BenchNativeNs, in the order of bench/calls.wren
+enum {
+    SHAPE_NOOP, SHAPE_I32, SHAPE_I64, SHAPE_F32, SHAPE_F64, SHAPE_BOOL, SHAPE_PTR,
+    SHAPE_STRING_ARG, SHAPE_STRING_RET, SHAPE_WIDE8, SHAPE_WIDE12, SHAPE_STRUCT_ARG, SHAPE_STRUCT_RET
+};
+
+// Called through volatile pointers so the compiler can't inline the callee
+static void (*volatile noop)(void) = Noop;
+static int32_t (*volatile addI32)(int32_t, int32_t) = AddI32;
+static int64_t (*volatile addI64)(int64_t, int64_t) = AddI64;
+static float (*volatile scaleF32)(float, float) = ScaleF32;
+static double (*volatile mixF64)(double, int32_t, float) = MixF64;
+static bool (*volatile isEven)(int32_t) = IsEven;
+static void* (*volatile ptrOffset)(void*, int32_t) = PtrOffset;
+static int32_t (*volatile strLen)(const char*) = StrLen;
+static const char* (*volatile greeting)(void) = Greeting;
+static int64_t (*volatile sum8)(int64_t, int64_t, int64_t, int64_t, int64_t, int64_t, int64_t, int64_t) = Sum8;
+static double (*volatile sum12)(double, double, double, double, double, double,
+                                double, double, double, double, double, double) = Sum12;
+static float (*volatile vec2Dot)(BenchVec2, BenchVec2) = Vec2Dot;
+static BenchVec2 (*volatile vec2Scale)(BenchVec2, float) = Vec2Scale;
+
+static volatile double sink;
+
+// Function to time [iterations] direct calls of a shape from C, the part of
+// a call from Wren spent in the callee. Returns ns per call, -1 for an
+// unknown shape.
+double BenchNativeNs(int32_t shape, int32_t iterations) {
+    struct timespec start, end;
+    BenchVec2 v = { 1, 2 };
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int32_t i = 0; i < iterations; i++) {
+        switch (shape) {
+            case SHAPE_NOOP:       noop(); break;
+            case SHAPE_I32:        sink = addI32(i, 1); break;
+            case SHAPE_I64:        sink = addI64(i, 1); break;
+            case SHAPE_F32:        sink = scaleF32(i, 0.5f); break;
+            case SHAPE_F64:        sink = mixF64(i, 1, 0.5f); break;
+            case SHAPE_BOOL:       sink = isEven(i); break;
+            case SHAPE_PTR:        sink = (double)(uintptr_t)ptrOffset(NULL, i); break;
+            case SHAPE_STRING_ARG: sink = strLen("hello"); break;
+            case SHAPE_STRING_RET: sink = (double)(uintptr_t)greeting(); break;
+            case SHAPE_WIDE8:      sink = sum8(i, 1, 2, 3, 4, 5, 6, 7); break;
+            case SHAPE_WIDE12:     sink = sum12(i, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11); break;
+            case SHAPE_STRUCT_ARG: sink = vec2Dot(v, v); break;
+            case SHAPE_STRUCT_RET: sink = vec2Scale(v, 2).x; break;
+            default: return -1;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / iterations;
+}
+
+// Allocation counter, active when the library is preloaded and so replaces
+// the allocator of the whole process. Frees aren't counted.
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* p, size_t size);
+
+static int64_t allocations = 0;
+static bool counting = false;
+
+void* malloc(size_t size) {
+    counting = true;
+    __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+    counting = true;
+    __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* p, size_t size) {
+    counting = true;
+    __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(p, size);
+}
+
+// Number of allocations so far, -1 when the library wasn't preloaded
+int64_t BenchAllocations(void) {
+    return counting ? __atomic_load_n(&allocations, __ATOMIC_RELAXED) : -1;
+}
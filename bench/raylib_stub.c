@@ -0,0 +1,89 @@
+// Headless stand-in for libraylib.so with the functions raylib.wren
+// declares, so game.wren and bounce.wren run without a display. Drawing is
+// counted and dropped, WindowShouldClose turns true after WRENI_STUB_FRAMES
+// frames (600 by default) and the arrow keys are held in turns so the games
+// have something to do. Built and used by `make bench-frames`.
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Same layouts as raylib and the #!struct declarations of raylib.wren
+typedef struct { float x, y; } Vector2;
+typedef struct { float x, y, width, height; } Rectangle;
+typedef struct { unsigned char r, g, b, a; } Color;
+typedef struct { Vector2 offset; Vector2 target; float rotation; float zoom; } Camera2D;
+
+#define KEY_SPACE 32
+#define KEY_RIGHT 262
+#define KEY_LEFT 263
+
+// Frames between switching the held arrow key
+#define STUB_KEY_PERIOD 45
+
+static int screenWidth;
+static int screenHeight;
+static int frame;
+static int frameLimit;
+static unsigned long long drawCalls;
+static char windowHandle;
+
+void InitWindow(int width, int height, const char* title) {
+    screenWidth = width;
+    screenHeight = height;
+    frame = 0;
+    drawCalls = 0;
+    const char* env = getenv("WRENI_STUB_FRAMES");
+    frameLimit = env != NULL && atoi(env) > 0 ? atoi(env) : 600;
+}
+
+void CloseWindow(void) {
+    fprintf(stderr, "raylib stub: %d frames, %llu draw calls\n", frame, drawCalls);
+}
+
+bool WindowShouldClose(void) { return frame >= frameLimit; }
+void SetTargetFPS(int fps) {}
+
+// Frames are timed by the host, not paced here
+float GetFrameTime(void) { return 1.0f / 60.0f; }
+int GetScreenWidth(void) { return screenWidth; }
+int GetScreenHeight(void) { return screenHeight; }
+void* GetWindowHandle(void) { return &windowHandle; }
+
+void BeginDrawing(void) {}
+void EndDrawing(void) { frame++; }
+void BeginMode2D(Camera2D camera) {}
+void EndMode2D(void) {}
+
+// Input is scripted from the frame number: one arrow key is always held,
+// space is pressed once a second
+bool IsKeyDown(int key) {
+    int held = (frame / STUB_KEY_PERIOD) % 2 == 0 ? KEY_RIGHT : KEY_LEFT;
+    return key == held;
+}
+
+bool IsKeyPressed(int key) {
+    return key == KEY_SPACE && frame % 60 == 0;
+}
+
+Vector2 GetMousePosition(void) {
+    Vector2 position = { screenWidth / 2.0f, screenHeight / 2.0f };
+    return position;
+}
+
+const char* GetClipboardText(void) { return ""; }
+const char* GetWorkingDirectory(void) { return "."; }
+
+// Close to raylib's default font, which is about half as wide as it is high
+int MeasureText(const char* text, int fontSize) {
+    return (int)strlen(text) * fontSize / 2;
+}
+
+void ClearBackground(Color color) { drawCalls++; }
+void DrawRectangle(int x, int y, int width, int height, Color color) { drawCalls++; }
+void DrawText(const char* text, int x, int y, int fontSize, Color color) { drawCalls++; }
+void DrawCircle(int centerX, int centerY, float radius, Color color) { drawCalls++; }
+void DrawCircleV(Vector2 center, float radius, Color color) { drawCalls++; }
+void DrawRectangleRec(Rectangle rec, Color color) { drawCalls++; }
+void DrawLineV(Vector2 startPos, Vector2 endPos, Color color) { drawCalls++; }
+void DrawTriangleStrip(const Vector2* points, int pointCount, Color color) { drawCalls++; }
@@ -0,0 +1,96 @@
+// Microbenchmark for the FFI class/method registries: lookup time should stay
+// flat while the number of bound methods grows.
+//
+// The registries are static in main.c, so the whole host is compiled into
+// this translation unit with its main() renamed.
+#define main wreniMain
+#include "../main.c"
+#undef main
+
+#include <time.h>
+
+#define LOOKUPS 10000000
+#define METHODS_PER_CLASS 32
+
+// Keeps the lookups from being optimized away
+static volatile uintptr_t benchSink;
+
+// Registries of a VM, filled directly without one
+static WreniContext benchContext;
+
+static double nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static uint32_t nextRandom(uint32_t* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+static void benchMethods(int methodCount) {
+    int classCount = (methodCount + METHODS_PER_CLASS - 1) / METHODS_PER_CLASS;
+    ObjClass* classes = calloc(classCount, sizeof(ObjClass));
+    
+    benchContext.methods = (FFIKeyTable){0};
+    for (int i = 0; i < methodCount; i++) {
+        addFFIMethod(&benchContext, "Method", "Method(_)", &classes[i / METHODS_PER_CLASS],
+                     (uint16_t)(i % METHODS_PER_CLASS * 7 + i / METHODS_PER_CLASS), false);
+    }
+    
+    uint32_t seed = 0x12345678;
+    uintptr_t sink = 0;
+    double start = nowNs();
+    for (int n = 0; n < LOOKUPS; n++) {
+        int i = nextRandom(&seed) % methodCount;
+        sink ^= (uintptr_t)findFFIMethod(&benchContext, &classes[i / METHODS_PER_CLASS],
+                                         (uint16_t)(i % METHODS_PER_CLASS * 7 + i / METHODS_PER_CLASS));
+    }
+    double elapsed = nowNs() - start;
+    
+    benchSink = sink;
+    
+    printf("methods  %6d  capacity %6u  %6.2f ns/lookup\n",
+           methodCount, benchContext.methods.capacity, elapsed / LOOKUPS);
+}
+
+static void benchClasses(int classCount) {
+    char** names = malloc(classCount * sizeof(char*));
+    
+    benchContext.classesByName = (FFINameTable){0};
+    for (int i = 0; i < classCount; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "Class%d", i);
+        FFIClassInfo* info = calloc(1, sizeof(FFIClassInfo));
+        info->moduleName = "bench";
+        info->className = names[i] = strdup(name);
+        ffiNameTableAdd(&benchContext.classesByName, info);
+    }
+    
+    uint32_t seed = 0x9abcdef0;
+    uintptr_t sink = 0;
+    double start = nowNs();
+    for (int n = 0; n < LOOKUPS; n++) {
+        sink ^= (uintptr_t)findFFIClass(&benchContext, "bench", names[nextRandom(&seed) % classCount]);
+    }
+    double elapsed = nowNs() - start;
+    
+    benchSink = sink;
+    
+    printf("classes  %6d  capacity %6u  %6.2f ns/lookup\n",
+           classCount, benchContext.classesByName.capacity, elapsed / LOOKUPS);
+}
+
+int main(int argc, char* argv[])
+{
+    for (int count = 16; count <= 65536; count *= 4) {
+        benchMethods(count);
+    }
+    for (int count = 16; count <= 65536; count *= 4) {
+        benchClasses(count);
+    }
+    return 0;
+}
@@ -0,0 +1,72 @@
+#!/bin/sh
+# Startup benchmark of the compiled-module cache, run with `make bench-startup`.
+# Generates a program importing MODULES modules of CLASSES classes each and
+# times it with an empty cache (cold) and with the cache filled (warm).
+set -e
+
+WRENI=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+DIR=${2:-build/startup}
+MODULES=${MODULES:-40}
+CLASSES=${CLASSES:-20}
+RUNS=${RUNS:-5}
+
+rm -rf "$DIR"
+mkdir -p "$DIR"
+cd "$DIR"
+
+: > main.wren
+m=0
+while [ $m -lt $MODULES ]; do
+    {
+        c=0
+        while [ $c -lt $CLASSES ]; do
+            cat <<WREN
+#!component(name="C${m}_${c}", order=$c)
+class C${m}_${c} {
+    construct new(x, y) {
+        _x = x
+        _y = y
+    }
+    x { _x }
+    y { _y }
+    length { (_x * _x + _y * _y).sqrt }
+    +(other) { C${m}_${c}.new(_x + other.x, _y + other.y) }
+    scale(factor) { C${m}_${c}.new(_x * factor, _y * factor) }
+    toString { "C${m}_${c}(%(_x), %(_y))" }
+    static sum(list) {
+        var total = C${m}_${c}.new(0, 0)
+        for (item in list) total = total + item
+        return total
+    }
+}
+WREN
+            c=$((c + 1))
+        done
+        echo "var Loaded$m = true"
+    } > "mod$m.wren"
+    echo "import \"mod$m\" for Loaded$m" >> main.wren
+    m=$((m + 1))
+done
+
+# Prints the average wall time of RUNS runs in ms, [1] clears the cache first
+run() {
+    total=0
+    i=0
+    while [ $i -lt $RUNS ]; do
+        [ "$1" = 1 ] && rm -rf .wreni-cache
+        start=$(date +%s%N)
+        "$WRENI" main > /dev/null 2>&1
+        end=$(date +%s%N)
+        total=$((total + end - start))
+        i=$((i + 1))
+    done
+    echo "$((total / RUNS / 1000)) us"
+}
+
+echo "$MODULES modules of $CLASSES classes"
+export WRENI_CACHE_DIR=.wreni-cache
+echo "cold start: $(run 1)"
+"$WRENI" main > /dev/null 2>&1
+echo "warm start: $(run 0)"
+export WRENI_NO_CACHE=1
+echo "no cache:   $(run 0)"
@@ -0,0 +1,191 @@
+// Bulk kernels over f32 Buffers, included by main.c once per instruction
+// set with KERNEL_SUFFIX, KERNEL_NAME, KERNEL_TARGET and KERNEL_LANES
+// defined. Main loops work on KERNEL_LANES floats at a time with GCC vector
+// extensions, which the target attribute turns into SSE or AVX2 code, the
+// tail is done one element at a time. With one lane this is the scalar
+// fallback.
+
+#define KERNEL_CAT_(a, b) a##b
+#define KERNEL_CAT(a, b) KERNEL_CAT_(a, b)
+#define KERNEL(name) KERNEL_CAT(name, KERNEL_SUFFIX)
+#define KVec KERNEL(FFIVecF)
+#define KMask KERNEL(FFIVecI)
+
+typedef float KVec __attribute__((vector_size(KERNEL_LANES * sizeof(float))));
+typedef int32_t KMask __attribute__((vector_size(KERNEL_LANES * sizeof(float))));
+
+KERNEL_TARGET static inline KVec KERNEL(kLoad)(const float* p) {
+    KVec v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+KERNEL_TARGET static inline void KERNEL(kStore)(float* p, KVec v) {
+    memcpy(p, &v, sizeof(v));
+}
+
+KERNEL_TARGET static inline KVec KERNEL(kSplat)(float value) {
+    KVec v;
+    for (int i = 0; i < KERNEL_LANES; i++) v[i] = value;
+    return v;
+}
+
+// Lanes of [a] where [mask] is set, lanes of [b] elsewhere
+KERNEL_TARGET static inline KVec KERNEL(kSelect)(KMask mask, KVec a, KVec b) {
+    return (KVec)((mask & (KMask)a) | (~mask & (KMask)b));
+}
+
+KERNEL_TARGET static void KERNEL(ffiFill)(float* y, size_t n, float value) {
+    KVec v = KERNEL(kSplat)(value);
+    size_t i = 0;
+    for (; i + KERNEL_LANES <= n; i += KERNEL_LANES) KERNEL(kStore)(y + i, v);
+    for (; i < n; i++) y[i] = value;
+}
+
+KERNEL_TARGET static void KERNEL(ffiAxpy)(float* y, const float* x, size_t n, float a) {
+    KVec va = KERNEL(kSplat)(a);
+    size_t i = 0;
+    for (; i + KERNEL_LANES <= n; i += KERNEL_LANES) {
+        KERNEL(kStore)(y + i, va * KERNEL(kLoad)(x + i) + KERNEL(kLoad)(y + i));
+    }
+    for (; i < n; i++) y[i] = a * x[i] + y[i];
+}
+
+KERNEL_TARGET static void KERNEL(ffiClamp)(float* y, size_t n, float lo, float hi) {
+    KVec vlo = KERNEL(kSplat)(lo);
+    KVec vhi = KERNEL(kSplat)(hi);
+    size_t i = 0;
+    for (; i + KERNEL_LANES <= n; i += KERNEL_LANES) {
+        KVec v = KERNEL(kLoad)(y + i);
+        v = KERNEL(kSelect)(v < vlo, vlo, KERNEL(kSelect)(v > vhi, vhi, v));
+        KERNEL(kStore)(y + i, v);
+    }
+    for (; i < n; i++) y[i] = y[i] < lo ? lo : y[i] > hi ? hi : y[i];
+}
+
+KERNEL_TARGET static void KERNEL(ffiAdd)(float* y, const float* x, size_t n) {
+    size_t i = 0;
+    for (; i + KERNEL_LANES <= n; i += KERNEL_LANES) {
+        KERNEL(kStore)(y + i, KERNEL(kLoad)(y + i) + KERNEL(kLoad)(x + i));
+    }
+    for (; i < n; i++) y[i] += x[i];
+}
+
+KERNEL_TARGET static void KERNEL(ffiMul)(float* y, const float* x, size_t n) {
+    size_t i = 0;
+    for (; i + KERNEL_LANES <= n; i += KERNEL_LANES) {
+        KERNEL(kStore)(y + i, KERNEL(kLoad)(y + i) * KERNEL(kLoad)(x + i));
+    }
+    for (; i < n; i++) y[i] *= x[i];
+}
+
+KERNEL_TARGET static void KERNEL(ffiAddScalar)(float* y, size_t n, float value) {
+    KVec v = KERNEL(kSplat)(value);
+    size_t i = 0;
+    for (; i + KERNEL_LANES <= n; i += KERNEL_LANES) KERNEL(kStore)(y + i, KERNEL(kLoad)(y + i) + v);
+    for (; i < n; i++) y[i] += value;
+}
+
+KERNEL_TARGET static void KERNEL(ffiMulScalar)(float* y, size_t n, float value) {
+    KVec v = KERNEL(kSplat)(value);
+    size_t i = 0;
+    for (; i + KERNEL_LANES <= n; i += KERNEL_LANES) KERNEL(kStore)(y + i, KERNEL(kLoad)(y + i) * v);
+    for (; i < n; i++) y[i] *= value;
+}
+
+// Positions past a bound are put back on it and their velocity is turned
+// to point inside, like the wall checks of bounce.wren
+KERNEL_TARGET static void KERNEL(ffiBounce)(float* pos, float* vel, size_t n, float lo, float hi) {
+    KVec vlo = KERNEL(kSplat)(lo);
+    KVec vhi = KERNEL(kSplat)(hi);
+    KMask noSign = (KMask)KERNEL(kSplat)(0) | 0x7fffffff;
+    size_t i = 0;
+    for (; i + KERNEL_LANES <= n; i += KERNEL_LANES) {
+        KVec p = KERNEL(kLoad)(pos + i);
+        KVec v = KERNEL(kLoad)(vel + i);
+        KMask below = p < vlo;
+        KMask above = p > vhi;
+        KVec speed = (KVec)((KMask)v & noSign);
+        KERNEL(kStore)(pos + i, KERNEL(kSelect)(below, vlo, KERNEL(kSelect)(above, vhi, p)));
+        KERNEL(kStore)(vel + i, KERNEL(kSelect)(below, speed, KERNEL(kSelect)(above, -speed, v)));
+    }
+    for (; i < n; i++) {
+        if (pos[i] < lo) {
+            pos[i] = lo;
+            vel[i] = fabsf(vel[i]);
+        } else if (pos[i] > hi) {
+            pos[i] = hi;
+            vel[i] = -fabsf(vel[i]);
+        }
+    }
+}
+
+// Reductions keep one partial result per lane and combine them at the end
+KERNEL_TARGET static double KERNEL(ffiSum)(const float* x, size_t n) {
+    KVec acc = KERNEL(kSplat)(0);
+    size_t i = 0;
+    for (; i + KERNEL_LANES <= n; i += KERNEL_LANES) acc += KERNEL(kLoad)(x + i);
+    float sum = 0;
+    for (int lane = 0; lane < KERNEL_LANES; lane++) sum += acc[lane];
+    for (; i < n; i++) sum += x[i];
+    return sum;
+}
+
+KERNEL_TARGET static double KERNEL(ffiDot)(const float* x, const float* y, size_t n) {
+    KVec acc = KERNEL(kSplat)(0);
+    size_t i = 0;
+    for (; i + KERNEL_LANES <= n; i += KERNEL_LANES) acc += KERNEL(kLoad)(x + i) * KERNEL(kLoad)(y + i);
+    float sum = 0;
+    for (int lane = 0; lane < KERNEL_LANES; lane++) sum += acc[lane];
+    for (; i < n; i++) sum += x[i] * y[i];
+    return sum;
+}
+
+// Minimum and maximum of a non-empty range
+KERNEL_TARGET static float KERNEL(ffiMin)(const float* x, size_t n) {
+    KVec acc = KERNEL(kSplat)(x[0]);
+    size_t i = 0;
+    for (; i + KERNEL_LANES <= n; i += KERNEL_LANES) {
+        KVec v = KERNEL(kLoad)(x + i);
+        acc = KERNEL(kSelect)(v < acc, v, acc);
+    }
+    float result = acc[0];
+    for (int lane = 1; lane < KERNEL_LANES; lane++) if (acc[lane] < result) result = acc[lane];
+    for (; i < n; i++) if (x[i] < result) result = x[i];
+    return result;
+}
+
+KERNEL_TARGET static float KERNEL(ffiMax)(const float* x, size_t n) {
+    KVec acc = KERNEL(kSplat)(x[0]);
+    size_t i = 0;
+    for (; i + KERNEL_LANES <= n; i += KERNEL_LANES) {
+        KVec v = KERNEL(kLoad)(x + i);
+        acc = KERNEL(kSelect)(v > acc, v, acc);
+    }
+    float result = acc[0];
+    for (int lane = 1; lane < KERNEL_LANES; lane++) if (acc[lane] > result) result = acc[lane];
+    for (; i < n; i++) if (x[i] > result) result = x[i];
+    return result;
+}
+
+static const FFIKernels KERNEL(ffiKernels) = {
+    KERNEL_NAME,
+    KERNEL(ffiFill),
+    KERNEL(ffiAxpy),
+    KERNEL(ffiClamp),
+    KERNEL(ffiAdd),
+    KERNEL(ffiMul),
+    KERNEL(ffiAddScalar),
+    KERNEL(ffiMulScalar),
+    KERNEL(ffiBounce),
+    KERNEL(ffiSum),
+    KERNEL(ffiDot),
+    KERNEL(ffiMin),
+    KERNEL(ffiMax),
+};
+
+#undef KVec
+#undef KMask
+#undef KERNEL
+#undef KERNEL_CAT
+#undef KERNEL_CAT_
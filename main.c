@@ -2,12 +2,21 @@
 
 #include <wren.h>
 
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <math.h>
 
 #include <dlfcn.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <ffi.h>
 
@@ -16,753 +25,5374 @@
 // Include debug functions
 #include "wren/src/vm/wren_debug.h"
 
+// Shared library in the process-wide registry, see acquireFFILibrary
+typedef struct FFILibrary FFILibrary;
+
+// #!extern attributes of one method, or of the class when they are defaults
+// for all its methods. Strings point into the index of the class.
+typedef struct {
+    const char* signature;     // Method signature such as DrawText(_,_,_,_,_)
+    bool isStatic;
+    const char* dll;
+    const char* args;
+    const char* ret;
+    bool batch;
+    bool async;
+    bool hasBatch;             // batch or async was given, false included, over the class default
+    bool hasAsync;
+    bool frame;
+    bool init;                 // init=true: the result fills the payload of the receiver
+    bool pure;                 // pure=true: results are memoized, see FFIMemoCache
+} FFIExternSpec;
+
+// Native payload of the instances of an FFI class declared with
+// #!payload(struct="Texture"). Slots are carved out of slabs of
+// FFI_PAYLOAD_SLAB_SLOTS and go back on a free list when their instance is
+// finalized, after the #!destructor function ran on them.
+#define FFI_PAYLOAD_SLAB_SLOTS 64
+
+typedef struct FFIPayloadPool FFIPayloadPool;
+
+typedef struct FFIPayloadSlot {
+    FFIPayloadPool* pool;
+    struct FFIPayloadSlot* next;   // Next free slot while on the free list
+    bool initialized;              // Filled by an init=true method, the destructor may run on it
+    uint8_t bytes[];               // Payload, zeroed when the slot is taken
+} FFIPayloadSlot;
+
+struct FFIPayloadPool {
+    bool prepared;             // Attributes were read on the first allocation
+    struct FFIStructType* type; // NULL for classes without a payload
+    size_t stride;             // Bytes per slot, header included
+    uint8_t** slabs;
+    int slabCount;
+    FFIPayloadSlot* free;
+    // #!destructor, called with the payload's address or with the payload by value
+    void* destructor;
+    ffi_cif destructorCif;
+    ffi_type* destructorArgTypes[1];
+    bool byValue;
+    bool initRequired;         // The class has init=true methods, only payloads they filled are destroyed
+};
+
 // Structure to store FFI class information
 typedef struct {
     char* className;
     char* moduleName;
     ObjClass* classObj;
-    // Simple DLL handle cache - array of name->handle pairs
-    struct {
-        char* dllName;
-        void* handle;
-    } dllHandles[10];  // Support up to 10 different DLLs per class
-    int dllHandleCount;
+    // Libraries the class's methods use, each holding one reference
+    FFILibrary** libraries;
+    int libraryCount;
+    int libraryCapacity;
+    bool structsRegistered;    // #!struct declarations of the class were read
+    bool librariesRegistered;  // #!library options of the class were read
+    // #!extern attributes of the methods sorted by signature, and of the
+    // class, read in one pass the first time a method needs them. The
+    // specs and their strings share the one allocation [externArena].
+    bool externsIndexed;
+    FFIExternSpec* externs;
+    int externCount;
+    FFIExternSpec classExtern;
+    void* externArena;
+    // #!payload and #!destructor, read with the index. [payloadArgs] is the
+    // implicit first argument of instance methods: "ptr", or the struct name
+    // when the payload is passed by value.
+    const char* payloadStruct;
+    const char* payloadArgs;
+    bool payloadByValue;
+    const char* destructorFn;
+    const char* destructorDll;
+    FFIPayloadPool payload;
 } FFIClassInfo;
 
+// Type tags for arguments and return values of FFI calls, parsed once from
+// the args/ret strings of the #!extern attribute
+typedef enum {
+    FT_VOID,
+    FT_I32,
+    FT_I64,
+    FT_F32,
+    FT_F64,
+    FT_BOOL,
+    FT_STRING,
+    FT_PTR,
+    FT_I8,
+    FT_U8,
+    FT_I16,
+    FT_U16,
+    FT_U32,
+    FT_STRUCT,   // Passed by value, layout given by an FFIStructType
+    FT_CALLBACK, // Wren Fn passed as a C function pointer, see FFICallbackType
+} FFITypeTag;
+
+// Wren methods take at most 16 parameters, so do FFI calls
+#define FFI_MAX_ARGS 16
+
+// One marshalled argument or return value of an FFI call, the active member
+// is given by the FFITypeTag of the matching position in the descriptor
+typedef union {
+    int32_t i32;
+    int64_t i64;
+    float f32;
+    double f64;
+    uint8_t u8;
+    void* ptr;
+    ffi_arg ret;
+} FFIValue;
+
+// Struct type declared with #!struct(name="Vector2", fields="f32,f32") on an
+// FFI class. The ffi_type layout is built once and shared by every method
+// that passes or returns the struct by value.
+typedef struct FFIStructType {
+    char* name;
+    int fieldCount;
+    FFITypeTag* fieldTags;
+    struct FFIStructType** fieldStructs;  // Layout of FT_STRUCT fields, NULL otherwise
+    size_t* offsets;                      // Byte offset of each field
+    ffi_type type;                        // FFI_TYPE_STRUCT with size and alignment
+    ffi_type** elements;                  // NULL terminated field types of [type]
+} FFIStructType;
+
+// Callback type declared with #!callback(name="TraceLog", args="i32,char*,ptr")
+// on an FFI class and used by name in args. A Fn passed for it is bound to
+// a closure of a preallocated pool, which calls the Fn through a cached call
+// handle, so firing a callback allocates neither.
+typedef struct FFICallbackSlot FFICallbackSlot;
+
+typedef struct {
+    char* name;
+    int argCount;
+    FFITypeTag* argTags;
+    ffi_type** argTypes;
+    FFITypeTag retTag;
+    ffi_cif cif;
+    // Closure pool, grown by FFI_CALLBACK_POOL_SIZE slots at a time
+    FFICallbackSlot** blocks;
+    int blockCount;
+} FFICallbackType;
+
+// Struct arguments of one call are packed into a scratch buffer on the C
+// stack, so are struct return values
+#define FFI_STRUCT_SCRATCH_SIZE 1024
+
+typedef union {
+    uint8_t bytes[FFI_STRUCT_SCRATCH_SIZE];
+    long double align;
+    void* ptr;
+} FFIStructScratch;
+
+// Direct-call thunk: casts [fn] to the exact C prototype of one signature
+// shape and calls it with the marshalled arguments, bypassing ffi_call
+typedef void (*FFIThunk)(void* fn, const FFIValue* args, FFIValue* result);
+
+// Thunks for every shape of up to FFI_THUNK_MAX_ARGS scalar arguments,
+// generated at build time by tools/gen_thunks.sh
+#include "ffi_thunks.h"
+
+// The thunks and the widened integer arguments follow the x86_64 SysV ABI,
+// other targets always call through ffi_call
+#if defined(__x86_64__) && !defined(_WIN32)
+#define FFI_DIRECT_THUNKS 1
+#else
+#define FFI_DIRECT_THUNKS 0
+#endif
+
+// Results of a pure=true method, keyed on the marshalled arguments with the
+// contents of strings, structs and the receiver's payload. Entries with the
+// same hash modulo FFI_MEMO_BUCKETS are chained, and when the cache is full
+// the least recently used entry makes room. Calls with a key longer than
+// FFI_MEMO_KEY_SIZE or with a callback argument are not memoized.
+#define FFI_MEMO_SIZE 64
+#define FFI_MEMO_BUCKETS 128
+#define FFI_MEMO_KEY_SIZE 1024
+
+typedef struct {
+    uint8_t* key;              // Key, then the bytes of a struct result. NULL marks an empty entry
+    uint32_t keyLength;
+    uint32_t hash;
+    uint64_t lastUse;
+    int next;                  // Next entry of the bucket, -1 at the end
+    Value value;               // Result other than a struct
+    WrenHandle* handle;        // Keeps a String result alive
+} FFIMemoEntry;
+
+typedef struct {
+    FFIMemoEntry entries[FFI_MEMO_SIZE];
+    int buckets[FFI_MEMO_BUCKETS];
+    int count;
+    uint64_t clock;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t invalidated;      // Entries dropped by FFI.invalidate
+} FFIMemoCache;
+
 // Structure to store FFI method information
 typedef struct {
     char* methodName;
     char* signature;
     ObjClass* classObj;
     uint16_t symbol;
-    // Store extracted FFI attributes
-    char* dllName;
-    char* argsSignature;
-    char* retSignature;
+    // #!extern attributes, pointing into the index of the class
+    const char* dllName;
+    const char* argsSignature;
+    const char* retSignature;
     bool attributesExtracted;  // Flag to indicate if attributes have been extracted
+    // Compiled call descriptor, built on the first call and reused afterwards
+    bool compiled;             // Flag to indicate if the descriptor below is ready
+    void* fnPtr;               // Resolved function pointer from dlsym
+    ffi_cif cif;               // Prepared libffi call interface
+    int argCount;
+    FFITypeTag* argTags;       // Type tag of each argument
+    ffi_type** argTypes;       // libffi type of each argument, referenced by cif
+    FFIStructType** argStructs; // Struct type of FT_STRUCT arguments, NULL otherwise
+    FFICallbackType** argCallbacks; // Callback type of FT_CALLBACK arguments, NULL otherwise
+    FFITypeTag retTag;
+    FFIStructType* retStruct;  // Struct type of an FT_STRUCT return value
+    FFIThunk thunk;            // Direct-call thunk for this shape, NULL to use ffi_call
+    bool batch;                // #!extern(batch=true): calls are recorded, not run
+    bool async;                // #!extern(async=true): calls run on a worker thread
+    bool frame;                // #!extern(frame=true): a call ends a frame, see endWreniFrame
+    bool payloadArg;           // The receiver's payload is the implicit first argument
+    bool init;                 // #!extern(init=true): the result fills the receiver's payload
+    bool pure;                 // #!extern(pure=true): results are memoized by argument values
+    FFIMemoCache* memo;        // Made on the first call of a pure method with a result
+    // Per-method entry point handed to Wren, knows its FFIMethodInfo
+    bool isStatic;
+    int arity;
+    ffi_closure* closure;
+    WrenForeignMethodFn entry;
 } FFIMethodInfo;
 
-// Global list to store FFI classes
-#define MAX_FFI_CLASSES 100
-static FFIClassInfo ffiClasses[MAX_FFI_CLASSES];
-static int ffiClassCount = 0;
+// Open-addressing hash table keyed on (pointer, symbol), used to index FFI
+// methods by (ObjClass*, symbol) and FFI classes by their ObjClass*.
+// Capacity is a power of two and collisions are resolved by linear probing.
+typedef struct {
+    const void* key;       // NULL marks an empty slot
+    uint32_t symbol;
+    uint32_t hash;
+    void* value;
+} FFIKeySlot;
 
-// Global list to store FFI methods
-#define MAX_FFI_METHODS 100
-static FFIMethodInfo ffiMethods[MAX_FFI_METHODS];
-static int ffiMethodCount = 0;
+typedef struct {
+    FFIKeySlot* slots;
+    uint32_t capacity;
+    uint32_t count;
+} FFIKeyTable;
 
-// Forward declarations for functions that need these structs
-FFIClassInfo* findFFIClassByObject(ObjClass* classObj);
+// Open-addressing hash table indexing FFI classes by (module, class) name
+typedef struct {
+    uint32_t hash;
+    FFIClassInfo* info;    // NULL marks an empty slot
+} FFINameSlot;
 
-// Function to store FFI class information
-void storeFFIClass(WrenVM* vm, const char* className, const char* moduleName, ObjClass* classObj) {
-    if (ffiClassCount >= MAX_FFI_CLASSES) {
-        fprintf(stderr, "Too many FFI classes stored\n");
-        return;
+typedef struct {
+    FFINameSlot* slots;
+    uint32_t capacity;
+    uint32_t count;
+} FFINameTable;
+
+#define FFI_TABLE_MIN_CAPACITY 16
+
+// Types of the per-VM state below that are defined further down
+typedef struct FFIBufferBlock FFIBufferBlock;
+typedef struct MappedModule MappedModule;
+
+// Native command buffer of batched FFI calls. Each record is the method
+// followed by its marshalled arguments. String and struct arguments are
+// copied into [arena] since the Wren objects and the C stack they were
+// marshalled from are gone by the time of the replay.
+typedef struct {
+    FFIMethodInfo* method;
+    FFIValue args[];
+} FFIBatchRecord;
+
+typedef struct {
+    uint8_t* data;
+    size_t size;
+    size_t capacity;
+    uint8_t* arena;
+    size_t arenaSize;
+    size_t arenaCapacity;
+    FFIBufferBlock** retained; // Buffers passed to recorded calls, kept alive
+    uint32_t retainedCount;
+    size_t retainedCapacity;   // In bytes, like the other buffers
+    uint32_t count;            // Number of recorded calls
+    int depth;                 // Nesting depth of FFI.batch blocks
+} FFIBatch;
+
+// Cache of the Wren strings made from returned C strings. Functions often
+// return the same static or internal buffer frame after frame, an entry is
+// reused while the pointer and the contents still match, so no new
+// ObjString is allocated. Direct mapped, a colliding string replaces the entry.
+#define FFI_STRING_CACHE_SIZE 256
+
+typedef struct {
+    const char* ptr;           // Returned pointer, NULL marks an empty entry
+    uint32_t hash;             // FNV-1a of the contents
+    uint32_t length;
+    WrenHandle* string;        // Keeps the ObjString alive while cached
+} FFIStringCacheEntry;
+
+typedef struct {
+    FFIStringCacheEntry entries[FFI_STRING_CACHE_SIZE];
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+} FFIStringCache;
+
+// Calls of async=true methods made by one VM. Workers move a call to
+// [completed] when it returns, FFI.poll moves it on to [done] where its
+// result waits for FFI.await.
+typedef struct FFIAsyncCall FFIAsyncCall;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t finished;   // Signalled whenever a call completes
+    FFIAsyncCall* completed;   // Returned, not polled yet, oldest first
+    FFIAsyncCall* completedTail;
+    int running;               // Submitted, not returned yet
+    FFIAsyncCall* done;        // Polled, only touched by the VM's thread
+    uint32_t nextId;
+} FFIAsyncQueue;
+
+// Frame statistics, enabled with WRENI_FRAME_STATS. A frame ends with each
+// call of a frame=true method and counts the FFI calls made since the last
+// one. Wren has no hook for collections: when the host schedules them they
+// are counted, otherwise one is seen when the heap shrinks or its next
+// collection threshold moves.
+typedef struct {
+    uint64_t ns;               // Time since the end of the previous frame
+    uint32_t calls;            // FFI calls made during the frame
+    uint32_t allocations;      // Heap blocks allocated during the frame, see WreniHeap
+    bool collected;            // A collection ran during the frame
+    size_t heapBytes;          // Heap size at the end of the frame
+} WreniFrame;
+
+typedef struct {
+    bool enabled;
+    uint64_t calls;            // FFI calls since the end of the last frame
+    struct timespec last;      // End of the last frame, zero before the first
+    size_t lastBytes;
+    size_t lastNextGC;
+    uint64_t lastAllocations;
+    uint64_t lastCollections;
+    WreniFrame* frames;
+    int count;
+    int capacity;
+} WreniFrameStats;
+
+// Wren heap of one VM, used when WRENI_ALLOCATOR=pool. Blocks of up to
+// WRENI_POOL_MAX_SIZE bytes are rounded up to a multiple of
+// WRENI_POOL_GRANULE and kept on one free list per size class, new ones are
+// bumped out of chunks of WRENI_POOL_CHUNK_SIZE. Larger blocks go to malloc.
+// Wren's reallocateFn is not told the old size, so every block starts with a
+// WreniBlock header.
+#define WRENI_POOL_GRANULE 16
+#define WRENI_POOL_MAX_SIZE 512
+#define WRENI_POOL_CLASSES (WRENI_POOL_MAX_SIZE / WRENI_POOL_GRANULE)
+#define WRENI_POOL_CHUNK_SIZE (64 * 1024)
+
+typedef struct {
+    size_t size;               // Requested size
+    size_t sizeClass;          // Index of the free list, WRENI_POOL_CLASSES for malloc
+} WreniBlock;
+
+typedef struct WreniFreeBlock {
+    struct WreniFreeBlock* next;
+} WreniFreeBlock;
+
+typedef struct {
+    bool enabled;
+    WreniFreeBlock* freeLists[WRENI_POOL_CLASSES];
+    uint8_t* bump;
+    uint8_t* bumpEnd;
+    void** chunks;
+    int chunkCount;
+    int chunkCapacity;
+    size_t liveBytes;          // Requested bytes of live blocks
+    size_t reservedBytes;      // Chunks and malloc blocks, headers included
+    uint64_t allocations;
+    uint64_t frees;
+} WreniHeap;
+
+// Collections of one VM when the host schedules them, see collectWreniGarbage.
+// Wren collects whenever its heap crosses vm->nextGC, which is then kept out
+// of reach while the host checks [threshold] itself and times each pause.
+typedef struct {
+    uint64_t ns;
+    size_t before;             // Heap bytes before and after the collection
+    size_t after;
+    uint32_t frame;            // Frames ended before it, see endWreniFrame
+    bool atBoundary;           // Run at a frame boundary rather than mid-frame
+} WreniGCPause;
+
+typedef struct {
+    bool managed;
+    bool frameMode;            // Defer collections to frame boundaries
+    bool collecting;
+    int held;                  // Collections are held off while above 0, see rebuildModuleFromCache
+    WrenVM* vm;                // Set once the VM exists
+    size_t threshold;          // Heap size of the next collection
+    size_t frameStartBytes;    // Heap size when the current frame began
+    uint32_t frame;
+    uint64_t collections;
+    WreniGCPause* pauses;
+    int pauseCount;
+    int pauseCapacity;
+} WreniGC;
+
+// State of the host for one VM: the registries of its FFI classes and
+// methods, its batch and string cache and its loader. It is the VM's user
+// data, so VMs on different threads share nothing but the read-mostly
+// process-wide libraries, struct layouts and call descriptors, which have
+// their own locks. The info structs are allocated one by one so pointers to
+// them stay valid when a table grows.
+typedef struct {
+    FFINameTable classesByName;
+    FFIKeyTable classesByObject;
+    FFIKeyTable methods;
+    // Classes waiting for eager binding, see resolveFFIBindings
+    FFIClassInfo** pendingClasses;
+    int pendingClassCount;
+    int pendingClassCapacity;
+    ObjClass* bufferClass;     // Class of Buffer, known once the first buffer is allocated
+    FFIBatch batch;
+    FFIStringCache stringCache;
+    FFIAsyncQueue async;
+    WreniFrameStats frames;
+    WreniHeap heap;
+    WreniGC gc;
+    // Call handles of callbacks by arity, made when a callback is first bound
+    WrenHandle* callHandles[FFI_MAX_ARGS + 1];
+    int callbackDepth;         // Callbacks running inside each other
+    MappedModule* prefetchedModules; // Modules mapped ahead of the compiler asking for them
+    FFIMethodInfo** aotMethods; // Methods of AOT bindings by binding index, see recordAOTCall
+} WreniContext;
+
+// Helper function to get the host state of a VM
+static inline WreniContext* getWreniContext(WrenVM* vm) {
+    return (WreniContext*)wrenGetUserData(vm);
+}
+
+// Allocator of new VMs, the pool allocator with WRENI_ALLOCATOR=pool,
+// Wren's default realloc otherwise
+static bool wreniPoolAllocator = false;
+
+// Frame statistics of new VMs, WRENI_FRAME_STATS. They count heap blocks,
+// so malloc VMs get a counting reallocateFn too.
+static bool wreniFrameStats = false;
+
+// Helper function to take a block of a size class from its free list, or
+// bump it out of the current chunk
+static WreniBlock* takeWreniBlock(WreniHeap* heap, size_t sizeClass) {
+    WreniFreeBlock* free = heap->freeLists[sizeClass];
+    if (free != NULL) {
+        heap->freeLists[sizeClass] = free->next;
+        return (WreniBlock*)free;
     }
     
-    ffiClasses[ffiClassCount].className = strdup(className);
-    ffiClasses[ffiClassCount].moduleName = strdup(moduleName);
-    ffiClasses[ffiClassCount].classObj = classObj;
-    ffiClasses[ffiClassCount].dllHandleCount = 0;  // Initialize DLL handle count
+    size_t blockSize = sizeof(WreniBlock) + (sizeClass + 1) * WRENI_POOL_GRANULE;
+    if ((size_t)(heap->bumpEnd - heap->bump) < blockSize) {
+        // The rest of the old chunk is left unused
+        if (heap->chunkCount == heap->chunkCapacity) {
+            int capacity = heap->chunkCapacity == 0 ? 16 : heap->chunkCapacity * 2;
+            void** chunks = realloc(heap->chunks, capacity * sizeof(void*));
+            if (chunks == NULL) return NULL;
+            heap->chunks = chunks;
+            heap->chunkCapacity = capacity;
+        }
+        uint8_t* chunk = malloc(WRENI_POOL_CHUNK_SIZE);
+        if (chunk == NULL) return NULL;
+        heap->chunks[heap->chunkCount++] = chunk;
+        heap->reservedBytes += WRENI_POOL_CHUNK_SIZE;
+        heap->bump = chunk;
+        heap->bumpEnd = chunk + WRENI_POOL_CHUNK_SIZE;
+    }
     
-    fprintf(stderr, "Stored FFI class: module='%s', class='%s'\n", moduleName, className);
-    ffiClassCount++;
+    WreniBlock* block = (WreniBlock*)heap->bump;
+    heap->bump += blockSize;
+    return block;
 }
 
-// Function to find an FFI class by name
-FFIClassInfo* findFFIClass(const char* moduleName, const char* className) {
-    for (int i = 0; i < ffiClassCount; i++) {
-        if (strcmp(ffiClasses[i].moduleName, moduleName) == 0 && 
-            strcmp(ffiClasses[i].className, className) == 0) {
-            return &ffiClasses[i];
-        }
+// Helper function to allocate a block of [size] bytes, NULL when out of memory
+static WreniBlock* allocateWreniBlock(WreniHeap* heap, size_t size) {
+    size_t sizeClass = (size + WRENI_POOL_GRANULE - 1) / WRENI_POOL_GRANULE - 1;
+    WreniBlock* block;
+    if (size <= WRENI_POOL_MAX_SIZE) {
+        block = takeWreniBlock(heap, sizeClass);
+    } else {
+        sizeClass = WRENI_POOL_CLASSES;
+        block = malloc(sizeof(WreniBlock) + size);
+        if (block != NULL) heap->reservedBytes += sizeof(WreniBlock) + size;
     }
-    return NULL;
+    if (block == NULL) return NULL;
+    
+    block->size = size;
+    block->sizeClass = sizeClass;
+    heap->liveBytes += size;
+    heap->allocations++;
+    return block;
 }
 
-// Function to add a method to the FFI method list
-void addFFIMethod(const char* methodName, const char* signature, ObjClass* classObj, uint16_t symbol) {
-    if (ffiMethodCount >= MAX_FFI_METHODS) {
-        fprintf(stderr, "Warning: Maximum FFI methods reached, cannot add %s\n", methodName);
+// Helper function to put a block back on its free list, or free it
+static void releaseWreniBlock(WreniHeap* heap, WreniBlock* block) {
+    heap->liveBytes -= block->size;
+    heap->frees++;
+    if (block->sizeClass == WRENI_POOL_CLASSES) {
+        heap->reservedBytes -= sizeof(WreniBlock) + block->size;
+        free(block);
         return;
     }
+    WreniFreeBlock* free = (WreniFreeBlock*)block;
+    free->next = heap->freeLists[block->sizeClass];
+    heap->freeLists[block->sizeClass] = free;
+}
+
+// Function used as the reallocateFn of VMs with the pool allocator, with
+// realloc semantics. [userData] is the VM's WreniContext.
+static void* reallocateWreniHeap(void* memory, size_t newSize, void* userData) {
+    WreniHeap* heap = &((WreniContext*)userData)->heap;
+    WreniBlock* block = memory != NULL ? (WreniBlock*)memory - 1 : NULL;
+    if (newSize == 0) {
+        if (block != NULL) releaseWreniBlock(heap, block);
+        return NULL;
+    }
     
-    // Allocate memory for method name and signature
-    ffiMethods[ffiMethodCount].methodName = strdup(methodName);
-    ffiMethods[ffiMethodCount].signature = strdup(signature);
-    ffiMethods[ffiMethodCount].classObj = classObj;
-    ffiMethods[ffiMethodCount].symbol = symbol;
+    // Resizing within a size class keeps the block
+    if (block != NULL && newSize <= WRENI_POOL_MAX_SIZE && block->sizeClass != WRENI_POOL_CLASSES &&
+        (newSize + WRENI_POOL_GRANULE - 1) / WRENI_POOL_GRANULE - 1 == block->sizeClass) {
+        heap->liveBytes += newSize - block->size;
+        block->size = newSize;
+        return memory;
+    }
     
-    // Initialize FFI attribute fields
-    ffiMethods[ffiMethodCount].dllName = NULL;
-    ffiMethods[ffiMethodCount].argsSignature = NULL;
-    ffiMethods[ffiMethodCount].retSignature = NULL;
-    ffiMethods[ffiMethodCount].attributesExtracted = false;
+    WreniBlock* newBlock = allocateWreniBlock(heap, newSize);
+    if (newBlock == NULL) return NULL;
+    if (block != NULL) {
+        memcpy(newBlock + 1, memory, block->size < newSize ? block->size : newSize);
+        releaseWreniBlock(heap, block);
+    }
+    return newBlock + 1;
+}
+
+// Helper function to get the share of the reserved heap not holding live data
+static double getWreniHeapFragmentation(WreniHeap* heap) {
+    return heap->reservedBytes > 0 ? 1.0 - (double)heap->liveBytes / heap->reservedBytes : 0;
+}
+
+// Helper function to free the chunks of a heap once its VM is gone
+static void freeWreniHeap(WreniHeap* heap) {
+    for (int i = 0; i < heap->chunkCount; i++) {
+        free(heap->chunks[i]);
+    }
+    free(heap->chunks);
+}
+
+// Helper function to parse a byte size such as 512K, 4M or 1G
+static size_t parseWreniSize(const char* text) {
+    char* end;
+    double size = strtod(text, &end);
+    switch (*end) {
+        case 'k': case 'K': size *= 1024; break;
+        case 'm': case 'M': size *= 1024 * 1024; break;
+        case 'g': case 'G': size *= 1024 * 1024 * 1024; break;
+    }
+    return size > 0 ? (size_t)size : 0;
+}
+
+// Options of the collector of new VMs, set from the command line. Sizes of 0
+// keep Wren's defaults.
+typedef struct {
+    size_t initialHeapSize;
+    size_t minHeapSize;
+    int heapGrowthPercent;
+    bool frameMode;            // --gc-frame
+    bool stats;                // --gc-stats
+    const char* logPath;       // --gc-log
+} WreniGCOptions;
+
+static WreniGCOptions wreniGCOptions;
+
+// In frame mode a collection runs mid-frame only once the heap is this many
+// percent past its threshold
+#define WRENI_GC_FRAME_SLACK 50
+
+// Function to run and time a collection of a VM whose collections the host
+// schedules, then move Wren's own trigger out of reach again
+static void collectWreniGarbage(WrenVM* vm, bool atBoundary) {
+    WreniGC* gc = &getWreniContext(vm)->gc;
+    struct timespec start, end;
+    size_t before = vm->bytesAllocated;
+    
+    gc->collecting = true;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    wrenCollectGarbage(vm);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    gc->collecting = false;
     
-    ffiMethodCount++;
+    gc->threshold = vm->nextGC;
+    vm->nextGC = SIZE_MAX;
+    gc->collections++;
+    
+    if (gc->pauseCount == gc->pauseCapacity) {
+        int capacity = gc->pauseCapacity == 0 ? 64 : gc->pauseCapacity * 2;
+        WreniGCPause* pauses = realloc(gc->pauses, capacity * sizeof(WreniGCPause));
+        if (pauses == NULL) return;
+        gc->pauses = pauses;
+        gc->pauseCapacity = capacity;
+    }
+    WreniGCPause* pause = &gc->pauses[gc->pauseCount++];
+    pause->ns = (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000u + (end.tv_nsec - start.tv_nsec);
+    pause->before = before;
+    pause->after = vm->bytesAllocated;
+    pause->frame = gc->frame;
+    pause->atBoundary = atBoundary;
 }
 
-// Function to extract and store FFI attributes for a method
-static void extractAndStoreFFIAttributes(WrenVM* vm, FFIMethodInfo* methodInfo, const char* methodName) {
-    if (methodInfo == NULL || methodInfo->attributesExtracted) {
-        return; // Already extracted or invalid
+// Function used as the reallocateFn of VMs with the pool allocator or a host
+// scheduled collector. It collects where Wren would, before an allocation
+// that takes the heap past the threshold, raised by WRENI_GC_FRAME_SLACK in
+// frame mode. Allocations of the collection itself don't collect, nor do
+// allocations while the host holds collections off.
+static void* reallocateWreni(void* memory, size_t newSize, void* userData) {
+    WreniContext* ctx = userData;
+    WreniGC* gc = &ctx->gc;
+    if (newSize > 0 && gc->vm != NULL && !gc->collecting && gc->held == 0) {
+        // System.gc() collected and set a new threshold
+        if (gc->vm->nextGC != SIZE_MAX) {
+            gc->threshold = gc->vm->nextGC;
+            gc->vm->nextGC = SIZE_MAX;
+        }
+        size_t limit = gc->threshold;
+        if (gc->frameMode) limit += gc->threshold / 100 * WRENI_GC_FRAME_SLACK;
+        if (gc->vm->bytesAllocated > limit) collectWreniGarbage(gc->vm, false);
     }
     
-    ObjClass* targetClass = methodInfo->classObj;
-    if (targetClass == NULL || targetClass->attributes == 0) {
-        return;
+    if (ctx->heap.enabled) return reallocateWreniHeap(memory, newSize, userData);
+    
+    // Blocks are counted like the pool allocator does: a block that moves is
+    // a new one and a free of the old one
+    if (newSize == 0) {
+        if (memory != NULL) ctx->heap.frees++;
+        free(memory);
+        return NULL;
+    }
+    void* block = realloc(memory, newSize);
+    if (block != NULL && block != memory) {
+        ctx->heap.allocations++;
+        if (memory != NULL) ctx->heap.frees++;
+    }
+    return block;
+}
+
+// Eager binding, enabled with --eager or WRENI_EAGER=1: FFI classes stored
+// since the last resolution wait until their module has run and their
+// attributes exist, then every method is resolved at once, see
+// resolveFFIBindings
+static bool ffiEagerBinding = false;
+
+// Debug output of the FFI registry while classes and methods are bound,
+// enabled with WRENI_DEBUG=1
+static bool wreniDebug = false;
+
+// Helper function to mix a (pointer, symbol) key into a 32-bit hash
+static inline uint32_t hashFFIKey(const void* key, uint32_t symbol) {
+    uint64_t h = (uint64_t)(uintptr_t)key ^ ((uint64_t)symbol * 0x9e3779b97f4a7c15ULL);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return (uint32_t)h;
+}
+
+// Helper function to hash a (module, class) name pair with FNV-1a
+static uint32_t hashFFIClassName(const char* moduleName, const char* className) {
+    uint32_t h = 2166136261u;
+    for (const char* p = moduleName; *p; p++) {
+        h = (h ^ (uint8_t)*p) * 16777619u;
+    }
+    // Separator so ("ab", "c") and ("a", "bc") differ
+    h = (h ^ 0xff) * 16777619u;
+    for (const char* p = className; *p; p++) {
+        h = (h ^ (uint8_t)*p) * 16777619u;
     }
+    return h;
+}
+
+static void* ffiKeyTableFind(const FFIKeyTable* table, const void* key, uint32_t symbol) {
+    if (table->count == 0) return NULL;
     
-    ObjInstance* attrInstance = AS_INSTANCE(targetClass->attributes);
+    uint32_t mask = table->capacity - 1;
+    uint32_t hash = hashFFIKey(key, symbol);
+    for (uint32_t i = hash & mask; ; i = (i + 1) & mask) {
+        FFIKeySlot* slot = &table->slots[i];
+        if (slot->key == NULL) return NULL;
+        if (slot->hash == hash && slot->key == key && slot->symbol == symbol) return slot->value;
+    }
+}
+
+static void ffiKeyTableInsertSlot(FFIKeySlot* slots, uint32_t capacity, FFIKeySlot entry) {
+    uint32_t mask = capacity - 1;
+    uint32_t i = entry.hash & mask;
+    while (slots[i].key != NULL) i = (i + 1) & mask;
+    slots[i] = entry;
+}
+
+// Inserts or replaces the value of a key, growing the table at 75% load
+static bool ffiKeyTableSet(FFIKeyTable* table, const void* key, uint32_t symbol, void* value) {
+    uint32_t hash = hashFFIKey(key, symbol);
     
-    // fields[0] is the class's attributes, fields[1] is all the methods' attributes
-    if (attrInstance->fields[1] != 0 && IS_MAP(attrInstance->fields[1])) {
-        ObjMap* methodsMap = AS_MAP(attrInstance->fields[1]);
-        
-        // Find the method key in the attributes map
-        Value methodKey;
-        bool found = false;
-        for (int i = 0; i < methodsMap->capacity; i++) {
-            MapEntry* entry = &methodsMap->entries[i];
-            if (!IS_UNDEFINED(entry->key)) {
-                if (IS_STRING(entry->key)) {
-                    ObjString* key = AS_STRING(entry->key);
-                    const char* keyStr = key->value;
-                    const char* lastSpace = strrchr(keyStr, ' ');
-                    
-                    if (lastSpace != NULL) {
-                        const char* methodSignature = lastSpace + 1;
-                        if (strcmp(methodSignature, methodName) == 0) {
-                            methodKey = entry->key;
-                            found = true;
-                            break;
-                        }
-                    }
-                }
+    if (table->count > 0) {
+        uint32_t mask = table->capacity - 1;
+        for (uint32_t i = hash & mask; table->slots[i].key != NULL; i = (i + 1) & mask) {
+            FFIKeySlot* slot = &table->slots[i];
+            if (slot->hash == hash && slot->key == key && slot->symbol == symbol) {
+                slot->value = value;
+                return true;
             }
         }
-        
-        if (found) {
-            Value methodAttrsValue = wrenMapGet(methodsMap, methodKey);
-            if (!IS_UNDEFINED(methodAttrsValue) && IS_MAP(methodAttrsValue)) {
-                ObjMap* methodAttrs = AS_MAP(methodAttrsValue);
-                
-                // Look for the 'extern' attribute
-                for (int i = 0; i < methodAttrs->capacity; i++) {
-                    MapEntry* entry = &methodAttrs->entries[i];
-                    if (!IS_UNDEFINED(entry->key) && IS_STRING(entry->key)) {
-                        ObjString* key = AS_STRING(entry->key);
-                        if (strcmp(key->value, "extern") == 0 && IS_MAP(entry->value)) {
-                            ObjMap* externMap = AS_MAP(entry->value);
-                            
-                            // Extract dll attribute
-                            Value dllKey = CONST_STRING(vm, "dll");
-                            Value dllValue = wrenMapGet(externMap, dllKey);
-                            if (!IS_UNDEFINED(dllValue) && IS_LIST(dllValue)) {
-                                ObjList* list = AS_LIST(dllValue);
-                                if (list->elements.count > 0 && IS_STRING(list->elements.data[0])) {
-                                    ObjString* value = AS_STRING(list->elements.data[0]);
-                                    methodInfo->dllName = strdup(value->value);
-                                }
-                            }
-                            
-                            // Extract args attribute
-                            Value argsKey = CONST_STRING(vm, "args");
-                            Value argsValue = wrenMapGet(externMap, argsKey);
-                            if (!IS_UNDEFINED(argsValue) && IS_LIST(argsValue)) {
-                                ObjList* list = AS_LIST(argsValue);
-                                if (list->elements.count > 0 && IS_STRING(list->elements.data[0])) {
-                                    ObjString* value = AS_STRING(list->elements.data[0]);
-                                    methodInfo->argsSignature = strdup(value->value);
-                                }
-                            }
-                            
-                            // Extract ret attribute
-                            Value retKey = CONST_STRING(vm, "ret");
-                            Value retValue = wrenMapGet(externMap, retKey);
-                            if (!IS_UNDEFINED(retValue) && IS_LIST(retValue)) {
-                                ObjList* list = AS_LIST(retValue);
-                                if (list->elements.count > 0 && IS_STRING(list->elements.data[0])) {
-                                    ObjString* value = AS_STRING(list->elements.data[0]);
-                                    methodInfo->retSignature = strdup(value->value);
-                                }
-                            }
-                            
-                            methodInfo->attributesExtracted = true;
-                            fprintf(stderr, "Extracted and cached FFI attributes for %s\n", methodName);
-                            break;
-                        }
-                    }
-                }
-            }
+    }
+    
+    if ((table->count + 1) * 4 > table->capacity * 3) {
+        uint32_t capacity = table->capacity == 0 ? FFI_TABLE_MIN_CAPACITY : table->capacity * 2;
+        FFIKeySlot* slots = calloc(capacity, sizeof(FFIKeySlot));
+        if (slots == NULL) return false;
+        for (uint32_t i = 0; i < table->capacity; i++) {
+            if (table->slots[i].key != NULL) ffiKeyTableInsertSlot(slots, capacity, table->slots[i]);
         }
+        free(table->slots);
+        table->slots = slots;
+        table->capacity = capacity;
     }
+    
+    ffiKeyTableInsertSlot(table->slots, table->capacity, (FFIKeySlot){ key, symbol, hash, value });
+    table->count++;
+    return true;
 }
 
-// Function to find an FFI method by class object and symbol
-FFIMethodInfo* findFFIMethod(ObjClass* classObj, uint16_t symbol) {
-    for (int i = 0; i < ffiMethodCount; i++) {
-        if (ffiMethods[i].classObj == classObj && ffiMethods[i].symbol == symbol) {
-            return &ffiMethods[i];
+static FFIClassInfo* ffiNameTableFind(const FFINameTable* table, const char* moduleName, const char* className) {
+    if (table->count == 0) return NULL;
+    
+    uint32_t mask = table->capacity - 1;
+    uint32_t hash = hashFFIClassName(moduleName, className);
+    for (uint32_t i = hash & mask; ; i = (i + 1) & mask) {
+        FFINameSlot* slot = &table->slots[i];
+        if (slot->info == NULL) return NULL;
+        if (slot->hash == hash &&
+            strcmp(slot->info->className, className) == 0 &&
+            strcmp(slot->info->moduleName, moduleName) == 0) {
+            return slot->info;
         }
     }
-    return NULL;
 }
 
-// Function to find an FFI class by its object pointer
-FFIClassInfo* findFFIClassByObject(ObjClass* classObj) {
-    for (int i = 0; i < ffiClassCount; i++) {
-        if (ffiClasses[i].classObj == classObj) {
-            return &ffiClasses[i];
+static bool ffiNameTableAdd(FFINameTable* table, FFIClassInfo* info) {
+    if ((table->count + 1) * 4 > table->capacity * 3) {
+        uint32_t capacity = table->capacity == 0 ? FFI_TABLE_MIN_CAPACITY : table->capacity * 2;
+        FFINameSlot* slots = calloc(capacity, sizeof(FFINameSlot));
+        if (slots == NULL) return false;
+        for (uint32_t i = 0; i < table->capacity; i++) {
+            if (table->slots[i].info == NULL) continue;
+            uint32_t j = table->slots[i].hash & (capacity - 1);
+            while (slots[j].info != NULL) j = (j + 1) & (capacity - 1);
+            slots[j] = table->slots[i];
         }
+        free(table->slots);
+        table->slots = slots;
+        table->capacity = capacity;
     }
-    return NULL;
+    
+    uint32_t hash = hashFFIClassName(info->moduleName, info->className);
+    uint32_t mask = table->capacity - 1;
+    uint32_t i = hash & mask;
+    while (table->slots[i].info != NULL) i = (i + 1) & mask;
+    table->slots[i] = (FFINameSlot){ hash, info };
+    table->count++;
+    return true;
 }
 
-// Helper function to find DLL handle in FFIClassInfo, load if not found
-static void* getOrLoadDllHandle(WrenVM* vm, FFIClassInfo* ffiClass, const char* dllName) {
-    if (ffiClass == NULL || dllName == NULL) return NULL;
-    
-    // Check if handle already cached in the array
-    for (int i = 0; i < ffiClass->dllHandleCount; i++) {
-        if (ffiClass->dllHandles[i].dllName != NULL && 
-            strcmp(ffiClass->dllHandles[i].dllName, dllName) == 0) {
-            return ffiClass->dllHandles[i].handle;
-        }
+// Function to take a class back out of the name table, the entries after it
+// in its probe run are moved up so lookups still find them
+static void ffiNameTableRemove(FFINameTable* table, FFIClassInfo* info) {
+    if (table->capacity == 0) return;
+    uint32_t mask = table->capacity - 1;
+    uint32_t i = hashFFIClassName(info->moduleName, info->className) & mask;
+    while (table->slots[i].info != info) {
+        if (table->slots[i].info == NULL) return;
+        i = (i + 1) & mask;
     }
+    table->slots[i].info = NULL;
+    table->count--;
     
-    // Load the DLL if not cached
-    if (ffiClass->dllHandleCount >= 10) {
-        fprintf(stderr, "Too many DLL handles cached for class %s\n", ffiClass->className);
-        return NULL;
+    for (uint32_t j = (i + 1) & mask; table->slots[j].info != NULL; j = (j + 1) & mask) {
+        FFINameSlot slot = table->slots[j];
+        table->slots[j].info = NULL;
+        uint32_t k = slot.hash & mask;
+        while (table->slots[k].info != NULL) k = (k + 1) & mask;
+        table->slots[k] = slot;
+    }
+}
+
+// Forward declarations for functions that need these structs
+FFIClassInfo* findFFIClassByObject(WreniContext* ctx, ObjClass* classObj);
+
+// Function to store FFI class information
+void storeFFIClass(WrenVM* vm, const char* className, const char* moduleName, ObjClass* classObj) {
+    WreniContext* ctx = getWreniContext(vm);
+    FFIClassInfo* info = calloc(1, sizeof(FFIClassInfo));
+    if (info == NULL) {
+        fprintf(stderr, "Could not allocate FFI class %s\n", className);
+        return;
     }
     
-    char libFileName[256];
-    snprintf(libFileName, sizeof(libFileName), "./lib%s.so", dllName);
+    info->className = strdup(className);
+    info->moduleName = strdup(moduleName);
+    info->classObj = classObj;
     
-    void* handle = dlopen(libFileName, RTLD_LAZY);
-    if (!handle) {
-        fprintf(stderr, "Failed to load library %s: %s\n", libFileName, dlerror());
-        return NULL;
+    // Nothing is left behind when registration fails part way
+    bool named = info->className != NULL && info->moduleName != NULL &&
+                 ffiNameTableAdd(&ctx->classesByName, info);
+    if (!named || !ffiKeyTableSet(&ctx->classesByObject, classObj, 0, info)) {
+        fprintf(stderr, "Could not register FFI class %s\n", className);
+        if (named) ffiNameTableRemove(&ctx->classesByName, info);
+        free(info->className);
+        free(info->moduleName);
+        free(info);
+        return;
     }
     
-    // Cache the handle
-    int index = ffiClass->dllHandleCount;
-    ffiClass->dllHandles[index].dllName = strdup(dllName);
-    ffiClass->dllHandles[index].handle = handle;
-    ffiClass->dllHandleCount++;
+    if (ffiEagerBinding) {
+        if (ctx->pendingClassCount == ctx->pendingClassCapacity) {
+            int capacity = ctx->pendingClassCapacity == 0 ? 8 : ctx->pendingClassCapacity * 2;
+            FFIClassInfo** classes = realloc(ctx->pendingClasses, capacity * sizeof(FFIClassInfo*));
+            if (classes == NULL) {
+                fprintf(stderr, "Could not queue FFI class %s for eager binding\n", className);
+                return;
+            }
+            ctx->pendingClasses = classes;
+            ctx->pendingClassCapacity = capacity;
+        }
+        ctx->pendingClasses[ctx->pendingClassCount++] = info;
+    }
     
-    fprintf(stderr, "Cached DLL handle for %s in class %s (index %d)\n", dllName, ffiClass->className, index);
-    return handle;
+    fprintf(stderr, "Stored FFI class: module='%s', class='%s'\n", moduleName, className);
 }
 
-// Helper function to unload all DLL handles for a class
-static void unloadAllDllHandles(FFIClassInfo* ffiClass) {
-    if (ffiClass == NULL) return;
+// Function to find an FFI class by name
+FFIClassInfo* findFFIClass(WreniContext* ctx, const char* moduleName, const char* className) {
+    return ffiNameTableFind(&ctx->classesByName, moduleName, className);
+}
+
+// Function to add a method to the FFI method registry. Methods are keyed on
+// the class that owns them, which is the metaclass for static methods.
+FFIMethodInfo* addFFIMethod(WreniContext* ctx, const char* methodName, const char* signature, ObjClass* classObj, uint16_t symbol, bool isStatic) {
+    FFIMethodInfo* methodInfo = calloc(1, sizeof(FFIMethodInfo));
+    if (methodInfo == NULL) {
+        fprintf(stderr, "Warning: Could not allocate FFI method %s\n", methodName);
+        return NULL;
+    }
     
-    // Iterate through all cached handles and unload them
-    for (int i = 0; i < ffiClass->dllHandleCount; i++) {
-        if (ffiClass->dllHandles[i].handle != NULL) {
-            dlclose(ffiClass->dllHandles[i].handle);
-            fprintf(stderr, "Unloaded DLL handle for %s in class %s\n", 
-                    ffiClass->dllHandles[i].dllName, ffiClass->className);
-            free(ffiClass->dllHandles[i].dllName);
-            ffiClass->dllHandles[i].dllName = NULL;
-            ffiClass->dllHandles[i].handle = NULL;
-        }
+    // Allocate memory for method name and signature
+    methodInfo->methodName = strdup(methodName);
+    methodInfo->signature = strdup(signature);
+    methodInfo->classObj = classObj;
+    methodInfo->symbol = symbol;
+    
+    // Initialize FFI attribute fields
+    methodInfo->dllName = NULL;
+    methodInfo->argsSignature = NULL;
+    methodInfo->retSignature = NULL;
+    methodInfo->attributesExtracted = false;
+    
+    // The call descriptor is compiled lazily on the first call
+    methodInfo->compiled = false;
+    methodInfo->fnPtr = NULL;
+    methodInfo->argCount = 0;
+    methodInfo->argTags = NULL;
+    methodInfo->argTypes = NULL;
+    methodInfo->argStructs = NULL;
+    methodInfo->argCallbacks = NULL;
+    methodInfo->retTag = FT_VOID;
+    methodInfo->retStruct = NULL;
+    methodInfo->thunk = NULL;
+    methodInfo->batch = false;
+    methodInfo->async = false;
+    methodInfo->frame = false;
+    methodInfo->payloadArg = false;
+    methodInfo->init = false;
+    methodInfo->pure = false;
+    methodInfo->memo = NULL;
+    
+    // Arity is the number of parameter placeholders in the signature
+    int arity = 0;
+    for (const char* p = signature; *p; p++) {
+        if (*p == '_') arity++;
     }
+    methodInfo->isStatic = isStatic;
+    methodInfo->arity = arity;
+    methodInfo->closure = NULL;
+    methodInfo->entry = NULL;
     
-    ffiClass->dllHandleCount = 0;
-}
-static ObjModule* findModuleByClass(WrenVM* vm, ObjClass* targetClass) {
-    if (vm == NULL || vm->modules == NULL || targetClass == NULL) {
+    ObjClass* owner = isStatic ? classObj->obj.classObj : classObj;
+    if (!ffiKeyTableSet(&ctx->methods, owner, symbol, methodInfo)) {
+        fprintf(stderr, "Warning: Could not register FFI method %s\n", methodName);
+        free(methodInfo->methodName);
+        free(methodInfo->signature);
+        free(methodInfo);
         return NULL;
     }
     
-    // Iterate through all modules in VM's module map
-    for (int i = 0; i < vm->modules->capacity; i++) {
-        MapEntry* entry = &vm->modules->entries[i];
-        if (!IS_UNDEFINED(entry->key)) {
-            if (wrenIsObjType(entry->value, OBJ_MODULE)) {
-                ObjModule* module = AS_MODULE(entry->value);
-                
-                // Search through module variables to find our target class
-                for (int j = 0; j < module->variables.count && j < module->variableNames.count; j++) {
-                    Value varValue = module->variables.data[j];
-                    
-                    // Check if this variable is our target class
-                    if (IS_CLASS(varValue) && AS_CLASS(varValue) == targetClass) {
-                        return module;
-                    }
-                }
-            }
+    return methodInfo;
+}
+
+// Helper function to get the values of one key of an attribute group
+static ObjList* getFFIAttributeList(ObjMap* group, const char* key) {
+    for (uint32_t i = 0; i < group->capacity; i++) {
+        MapEntry* entry = &group->entries[i];
+        if (!IS_UNDEFINED(entry->key) && IS_STRING(entry->key) && IS_LIST(entry->value) &&
+            strcmp(AS_STRING(entry->key)->value, key) == 0) {
+            return AS_LIST(entry->value);
         }
     }
-    
     return NULL;
 }
 
-// Function to execute foreign method with specific index
-void executeForeignFn(WrenVM* vm)
-{
-    const char* moduleName = "<unknown module>";
-    const char* className = "<unknown class>";
-    const char* methodName = "<unknown method>";
-    ObjClass* targetClass = NULL;
+// Helper function to get the first value of one key of an attribute group
+// when it is a string
+static ObjString* getFFIAttributeString(ObjMap* group, const char* key) {
+    ObjList* list = getFFIAttributeList(group, key);
+    if (list == NULL || list->elements.count == 0 || !IS_STRING(list->elements.data[0])) return NULL;
+    return AS_STRING(list->elements.data[0]);
+}
 
-    if (vm != NULL) {
-        // Determine the receiver and module/class information from API stack
-        if (vm->apiStack != NULL) {
-            Value receiver = vm->apiStack[0];
+// Helper function to read a boolean flag such as batch=true of an attribute group
+static bool getFFIAttributeFlag(ObjMap* group, const char* key) {
+    ObjList* list = getFFIAttributeList(group, key);
+    return list != NULL && list->elements.count > 0 && IS_BOOL(list->elements.data[0]) &&
+           AS_BOOL(list->elements.data[0]);
+}
 
-            if (IS_CLASS(receiver)) {
-                targetClass = AS_CLASS(receiver);
-            } else if (IS_INSTANCE(receiver)) {
-                targetClass = AS_INSTANCE(receiver)->obj.classObj;
-            }
+// Helper function to check whether a boolean flag is given, true or false
+static bool hasFFIAttributeFlag(ObjMap* group, const char* key) {
+    ObjList* list = getFFIAttributeList(group, key);
+    return list != NULL && list->elements.count > 0 && IS_BOOL(list->elements.data[0]);
+}
 
-            if (targetClass != NULL) {
-                if (targetClass->name != NULL) {
-                    className = targetClass->name->value;
-                }
-                // Try to find module by target class pointer
-                ObjModule* targetModule = findModuleByClass(vm, targetClass);
-                if (targetModule != NULL && targetModule->name != NULL) {
-                    moduleName = targetModule->name->value;
-                }
-            }
+// Helper function to get one group, such as #!extern, of a class's or method's attributes
+static ObjMap* getFFIAttributeGroup(Value attrs, const char* name) {
+    if (!IS_MAP(attrs)) return NULL;
+    ObjMap* map = AS_MAP(attrs);
+    for (uint32_t i = 0; i < map->capacity; i++) {
+        MapEntry* entry = &map->entries[i];
+        if (!IS_UNDEFINED(entry->key) && IS_STRING(entry->key) && IS_MAP(entry->value) &&
+            strcmp(AS_STRING(entry->key)->value, name) == 0) {
+            return AS_MAP(entry->value);
         }
     }
+    return NULL;
+}
 
-    // Check if this is a correctly stored FFI class
-    FFIClassInfo* ffiClass = findFFIClass(moduleName, className);
-    if (true) { // Skip validation for now
-        if (ffiClass != NULL) {
-            // fprintf(stderr, "Found FFI class: %s.%s\n", moduleName, className);
-        }
-    } else {
-        // Report error back to Wren instead of exiting
-        wrenSetSlotString(vm, 0, "FFI foreign class not found or not properly registered");
-        wrenAbortFiber(vm, 0);
-        return;
-    }
+// Helper function to copy a string into an index arena, NULL stays NULL
+static const char* copyFFIExternString(char** cursor, ObjString* string) {
+    if (string == NULL) return NULL;
+    char* copy = *cursor;
+    memcpy(copy, string->value, string->length + 1);
+    *cursor += string->length + 1;
+    return copy;
+}
 
-    // getting current frame
-    CallFrame* frame = &vm->fiber->frames[vm->fiber->numFrames-1];
+// Helper function to get the arena size of a string
+static size_t sizeFFIExternString(ObjString* string) {
+    return string == NULL ? 0 : string->length + 1;
+}
 
-    uint16_t methodSymbol = (uint16_t) (*(frame->ip - 2) << 8 | *(frame->ip - 1));
-    
-    // Get the actual method name from the VM using the symbol
-    if (targetClass != NULL) {
-        methodName = vm->methodNames.data[methodSymbol]->value;
-    }
+// Helper function to fill a spec from an #!extern group
+static void readFFIExternSpec(FFIExternSpec* spec, ObjMap* group, char** cursor) {
+    spec->dll = copyFFIExternString(cursor, getFFIAttributeString(group, "dll"));
+    spec->args = copyFFIExternString(cursor, getFFIAttributeString(group, "args"));
+    spec->ret = copyFFIExternString(cursor, getFFIAttributeString(group, "ret"));
+    spec->batch = getFFIAttributeFlag(group, "batch");
+    spec->async = getFFIAttributeFlag(group, "async");
+    spec->hasBatch = hasFFIAttributeFlag(group, "batch");
+    spec->hasAsync = hasFFIAttributeFlag(group, "async");
+    spec->frame = getFFIAttributeFlag(group, "frame");
+    spec->init = getFFIAttributeFlag(group, "init");
+    spec->pure = getFFIAttributeFlag(group, "pure");
+}
 
-    fprintf(stderr, "Executing foreign method %s.%s.%s\n", moduleName, className, methodName);
+// Helper function to get the arena size of an #!extern group's strings
+static size_t sizeFFIExternSpec(ObjMap* group) {
+    return sizeFFIExternString(getFFIAttributeString(group, "dll")) +
+           sizeFFIExternString(getFFIAttributeString(group, "args")) +
+           sizeFFIExternString(getFFIAttributeString(group, "ret"));
+}
 
-    // Find or create FFIMethodInfo for this method
-    FFIMethodInfo* methodInfo = findFFIMethod(targetClass, methodSymbol);
-    if (methodInfo == NULL) {
-        // Create new method info if not found
-        addFFIMethod(methodName, "foreign", targetClass, methodSymbol);
-        methodInfo = findFFIMethod(targetClass, methodSymbol);
+// Helper function to order extern specs by signature, then static after instance
+static int compareFFIExternSpecs(const void* a, const void* b) {
+    const FFIExternSpec* x = a;
+    const FFIExternSpec* y = b;
+    int order = strcmp(x->signature, y->signature);
+    return order != 0 ? order : (int)x->isStatic - (int)y->isStatic;
+}
+
+// Helper function to tell whether a method attribute key such as "foreign
+// static DrawText(_,_,_,_,_)" is of a static method
+static bool isStaticFFIAttributeKey(ObjString* key, const char* signature) {
+    for (const char* word = key->value; word < signature; word++) {
+        if (strncmp(word, "static ", 7) == 0) return true;
     }
+    return false;
+}
+
+// Function to index the #!extern attributes of a class in one pass over its
+// attributes. Keys of the method attributes look like "foreign static
+// DrawText(_,_,_,_,_)": the signature follows the last space. The args of
+// instance methods of a class with a payload start with the payload.
+// Returns false while the class body is incomplete and its attributes
+// don't exist yet.
+static bool indexFFIAttributes(FFIClassInfo* ffiClass) {
+    if (ffiClass->externsIndexed) return true;
+    ObjClass* classObj = ffiClass->classObj;
+    if (classObj == NULL || !IS_INSTANCE(classObj->attributes)) return false;
+    ffiClass->externsIndexed = true;
     
-    // Extract and cache attributes if not already done
-    extractAndStoreFFIAttributes(vm, methodInfo, methodName);
+    // fields[0] is the class's attributes, fields[1] is all the methods' attributes
+    ObjInstance* attrInstance = AS_INSTANCE(classObj->attributes);
+    ObjMap* classGroup = getFFIAttributeGroup(attrInstance->fields[0], "extern");
+    ObjMap* payloadGroup = getFFIAttributeGroup(attrInstance->fields[0], "payload");
+    ObjMap* destructorGroup = getFFIAttributeGroup(attrInstance->fields[0], "destructor");
+    ObjMap* methodsMap = IS_MAP(attrInstance->fields[1]) ? AS_MAP(attrInstance->fields[1]) : NULL;
     
-    // Use cached attributes
-    char* dllName = methodInfo->dllName;
-    char* argsSignature = methodInfo->argsSignature;
-    char* retSignature = methodInfo->retSignature;
+    ObjString* payloadStruct = payloadGroup != NULL ? getFFIAttributeString(payloadGroup, "struct") : NULL;
+    ObjString* pass = payloadGroup != NULL ? getFFIAttributeString(payloadGroup, "pass") : NULL;
+    bool byValue = pass != NULL && strcmp(pass->value, "value") == 0;
+    ObjString* destructorFn = destructorGroup != NULL ? getFFIAttributeString(destructorGroup, "fn") : NULL;
+    ObjString* destructorDll = destructorGroup != NULL ? getFFIAttributeString(destructorGroup, "dll") : NULL;
+    if (payloadGroup != NULL && payloadStruct == NULL) {
+        fprintf(stderr, "#!payload of %s needs struct\n", ffiClass->className);
+    }
+    size_t prefixLength = payloadStruct == NULL ? 0 : byValue ? payloadStruct->length : strlen("ptr");
     
-    // Set default values if not specified
-    if (retSignature == NULL) {
-        retSignature = "void";
-        fprintf(stderr, "FFI Attribute ret: void (default)\n");
+    // First pass sizes the arena, the second fills it
+    int count = 0;
+    size_t bytes = classGroup != NULL ? sizeFFIExternSpec(classGroup) : 0;
+    bytes += sizeFFIExternString(payloadStruct) + strlen("ptr") + 1;
+    bytes += sizeFFIExternString(destructorFn) + sizeFFIExternString(destructorDll);
+    for (uint32_t i = 0; methodsMap != NULL && i < methodsMap->capacity; i++) {
+        MapEntry* entry = &methodsMap->entries[i];
+        if (IS_UNDEFINED(entry->key) || !IS_STRING(entry->key)) continue;
+        ObjMap* group = getFFIAttributeGroup(entry->value, "extern");
+        if (group == NULL) continue;
+        count++;
+        bytes += AS_STRING(entry->key)->length + 1 + sizeFFIExternSpec(group);
+        if (payloadStruct != NULL) {
+            bytes += prefixLength + 1 + sizeFFIExternString(getFFIAttributeString(group, "args"));
+        }
     }
     
-    if (argsSignature == NULL) {
-        argsSignature = "";
-        fprintf(stderr, "FFI Attribute args:  (default empty)\n");
+    size_t specBytes = count * sizeof(FFIExternSpec);
+    char* arena = malloc(specBytes + bytes + 1);
+    if (arena == NULL) {
+        fprintf(stderr, "Could not index the attributes of %s\n", ffiClass->className);
+        return true;
     }
+    ffiClass->externArena = arena;
+    ffiClass->externs = (FFIExternSpec*)arena;
+    char* cursor = arena + specBytes;
     
-    // Print extracted attributes
-    if (dllName != NULL) {
-        fprintf(stderr, "FFI Attribute dll: %s\n", dllName);
+    if (classGroup != NULL) readFFIExternSpec(&ffiClass->classExtern, classGroup, &cursor);
+    ffiClass->destructorFn = copyFFIExternString(&cursor, destructorFn);
+    ffiClass->destructorDll = copyFFIExternString(&cursor, destructorDll);
+    ffiClass->payloadStruct = copyFFIExternString(&cursor, payloadStruct);
+    ffiClass->payloadByValue = byValue;
+    if (payloadStruct != NULL) {
+        ffiClass->payloadArgs = byValue ? ffiClass->payloadStruct : cursor;
+        memcpy(cursor, "ptr", strlen("ptr") + 1);
+        cursor += strlen("ptr") + 1;
     }
-
-    // Perform FFI call if we have the required information
-    if (dllName != NULL && methodName != NULL) {
-        // Extract clean method name for FFI (remove parameter signature)
-        char ffiFnName[256];
-        const char* parenPos = strchr(methodName, '(');
-        if (parenPos != NULL) {
-            size_t nameLen = parenPos - methodName;
-            strncpy(ffiFnName, methodName, nameLen);
-            ffiFnName[nameLen] = '\0';
-        } else {
-            strcpy(ffiFnName, methodName);
-        }
+    
+    for (uint32_t i = 0; methodsMap != NULL && i < methodsMap->capacity; i++) {
+        MapEntry* entry = &methodsMap->entries[i];
+        if (IS_UNDEFINED(entry->key) || !IS_STRING(entry->key)) continue;
+        ObjMap* group = getFFIAttributeGroup(entry->value, "extern");
+        if (group == NULL) continue;
         
-        fprintf(stderr, "Calling FFI: %s::%s(%s) -> %s\n", 
-                dllName, ffiFnName, 
-                argsSignature ? argsSignature : "void", 
-                retSignature ? retSignature : "void");
+        ObjString* key = AS_STRING(entry->key);
+        const char* lastSpace = strrchr(key->value, ' ');
+        const char* signature = lastSpace != NULL ? lastSpace + 1 : key->value;
+        FFIExternSpec* spec = &ffiClass->externs[ffiClass->externCount++];
+        spec->isStatic = isStaticFFIAttributeKey(key, signature);
+        spec->signature = cursor;
+        memcpy(cursor, signature, strlen(signature) + 1);
+        cursor += strlen(signature) + 1;
+        readFFIExternSpec(spec, group, &cursor);
         
-        // Get FFIClassInfo for DLL handle caching
-        FFIClassInfo* ffiClass = findFFIClassByObject(targetClass);
-        if (ffiClass == NULL) {
-            fprintf(stderr, "No FFI class info found for DLL caching, but continuing anyway\n");
-            // Don't abort - just continue without caching
+        // Written as one string so the call descriptor covers the payload too
+        if (ffiClass->payloadArgs != NULL && !spec->isStatic && !spec->init) {
+            const char* args = spec->args;
+            int length = sprintf(cursor, args != NULL ? "%s,%s" : "%s", ffiClass->payloadArgs, args);
+            spec->args = cursor;
+            cursor += length + 1;
         }
-        
-        // Get or load DLL handle from cache (or directly if no class info)
-        void* handle = NULL;
-        if (ffiClass != NULL) {
-            handle = getOrLoadDllHandle(vm, ffiClass, dllName);
-        } else {
-            // Fallback to direct loading
-            char libFileName[256];
-            snprintf(libFileName, sizeof(libFileName), "./lib%s.so", dllName);
-            handle = dlopen(libFileName, RTLD_LAZY);
+    }
+    
+    qsort(ffiClass->externs, ffiClass->externCount, sizeof(FFIExternSpec), compareFFIExternSpecs);
+    return true;
+}
+
+// Function to find the #!extern attributes of a method in the index of its class
+static const FFIExternSpec* findFFIExternSpec(FFIClassInfo* ffiClass, const char* signature, bool isStatic) {
+    FFIExternSpec key;
+    key.signature = signature;
+    key.isStatic = isStatic;
+    return bsearch(&key, ffiClass->externs, ffiClass->externCount, sizeof(FFIExternSpec), compareFFIExternSpecs);
+}
+
+// Function to extract and store FFI attributes for a method. The method's
+// own #!extern comes first, an #!extern on the class gives the library and
+// flags of methods that don't set them, or of methods without one.
+static void extractAndStoreFFIAttributes(WrenVM* vm, FFIMethodInfo* methodInfo, const char* methodName) {
+    if (methodInfo == NULL || methodInfo->attributesExtracted) {
+        return; // Already extracted or invalid
+    }
+    
+    FFIClassInfo* ffiClass = findFFIClassByObject(getWreniContext(vm), methodInfo->classObj);
+    if (ffiClass == NULL || !indexFFIAttributes(ffiClass)) {
+        return;
+    }
+    
+    const FFIExternSpec* spec = findFFIExternSpec(ffiClass, methodName, methodInfo->isStatic);
+    const FFIExternSpec* defaults = &ffiClass->classExtern;
+    if (spec == NULL && defaults->dll == NULL) {
+        return;
+    }
+    
+    methodInfo->dllName = spec != NULL && spec->dll != NULL ? spec->dll : defaults->dll;
+    methodInfo->argsSignature = spec != NULL ? spec->args : NULL;
+    methodInfo->retSignature = spec != NULL ? spec->ret : NULL;
+    // A method's own batch or async, false included, wins over the class
+    methodInfo->batch = spec != NULL && spec->hasBatch ? spec->batch : defaults->batch;
+    methodInfo->async = spec != NULL && spec->hasAsync ? spec->async : defaults->async;
+    methodInfo->frame = spec != NULL && spec->frame;
+    methodInfo->pure = spec != NULL && spec->pure;
+    
+    // Instance methods of a class with a payload take it first, or fill it
+    // with init=true. The receiver must stay alive during the call, so
+    // these calls are neither batched nor run on another thread.
+    if (ffiClass->payloadArgs != NULL && !methodInfo->isStatic) {
+        methodInfo->init = spec != NULL && spec->init;
+        methodInfo->payloadArg = !methodInfo->init;
+        if (spec == NULL) methodInfo->argsSignature = ffiClass->payloadArgs;
+        methodInfo->batch = false;
+        methodInfo->async = false;
+    }
+    
+    methodInfo->attributesExtracted = true;
+    if (wreniDebug) fprintf(stderr, "Extracted and cached FFI attributes for %s\n", methodName);
+}
+
+// Function to find an FFI method by its owning class object and symbol
+FFIMethodInfo* findFFIMethod(WreniContext* ctx, ObjClass* classObj, uint16_t symbol) {
+    return ffiKeyTableFind(&ctx->methods, classObj, symbol);
+}
+
+// Function to find an FFI class by its object pointer
+FFIClassInfo* findFFIClassByObject(WreniContext* ctx, ObjClass* classObj) {
+    return ffiKeyTableFind(&ctx->classesByObject, classObj, 0);
+}
+
+// Process-wide registry of shared libraries, hashed by the dll name used in
+// #!extern. Every class using a library holds one reference to it, the
+// handle is closed when the last one is released. Entries stay in the table
+// once added so their #!library options survive an unload.
+struct FFILibrary {
+    char* name;
+    uint32_t hash;
+    char* path;                // File the handle was opened from
+    void* handle;
+    int refCount;
+    int mode;                  // RTLD_LAZY unless #!library asks for now
+    uint32_t generation;       // Bumped by every dlopen, see FFIDescriptor
+    char** versions;           // Soname versions to try, in order
+    int versionCount;
+};
+
+static struct {
+    FFILibrary** slots;
+    uint32_t capacity;
+    uint32_t count;
+} ffiLibraries = {0};
+
+// Soname versions tried per library, extra ones are ignored
+#define FFI_LIBRARY_MAX_VERSIONS 8
+
+// Directories searched for libraries: "." then WRENI_LIBRARY_PATH
+static char** libraryPaths = NULL;
+static int libraryPathCount = 0;
+
+// The registry is shared by every VM of the process
+static pthread_mutex_t ffiLibraryLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Helper function to hash a library name with FNV-1a
+static uint32_t hashFFILibraryName(const char* name) {
+    uint32_t h = 2166136261u;
+    for (const char* p = name; *p; p++) {
+        h = (h ^ (uint8_t)*p) * 16777619u;
+    }
+    return h;
+}
+
+// Function to find a library by name, adding an unloaded entry if [add]
+static FFILibrary* findFFILibrary(const char* name, bool add) {
+    uint32_t hash = hashFFILibraryName(name);
+    if (ffiLibraries.count > 0) {
+        uint32_t mask = ffiLibraries.capacity - 1;
+        for (uint32_t i = hash & mask; ffiLibraries.slots[i] != NULL; i = (i + 1) & mask) {
+            FFILibrary* library = ffiLibraries.slots[i];
+            if (library->hash == hash && strcmp(library->name, name) == 0) return library;
         }
-        
-        if (!handle) {
-            fprintf(stderr, "Failed to get DLL handle for %s\n", dllName);
-            wrenSetSlotString(vm, 0, "Failed to load dynamic library");
-            wrenAbortFiber(vm, 0);
-            goto cleanup;
+    }
+    if (!add) return NULL;
+    
+    if ((ffiLibraries.count + 1) * 4 > ffiLibraries.capacity * 3) {
+        uint32_t capacity = ffiLibraries.capacity == 0 ? FFI_TABLE_MIN_CAPACITY : ffiLibraries.capacity * 2;
+        FFILibrary** slots = calloc(capacity, sizeof(FFILibrary*));
+        if (slots == NULL) return NULL;
+        for (uint32_t i = 0; i < ffiLibraries.capacity; i++) {
+            if (ffiLibraries.slots[i] == NULL) continue;
+            uint32_t j = ffiLibraries.slots[i]->hash & (capacity - 1);
+            while (slots[j] != NULL) j = (j + 1) & (capacity - 1);
+            slots[j] = ffiLibraries.slots[i];
         }
+        free(ffiLibraries.slots);
+        ffiLibraries.slots = slots;
+        ffiLibraries.capacity = capacity;
+    }
+    
+    FFILibrary* library = calloc(1, sizeof(FFILibrary));
+    if (library == NULL) return NULL;
+    library->name = strdup(name);
+    library->hash = hash;
+    library->mode = RTLD_LAZY;
+    
+    uint32_t mask = ffiLibraries.capacity - 1;
+    uint32_t i = hash & mask;
+    while (ffiLibraries.slots[i] != NULL) i = (i + 1) & mask;
+    ffiLibraries.slots[i] = library;
+    ffiLibraries.count++;
+    return library;
+}
+
+static void initLibraryPaths(void) {
+    if (libraryPaths != NULL) return;
+    
+    libraryPaths = malloc(sizeof(char*));
+    libraryPaths[libraryPathCount++] = strdup(".");
+    
+    const char* env = getenv("WRENI_LIBRARY_PATH");
+    while (env != NULL && *env) {
+        size_t length = strcspn(env, ":");
+        if (length > 0) {
+            libraryPaths = realloc(libraryPaths, (libraryPathCount + 1) * sizeof(char*));
+            libraryPaths[libraryPathCount++] = strndup(env, length);
+        }
+        env += length;
+        if (*env == ':') env++;
+    }
+}
+
+// Helper function to apply one #!library option list such as "now,5.5,5",
+// entries other than now and lazy are soname versions
+static void setFFILibraryOptions(FFILibrary* library, const char* options) {
+    while (*options) {
+        size_t length = strcspn(options, ",");
+        while (length > 0 && *options == ' ') {
+            options++;
+            length--;
+        }
+        size_t trimmed = length;
+        while (trimmed > 0 && options[trimmed - 1] == ' ') trimmed--;
         
-        // Get the function symbol
-        void* func = dlsym(handle, ffiFnName);
-        if (!func) {
-            fprintf(stderr, "Failed to find function %s in %s: %s\n", ffiFnName, dllName, dlerror());
-            wrenSetSlotString(vm, 0, "Function not found in library");
-            wrenAbortFiber(vm, 0);
-            goto cleanup;
-        }
-        
-        // Parse arguments signature and set up libffi call
-        ffi_cif cif;
-        ffi_type** arg_types = NULL;
-        void** arg_values = NULL;
-        int* int_args = NULL;
-        int64_t* i64_args = NULL;
-        float* f32_args = NULL;
-        char** str_args = NULL;
-        int arg_count = 0;
-        ffi_type* ret_type = &ffi_type_void;
-        
-        // Parse return type
-        if (retSignature != NULL && strcmp(retSignature, "i32") == 0) {
-            ret_type = &ffi_type_sint32;
-        } else if (retSignature != NULL && strcmp(retSignature, "i64") == 0) {
-            ret_type = &ffi_type_sint64;
-        } else if (retSignature != NULL && strcmp(retSignature, "f32") == 0) {
-            ret_type = &ffi_type_float;
-        } else if (retSignature != NULL && strcmp(retSignature, "bool") == 0) {
-            ret_type = &ffi_type_uint8;  // bool as 1 byte unsigned int
-        }
-        
-        // Parse arguments signature
-        if (argsSignature != NULL && strlen(argsSignature) > 0) {
-            // Count arguments by counting commas + 1
-            arg_count = 1;
-            for (const char* p = argsSignature; *p; p++) {
-                if (*p == ',') arg_count++;
-            }
-            
-            arg_types = malloc(arg_count * sizeof(ffi_type*));
-            arg_values = malloc(arg_count * sizeof(void*));
-            int_args = malloc(arg_count * sizeof(int));
-            i64_args = malloc(arg_count * sizeof(int64_t));
-            f32_args = malloc(arg_count * sizeof(float));
-            str_args = malloc(arg_count * sizeof(char*));
-            
-            // Parse each argument type and set up values
-            const char* start = argsSignature;
-            int arg_index = 0;
+        if (trimmed == 3 && strncmp(options, "now", 3) == 0) {
+            library->mode = RTLD_NOW;
+        } else if (trimmed == 4 && strncmp(options, "lazy", 4) == 0) {
+            library->mode = RTLD_LAZY;
+        } else if (trimmed > 0) {
+            char** versions = realloc(library->versions, (library->versionCount + 1) * sizeof(char*));
+            if (versions == NULL) return;
+            library->versions = versions;
+            library->versions[library->versionCount++] = strndup(options, trimmed);
+        }
+        options += length;
+        if (*options == ',') options++;
+    }
+}
+
+// Function to read the #!library options of a class, one key per library:
+// #!library(raylib="now,550") opens raylib with RTLD_NOW and tries
+// libraylib.so.550 before libraylib.so
+static void registerFFILibraries(FFIClassInfo* ffiClass) {
+    ObjClass* classObj = ffiClass->classObj;
+    if (ffiClass->librariesRegistered || classObj == NULL || classObj->attributes == 0 ||
+        !IS_INSTANCE(classObj->attributes)) {
+        return;
+    }
+    ffiClass->librariesRegistered = true;
+    
+    Value classAttrs = AS_INSTANCE(classObj->attributes)->fields[0];
+    if (!IS_MAP(classAttrs)) return;
+    
+    ObjMap* attrs = AS_MAP(classAttrs);
+    for (uint32_t i = 0; i < attrs->capacity; i++) {
+        MapEntry* entry = &attrs->entries[i];
+        if (IS_UNDEFINED(entry->key) || !IS_STRING(entry->key) ||
+            strcmp(AS_STRING(entry->key)->value, "library") != 0 || !IS_MAP(entry->value)) {
+            continue;
+        }
+        
+        ObjMap* libraryMap = AS_MAP(entry->value);
+        for (uint32_t j = 0; j < libraryMap->capacity; j++) {
+            MapEntry* option = &libraryMap->entries[j];
+            if (IS_UNDEFINED(option->key) || !IS_STRING(option->key) || !IS_LIST(option->value)) continue;
             
-            while (start && *start && arg_index < arg_count) {
-                const char* end = strchr(start, ',');
-                if (end == NULL) end = start + strlen(start);
-                
-                size_t len = end - start;
-                char arg_type[32];
-                if (len < sizeof(arg_type)) {
-                    strncpy(arg_type, start, len);
-                    arg_type[len] = '\0';
-                    
-                    // Remove any whitespace
-                    char* trimmed = arg_type;
-                    while (*trimmed == ' ') trimmed++;
-                    
-                    // Set argument type and get value from Wren stack
-                    if (strcmp(trimmed, "i32") == 0) {
-                        arg_types[arg_index] = &ffi_type_sint32;
-                        // Get int value from Wren stack (skip receiver)
-                        if (arg_index + 1 < wrenGetSlotCount(vm)) {
-                            int_args[arg_index] = (int)AS_NUM(vm->apiStack[arg_index + 1]);
-                            arg_values[arg_index] = &int_args[arg_index];
-                        }
-                    } else if (strcmp(trimmed, "i64") == 0) {
-                        arg_types[arg_index] = &ffi_type_sint64;
-                        // Get int64_t value from Wren stack (skip receiver)
-                        if (arg_index + 1 < wrenGetSlotCount(vm)) {
-                            i64_args[arg_index] = (int64_t)AS_NUM(vm->apiStack[arg_index + 1]);
-                            arg_values[arg_index] = &i64_args[arg_index];
-                            fprintf(stderr, "i64 arg[%d] = %ld (0x%lx)\n", arg_index, i64_args[arg_index], i64_args[arg_index]);
-                        }
-                    } else if (strcmp(trimmed, "f32") == 0) {
-                        arg_types[arg_index] = &ffi_type_float;
-                        // Get float value from Wren stack (skip receiver)
-                        if (arg_index + 1 < wrenGetSlotCount(vm)) {
-                            f32_args[arg_index] = (float)AS_NUM(vm->apiStack[arg_index + 1]);
-                            arg_values[arg_index] = &f32_args[arg_index];
-                            fprintf(stderr, "f32 arg[%d] = %f\n", arg_index, f32_args[arg_index]);
-                        }
-                    } else if (strcmp(trimmed, "char*") == 0) {
-                        arg_types[arg_index] = &ffi_type_pointer;
-                        // Get string value from Wren stack
-                        if (arg_index + 1 < wrenGetSlotCount(vm)) {
-                            Value str_val = vm->apiStack[arg_index + 1];
-                            if (IS_STRING(str_val)) {
-                                str_args[arg_index] = AS_STRING(str_val)->value;
-                                arg_values[arg_index] = &str_args[arg_index];
-                            }
-                        }
-                    }
-                    
-                    arg_index++;
+            FFILibrary* library = findFFILibrary(AS_STRING(option->key)->value, true);
+            if (library == NULL || library->handle != NULL) continue;
+            ObjList* values = AS_LIST(option->value);
+            for (int k = 0; k < values->elements.count; k++) {
+                if (IS_STRING(values->elements.data[k])) {
+                    setFFILibraryOptions(library, AS_STRING(values->elements.data[k])->value);
                 }
-                
-                start = end ? end + 1 : NULL;
-            }
-        }
-        
-        // Initialize CIF
-        ffi_status status = ffi_prep_cif(&cif, FFI_DEFAULT_ABI, arg_count, ret_type, arg_types);
-        if (status != FFI_OK) {
-            fprintf(stderr, "FFI prep_cif failed\n");
-            if (arg_types) free(arg_types);
-            if (arg_values) free(arg_values);
-            if (int_args) free(int_args);
-            if (i64_args) free(i64_args);
-            if (f32_args) free(f32_args);
-            if (str_args) free(str_args);
-            wrenSetSlotString(vm, 0, "FFI preparation failed");
-            wrenAbortFiber(vm, 0);
-            goto cleanup;
-        }
-        
-        // Make the FFI call
-        void* result = NULL;
-        if (ret_type != &ffi_type_void) {
-            if (ret_type == &ffi_type_sint64) {
-                result = malloc(sizeof(int64_t));
-                memset(result, 0, sizeof(int64_t));
-            } else if (ret_type == &ffi_type_float) {
-                result = malloc(sizeof(float));
-                memset(result, 0, sizeof(float));
-            } else if (ret_type == &ffi_type_uint8) {
-                result = malloc(sizeof(uint8_t));
-                memset(result, 0, sizeof(uint8_t));
+            }
+        }
+        break;
+    }
+}
+
+// Helper function to open a library: a name with a '/' or ".so" is a path,
+// otherwise lib<name>.so.<version> and lib<name>.so are tried in every
+// search directory and then through the system's own search
+static void* openFFILibrary(FFILibrary* library) {
+    char candidates[FFI_LIBRARY_MAX_VERSIONS + 1][256];
+    int candidateCount = 0;
+    
+    if (strchr(library->name, '/') != NULL || strstr(library->name, ".so") != NULL) {
+        snprintf(candidates[candidateCount++], sizeof(candidates[0]), "%s", library->name);
+    } else {
+        for (int i = 0; i < library->versionCount && i < FFI_LIBRARY_MAX_VERSIONS; i++) {
+            snprintf(candidates[candidateCount++], sizeof(candidates[0]), "lib%s.so.%s",
+                     library->name, library->versions[i]);
+        }
+        snprintf(candidates[candidateCount++], sizeof(candidates[0]), "lib%s.so", library->name);
+    }
+    
+    initLibraryPaths();
+    char path[PATH_MAX];
+    for (int d = 0; d <= libraryPathCount; d++) {
+        for (int c = 0; c < candidateCount; c++) {
+            if (d < libraryPathCount) {
+                if (candidates[c][0] == '/') continue;
+                snprintf(path, sizeof(path), "%s/%s", libraryPaths[d], candidates[c]);
             } else {
-                result = malloc(sizeof(int));
-                memset(result, 0, sizeof(int));
+                snprintf(path, sizeof(path), "%s", candidates[c]);
+            }
+            
+            void* handle = dlopen(path, library->mode);
+            if (handle != NULL) {
+                library->path = strdup(path);
+                return handle;
             }
         }
+    }
+    
+    fprintf(stderr, "Failed to load library %s: %s\n", library->name, dlerror());
+    return NULL;
+}
+
+// Function to take a reference to a library, opening it on the first one
+static FFILibrary* acquireFFILibrary(const char* dllName) {
+    pthread_mutex_lock(&ffiLibraryLock);
+    FFILibrary* library = findFFILibrary(dllName, true);
+    if (library != NULL && library->handle == NULL) {
+        library->handle = openFFILibrary(library);
+        if (library->handle != NULL) {
+            library->generation++;
+            fprintf(stderr, "Loaded library %s from %s (%s)\n", library->name, library->path,
+                    library->mode == RTLD_NOW ? "now" : "lazy");
+        }
+    }
+    if (library != NULL && library->handle == NULL) library = NULL;
+    if (library != NULL) library->refCount++;
+    pthread_mutex_unlock(&ffiLibraryLock);
+    return library;
+}
+
+// Function to drop a reference to a library, closing it with the last one
+static void releaseFFILibrary(FFILibrary* library) {
+    pthread_mutex_lock(&ffiLibraryLock);
+    if (--library->refCount == 0) {
+        dlclose(library->handle);
+        fprintf(stderr, "Unloaded library %s\n", library->name);
+        library->handle = NULL;
+        free(library->path);
+        library->path = NULL;
+    }
+    pthread_mutex_unlock(&ffiLibraryLock);
+}
+
+// Helper function to register the #!library options of every FFI class,
+// options may be declared on any class using the library
+static void registerAllFFILibraries(WreniContext* ctx) {
+    pthread_mutex_lock(&ffiLibraryLock);
+    for (uint32_t i = 0; i < ctx->classesByName.capacity; i++) {
+        if (ctx->classesByName.slots[i].info != NULL) {
+            registerFFILibraries(ctx->classesByName.slots[i].info);
+        }
+    }
+    pthread_mutex_unlock(&ffiLibraryLock);
+}
+
+// Helper function to get a library for a class, the class takes a
+// reference the first time it uses the library
+static FFILibrary* getFFIClassLibrary(WrenVM* vm, FFIClassInfo* ffiClass, const char* dllName) {
+    if (ffiClass == NULL || dllName == NULL) return NULL;
+    
+    // A class uses a handful of libraries, the list is short
+    for (int i = 0; i < ffiClass->libraryCount; i++) {
+        if (strcmp(ffiClass->libraries[i]->name, dllName) == 0) {
+            return ffiClass->libraries[i];
+        }
+    }
+    
+    registerAllFFILibraries(getWreniContext(vm));
+    if (ffiClass->libraryCount == ffiClass->libraryCapacity) {
+        int capacity = ffiClass->libraryCapacity == 0 ? 4 : ffiClass->libraryCapacity * 2;
+        FFILibrary** libraries = realloc(ffiClass->libraries, capacity * sizeof(FFILibrary*));
+        if (libraries == NULL) return NULL;
+        ffiClass->libraries = libraries;
+        ffiClass->libraryCapacity = capacity;
+    }
+    
+    FFILibrary* library = acquireFFILibrary(dllName);
+    if (library == NULL) return NULL;
+    ffiClass->libraries[ffiClass->libraryCount++] = library;
+    return library;
+}
+
+// Helper function to get the handle of a library for a class
+static void* getOrLoadDllHandle(WrenVM* vm, FFIClassInfo* ffiClass, const char* dllName) {
+    FFILibrary* library = getFFIClassLibrary(vm, ffiClass, dllName);
+    return library != NULL ? library->handle : NULL;
+}
+
+// Helper function to release the libraries of a class
+static void unloadAllDllHandles(FFIClassInfo* ffiClass) {
+    if (ffiClass == NULL) return;
+    
+    for (int i = 0; i < ffiClass->libraryCount; i++) {
+        releaseFFILibrary(ffiClass->libraries[i]);
+    }
+    ffiClass->libraryCount = 0;
+}
+
+// Table of type names accepted in the args/ret strings of #!extern
+static const struct {
+    const char* name;
+    FFITypeTag tag;
+} ffiTypeNames[] = {
+    { "void",  FT_VOID },
+    { "i32",   FT_I32 },
+    { "i64",   FT_I64 },
+    { "f32",   FT_F32 },
+    { "f64",   FT_F64 },
+    { "bool",  FT_BOOL },
+    { "char*", FT_STRING },
+    { "ptr",   FT_PTR },
+    { "i8",    FT_I8 },
+    { "u8",    FT_U8 },
+    { "i16",   FT_I16 },
+    { "u16",   FT_U16 },
+    { "u32",   FT_U32 },
+};
+
+// Helper function to parse one type name of an args/ret signature
+static bool parseFFIType(const char* name, size_t len, FFITypeTag* tag) {
+    // Remove any surrounding whitespace
+    while (len > 0 && *name == ' ') { name++; len--; }
+    while (len > 0 && name[len - 1] == ' ') len--;
+    
+    for (size_t i = 0; i < sizeof(ffiTypeNames) / sizeof(ffiTypeNames[0]); i++) {
+        if (strlen(ffiTypeNames[i].name) == len && strncmp(ffiTypeNames[i].name, name, len) == 0) {
+            *tag = ffiTypeNames[i].tag;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Helper function to map a type tag to its libffi type
+static ffi_type* ffiTypeForTag(FFITypeTag tag) {
+    switch (tag) {
+        case FT_I32:    return &ffi_type_sint32;
+        case FT_I64:    return &ffi_type_sint64;
+        case FT_F32:    return &ffi_type_float;
+        case FT_F64:    return &ffi_type_double;
+        case FT_BOOL:   return &ffi_type_uint8;  // bool as 1 byte unsigned int
+        case FT_STRING: return &ffi_type_pointer;
+        case FT_PTR:    return &ffi_type_pointer;
+        case FT_CALLBACK: return &ffi_type_pointer;
+        case FT_I8:     return &ffi_type_sint8;
+        case FT_U8:     return &ffi_type_uint8;
+        case FT_I16:    return &ffi_type_sint16;
+        case FT_U16:    return &ffi_type_uint16;
+        case FT_U32:    return &ffi_type_uint32;
+        case FT_VOID:
+        default:        return &ffi_type_void;
+    }
+}
+
+// Registry of declared struct types. There are only a handful and they are
+// looked up when a call descriptor is compiled, never per call. Layouts are
+// shared by every VM, registering and looking them up holds ffiStructLock,
+// a registered type is never changed or freed.
+static FFIStructType** ffiStructs = NULL;
+static int ffiStructCount = 0;
+static int ffiStructCapacity = 0;
+static pthread_mutex_t ffiStructLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Function to find a declared struct type by name
+static FFIStructType* findFFIStruct(const char* name, size_t len) {
+    for (int i = 0; i < ffiStructCount; i++) {
+        if (strlen(ffiStructs[i]->name) == len && strncmp(ffiStructs[i]->name, name, len) == 0) {
+            return ffiStructs[i];
+        }
+    }
+    return NULL;
+}
+
+// Helper function to parse a scalar type name or the name of a declared
+// struct, [structType] is set for FT_STRUCT
+static bool parseFFITypeName(const char* name, size_t len, FFITypeTag* tag, FFIStructType** structType) {
+    *structType = NULL;
+    if (parseFFIType(name, len, tag)) return true;
+    
+    while (len > 0 && *name == ' ') { name++; len--; }
+    while (len > 0 && name[len - 1] == ' ') len--;
+    
+    *structType = findFFIStruct(name, len);
+    if (*structType == NULL) return false;
+    *tag = FT_STRUCT;
+    return true;
+}
+
+// Function to build and register the layout of one struct type
+static FFIStructType* addFFIStruct(const char* name, const char* fields) {
+    int fieldCount = 1;
+    for (const char* p = fields; *p; p++) {
+        if (*p == ',') fieldCount++;
+    }
+    
+    FFIStructType* st = calloc(1, sizeof(FFIStructType));
+    if (st == NULL) return NULL;
+    st->name = strdup(name);
+    st->fieldCount = fieldCount;
+    st->fieldTags = malloc(fieldCount * sizeof(FFITypeTag));
+    st->fieldStructs = malloc(fieldCount * sizeof(FFIStructType*));
+    st->offsets = malloc(fieldCount * sizeof(size_t));
+    st->elements = malloc((fieldCount + 1) * sizeof(ffi_type*));
+    
+    const char* start = fields;
+    bool valid = st->fieldTags && st->fieldStructs && st->offsets && st->elements;
+    for (int i = 0; valid && i < fieldCount; i++) {
+        const char* end = strchr(start, ',');
+        if (end == NULL) end = start + strlen(start);
+        
+        // Fields are plain values or previously declared structs
+        valid = parseFFITypeName(start, end - start, &st->fieldTags[i], &st->fieldStructs[i]) &&
+                st->fieldTags[i] != FT_VOID && st->fieldTags[i] != FT_STRING;
+        if (valid) {
+            st->elements[i] = st->fieldStructs[i] ? &st->fieldStructs[i]->type : ffiTypeForTag(st->fieldTags[i]);
+        } else {
+            fprintf(stderr, "Unsupported field type '%.*s' in struct %s\n", (int)(end - start), start, name);
+        }
+        start = end + 1;
+    }
+    
+    if (valid) {
+        st->elements[fieldCount] = NULL;
+        st->type.size = 0;
+        st->type.alignment = 0;
+        st->type.type = FFI_TYPE_STRUCT;
+        st->type.elements = st->elements;
+        valid = ffi_get_struct_offsets(FFI_DEFAULT_ABI, &st->type, st->offsets) == FFI_OK &&
+                st->type.size <= FFI_STRUCT_SCRATCH_SIZE;
+    }
+    
+    if (valid && ffiStructCount == ffiStructCapacity) {
+        int capacity = ffiStructCapacity == 0 ? 8 : ffiStructCapacity * 2;
+        FFIStructType** structs = realloc(ffiStructs, capacity * sizeof(FFIStructType*));
+        valid = structs != NULL;
+        if (valid) {
+            ffiStructs = structs;
+            ffiStructCapacity = capacity;
+        }
+    }
+    
+    if (!valid) {
+        fprintf(stderr, "Could not register FFI struct %s(%s)\n", name, fields);
+        free(st->name);
+        free(st->fieldTags);
+        free(st->fieldStructs);
+        free(st->offsets);
+        free(st->elements);
+        free(st);
+        return NULL;
+    }
+    
+    ffiStructs[ffiStructCount++] = st;
+    fprintf(stderr, "Registered FFI struct %s(%s), %zu bytes\n", name, fields, st->type.size);
+    return st;
+}
+
+// Registry of declared callback types, shared and locked like the structs
+static FFICallbackType** ffiCallbackTypes = NULL;
+static int ffiCallbackTypeCount = 0;
+static int ffiCallbackTypeCapacity = 0;
+
+// Function to find a declared callback type by name
+static FFICallbackType* findFFICallbackType(const char* name, size_t len) {
+    while (len > 0 && *name == ' ') { name++; len--; }
+    while (len > 0 && name[len - 1] == ' ') len--;
+    
+    for (int i = 0; i < ffiCallbackTypeCount; i++) {
+        if (strlen(ffiCallbackTypes[i]->name) == len && strncmp(ffiCallbackTypes[i]->name, name, len) == 0) {
+            return ffiCallbackTypes[i];
+        }
+    }
+    return NULL;
+}
+
+// Function to register one callback type. Arguments and the return value
+// take the scalar types, arguments char* too. Structs aren't supported.
+static FFICallbackType* addFFICallbackType(const char* name, const char* args, const char* ret) {
+    FFICallbackType* type = calloc(1, sizeof(FFICallbackType));
+    if (type == NULL) return NULL;
+    
+    int argCount = 0;
+    if (args[strspn(args, " ")] != '\0') {
+        argCount = 1;
+        for (const char* p = args; *p; p++) {
+            if (*p == ',') argCount++;
+        }
+    }
+    
+    type->name = strdup(name);
+    type->argCount = argCount;
+    type->argTags = malloc((argCount + 1) * sizeof(FFITypeTag));
+    type->argTypes = malloc((argCount + 1) * sizeof(ffi_type*));
+    
+    FFIStructType* structType = NULL;
+    bool valid = type->name && type->argTags && type->argTypes && argCount <= FFI_MAX_ARGS &&
+                 parseFFITypeName(ret, strlen(ret), &type->retTag, &structType) &&
+                 structType == NULL && type->retTag != FT_STRING;
+    const char* start = args;
+    for (int i = 0; valid && i < argCount; i++) {
+        const char* end = strchr(start, ',');
+        if (end == NULL) end = start + strlen(start);
+        valid = parseFFITypeName(start, end - start, &type->argTags[i], &structType) &&
+                structType == NULL && type->argTags[i] != FT_VOID;
+        type->argTypes[i] = ffiTypeForTag(type->argTags[i]);
+        start = end + 1;
+    }
+    
+    valid = valid && ffi_prep_cif(&type->cif, FFI_DEFAULT_ABI, argCount, ffiTypeForTag(type->retTag),
+                                  type->argTypes) == FFI_OK;
+    
+    if (valid && ffiCallbackTypeCount == ffiCallbackTypeCapacity) {
+        int capacity = ffiCallbackTypeCapacity == 0 ? 8 : ffiCallbackTypeCapacity * 2;
+        FFICallbackType** types = realloc(ffiCallbackTypes, capacity * sizeof(FFICallbackType*));
+        valid = types != NULL;
+        if (valid) {
+            ffiCallbackTypes = types;
+            ffiCallbackTypeCapacity = capacity;
+        }
+    }
+    
+    if (!valid) {
+        fprintf(stderr, "Could not register FFI callback %s(%s)%s\n", name, args, ret);
+        free(type->name);
+        free(type->argTags);
+        free(type->argTypes);
+        free(type);
+        return NULL;
+    }
+    
+    ffiCallbackTypes[ffiCallbackTypeCount++] = type;
+    fprintf(stderr, "Registered FFI callback %s(%s)%s\n", name, args, ret);
+    return type;
+}
+
+// Function to register the #!callback declarations of an FFI class. Every
+// declaration gives name, args and ret, "void" for none, so the lists of
+// the group line up.
+static void registerFFICallbackTypes(FFIClassInfo* ffiClass, ObjMap* group) {
+    ObjList* names = getFFIAttributeList(group, "name");
+    ObjList* args = getFFIAttributeList(group, "args");
+    ObjList* rets = getFFIAttributeList(group, "ret");
+    if (names == NULL || args == NULL || rets == NULL ||
+        args->elements.count != names->elements.count || rets->elements.count != names->elements.count) {
+        fprintf(stderr, "#!callback of %s needs name, args and ret on every declaration\n", ffiClass->className);
+        return;
+    }
+    
+    for (int k = 0; k < names->elements.count; k++) {
+        Value name = names->elements.data[k];
+        Value callbackArgs = args->elements.data[k];
+        Value ret = rets->elements.data[k];
+        if (!IS_STRING(name) || !IS_STRING(callbackArgs) || !IS_STRING(ret)) continue;
         
-        fprintf(stderr, "Making FFI call to %s with %d arguments\n", ffiFnName, arg_count);
+        if (findFFICallbackType(AS_STRING(name)->value, AS_STRING(name)->length) != NULL) {
+            fprintf(stderr, "FFI callback %s already declared, keeping the first one\n", AS_STRING(name)->value);
+            continue;
+        }
+        addFFICallbackType(AS_STRING(name)->value, AS_STRING(callbackArgs)->value, AS_STRING(ret)->value);
+    }
+}
+
+// Function to register the #!struct and #!callback declarations of an FFI class. Class
+// attributes only exist once the class body is complete, so this runs when
+// a descriptor is compiled rather than when the class is bound.
+static void registerFFIStructs(FFIClassInfo* ffiClass) {
+    ObjClass* classObj = ffiClass->classObj;
+    if (ffiClass->structsRegistered || classObj == NULL || classObj->attributes == 0 ||
+        !IS_INSTANCE(classObj->attributes)) {
+        return;
+    }
+    ffiClass->structsRegistered = true;
+    
+    // fields[0] is the class's attributes, each #!struct adds one name and fields
+    Value classAttrs = AS_INSTANCE(classObj->attributes)->fields[0];
+    if (!IS_MAP(classAttrs)) return;
+    
+    ObjMap* attrs = AS_MAP(classAttrs);
+    for (uint32_t i = 0; i < attrs->capacity; i++) {
+        MapEntry* entry = &attrs->entries[i];
+        if (!IS_UNDEFINED(entry->key) && IS_STRING(entry->key) && IS_MAP(entry->value) &&
+            strcmp(AS_STRING(entry->key)->value, "callback") == 0) {
+            registerFFICallbackTypes(ffiClass, AS_MAP(entry->value));
+            continue;
+        }
+        if (IS_UNDEFINED(entry->key) || !IS_STRING(entry->key) ||
+            strcmp(AS_STRING(entry->key)->value, "struct") != 0 || !IS_MAP(entry->value)) {
+            continue;
+        }
         
-        ffi_call(&cif, FFI_FN(func), result, arg_values);
+        ObjMap* structMap = AS_MAP(entry->value);
+        ObjList* names = NULL;
+        ObjList* fields = NULL;
+        for (uint32_t j = 0; j < structMap->capacity; j++) {
+            MapEntry* field = &structMap->entries[j];
+            if (IS_UNDEFINED(field->key) || !IS_STRING(field->key) || !IS_LIST(field->value)) continue;
+            if (strcmp(AS_STRING(field->key)->value, "name") == 0) names = AS_LIST(field->value);
+            if (strcmp(AS_STRING(field->key)->value, "fields") == 0) fields = AS_LIST(field->value);
+        }
+        if (names == NULL || fields == NULL) continue;
         
-        // Handle return value
-        if (result != NULL) {
-            if (ret_type == &ffi_type_sint64) {
-                int64_t ret_val = *(int64_t*)result;
-                fprintf(stderr, "FFI call returned: %ld\n", ret_val);
-                
-                // Set return value in Wren
-                if (strcmp(retSignature, "i64") == 0) {
-                    wrenSetSlotDouble(vm, 0, (double)ret_val);
-                }
-            } else if (ret_type == &ffi_type_float) {
-                float ret_val = *(float*)result;
-                fprintf(stderr, "FFI call returned: %f\n", ret_val);
-                
-                // Set return value in Wren
-                if (strcmp(retSignature, "f32") == 0) {
-                    wrenSetSlotDouble(vm, 0, (double)ret_val);
-                }
-            } else if (ret_type == &ffi_type_uint8) {
-                uint8_t ret_val = *(uint8_t*)result;
-                fprintf(stderr, "FFI call returned: %u (bool)\n", ret_val);
-                
-                // Set return value in Wren
-                if (strcmp(retSignature, "bool") == 0) {
-                    wrenSetSlotBool(vm, 0, ret_val != 0);
+        // Declarations are in source order, so a struct can use earlier ones
+        for (int k = 0; k < names->elements.count && k < fields->elements.count; k++) {
+            Value name = names->elements.data[k];
+            Value layout = fields->elements.data[k];
+            if (!IS_STRING(name) || !IS_STRING(layout)) continue;
+            
+            FFIStructType* existing = findFFIStruct(AS_STRING(name)->value, AS_STRING(name)->length);
+            if (existing != NULL) {
+                fprintf(stderr, "FFI struct %s already declared, keeping the first layout\n", existing->name);
+                continue;
+            }
+            addFFIStruct(AS_STRING(name)->value, AS_STRING(layout)->value);
+        }
+    }
+}
+
+// Helper function to register the structs of every FFI class defined so far,
+// a method may use a struct declared on another class
+static void registerAllFFIStructs(WreniContext* ctx) {
+    pthread_mutex_lock(&ffiStructLock);
+    for (uint32_t i = 0; i < ctx->classesByName.capacity; i++) {
+        if (ctx->classesByName.slots[i].info != NULL) {
+            registerFFIStructs(ctx->classesByName.slots[i].info);
+        }
+    }
+    pthread_mutex_unlock(&ffiStructLock);
+}
+
+// Callback pools grow by this many closures and up to FFI_CALLBACK_MAX_SLOTS
+// per type, callbacks may nest FFI_CALLBACK_MAX_DEPTH deep
+#define FFI_CALLBACK_POOL_SIZE 16
+#define FFI_CALLBACK_MAX_SLOTS 1024
+#define FFI_CALLBACK_MAX_DEPTH 4
+
+// One closure of a callback pool and the Fn it is bound to. Slots are bound
+// and released on the thread of their VM, a callback fired on another
+// thread can't enter the VM and is dropped.
+struct FFICallbackSlot {
+    FFICallbackType* type;
+    ffi_closure* closure;
+    void* code;                // Native function pointer handed to C
+    WrenVM* vm;                // NULL while the slot is free
+    WrenHandle* fn;
+    pthread_t thread;
+    // Counters for FFI.callbackStats
+    uint64_t calls;
+    uint64_t dropped;
+    uint64_t errors;
+    uint64_t totalNs;
+    uint64_t maxNs;
+};
+
+// Binding and releasing slots and growing pools hold ffiCallbackLock
+static pthread_mutex_t ffiCallbackLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Helper function to put a value returned by a callback into [ret], zero
+// when it isn't a Num or the callback didn't run. libffi wants integral
+// returns widened to a full ffi_arg.
+static void setFFICallbackReturn(FFITypeTag tag, void* ret, Value value) {
+    double num = IS_NUM(value) ? AS_NUM(value) : 0;
+    switch (tag) {
+        case FT_F32:  *(float*)ret = (float)num; break;
+        case FT_F64:  *(double*)ret = num; break;
+        case FT_I64:  *(int64_t*)ret = (int64_t)num; break;
+        case FT_PTR:  *(void**)ret = (void*)(intptr_t)num; break;
+        case FT_BOOL: *(ffi_arg*)ret = !IS_FALSE(value) && !IS_NULL(value) && !IS_UNDEFINED(value); break;
+        case FT_I8:   *(ffi_sarg*)ret = (int8_t)(int64_t)num; break;
+        case FT_I16:  *(ffi_sarg*)ret = (int16_t)(int64_t)num; break;
+        case FT_I32:  *(ffi_sarg*)ret = (int32_t)(int64_t)num; break;
+        case FT_U8:   *(ffi_arg*)ret = (uint8_t)(int64_t)num; break;
+        case FT_U16:  *(ffi_arg*)ret = (uint16_t)(int64_t)num; break;
+        case FT_U32:  *(ffi_arg*)ret = (uint32_t)(int64_t)num; break;
+        default: break;
+    }
+}
+
+// Closure handler of every callback slot: calls the bound Fn with the C
+// arguments and hands its result back. The Fn runs on a fiber of its own,
+// since the fiber of the VM may be inside the foreign call that fired the
+// callback, like a qsort comparator.
+static void ffiCallbackHandler(ffi_cif* cif, void* ret, void** args, void* userData) {
+    FFICallbackSlot* slot = userData;
+    FFICallbackType* type = slot->type;
+    WrenVM* vm = slot->vm;
+    setFFICallbackReturn(type->retTag, ret, UNDEFINED_VAL);
+    
+    if (vm == NULL || !pthread_equal(pthread_self(), slot->thread) ||
+        getWreniContext(vm)->callbackDepth >= FFI_CALLBACK_MAX_DEPTH) {
+        __atomic_fetch_add(&slot->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    
+    WreniContext* ctx = getWreniContext(vm);
+    ObjFiber* fiber = vm->fiber;
+    Value* apiStack = vm->apiStack;
+    if (fiber != NULL) wrenPushRoot(vm, (Obj*)fiber);
+    ctx->callbackDepth++;
+    
+    // Without an API stack the next slot call makes a new fiber
+    vm->apiStack = NULL;
+    wrenEnsureSlots(vm, type->argCount + 1);
+    wrenSetSlotHandle(vm, 0, slot->fn);
+    for (int i = 0; i < type->argCount; i++) {
+        void* arg = args[i];
+        switch (type->argTags[i]) {
+            case FT_I8:   wrenSetSlotDouble(vm, i + 1, *(int8_t*)arg); break;
+            case FT_U8:   wrenSetSlotDouble(vm, i + 1, *(uint8_t*)arg); break;
+            case FT_I16:  wrenSetSlotDouble(vm, i + 1, *(int16_t*)arg); break;
+            case FT_U16:  wrenSetSlotDouble(vm, i + 1, *(uint16_t*)arg); break;
+            case FT_I32:  wrenSetSlotDouble(vm, i + 1, *(int32_t*)arg); break;
+            case FT_U32:  wrenSetSlotDouble(vm, i + 1, *(uint32_t*)arg); break;
+            case FT_I64:  wrenSetSlotDouble(vm, i + 1, (double)*(int64_t*)arg); break;
+            case FT_F32:  wrenSetSlotDouble(vm, i + 1, *(float*)arg); break;
+            case FT_F64:  wrenSetSlotDouble(vm, i + 1, *(double*)arg); break;
+            case FT_BOOL: wrenSetSlotBool(vm, i + 1, *(uint8_t*)arg != 0); break;
+            case FT_STRING:
+                if (*(const char**)arg != NULL) {
+                    wrenSetSlotString(vm, i + 1, *(const char**)arg);
+                } else {
+                    wrenSetSlotNull(vm, i + 1);
                 }
-            } else {
-                int ret_val = *(int*)result;
-                fprintf(stderr, "FFI call returned: %d\n", ret_val);
-                
-                // Set return value in Wren
-                if (strcmp(retSignature, "i32") == 0) {
-                    wrenSetSlotDouble(vm, 0, ret_val);
+                break;
+            default:
+                if (*(void**)arg != NULL) {
+                    wrenSetSlotDouble(vm, i + 1, (double)(uintptr_t)*(void**)arg);
+                } else {
+                    wrenSetSlotNull(vm, i + 1);
                 }
-            }
-            free(result);
+                break;
         }
-        
-        if (arg_types) free(arg_types);
-        if (arg_values) free(arg_values);
-        if (int_args) free(int_args);
-        if (i64_args) free(i64_args);
-        if (f32_args) free(f32_args);
-        if (str_args) free(str_args);
-        
-        // NOTE: DLL handle is cached in FFIClassInfo, don't unload here
-        fprintf(stderr, "DLL handle cached in FFIClassInfo for %s\n", dllName);
+    }
+    
+    if (wrenCall(vm, ctx->callHandles[type->argCount]) == WREN_RESULT_SUCCESS) {
+        if (type->retTag != FT_VOID) setFFICallbackReturn(type->retTag, ret, vm->apiStack[0]);
     } else {
-        fprintf(stderr, "Missing required FFI information:\n");
-        fprintf(stderr, "  dllName: %s\n", dllName ? dllName : "NULL");
-        fprintf(stderr, "  methodName: %s\n", methodName ? methodName : "NULL");
-        fprintf(stderr, "  targetClass: %p\n", targetClass);
-        wrenSetSlotString(vm, 0, "Missing FFI metadata");
-        wrenAbortFiber(vm, 0);
+        slot->errors++;
+    }
+    
+    ctx->callbackDepth--;
+    vm->fiber = fiber;
+    vm->apiStack = apiStack;
+    if (fiber != NULL) wrenPopRoot(vm);
+    
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    uint64_t ns = (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000u + (end.tv_nsec - start.tv_nsec);
+    slot->calls++;
+    slot->totalNs += ns;
+    if (ns > slot->maxNs) slot->maxNs = ns;
+}
+
+// Helper function to add a block of prepared closures to a pool, hold
+// ffiCallbackLock when calling
+static bool growFFICallbackPool(FFICallbackType* type) {
+    if ((type->blockCount + 1) * FFI_CALLBACK_POOL_SIZE > FFI_CALLBACK_MAX_SLOTS) return false;
+    
+    FFICallbackSlot** blocks = realloc(type->blocks, (type->blockCount + 1) * sizeof(FFICallbackSlot*));
+    if (blocks == NULL) return false;
+    type->blocks = blocks;
+    
+    FFICallbackSlot* block = calloc(FFI_CALLBACK_POOL_SIZE, sizeof(FFICallbackSlot));
+    if (block == NULL) return false;
+    for (int i = 0; i < FFI_CALLBACK_POOL_SIZE; i++) {
+        FFICallbackSlot* slot = &block[i];
+        slot->type = type;
+        slot->closure = ffi_closure_alloc(sizeof(ffi_closure), &slot->code);
+        if (slot->closure == NULL ||
+            ffi_prep_closure_loc(slot->closure, &type->cif, ffiCallbackHandler, slot, slot->code) != FFI_OK) {
+            for (int j = 0; j <= i; j++) {
+                if (block[j].closure != NULL) ffi_closure_free(block[j].closure);
+            }
+            free(block);
+            return false;
+        }
+    }
+    type->blocks[type->blockCount++] = block;
+    return true;
+}
+
+// Function to get the native function pointer calling [fn] for [type].
+// A Fn already bound keeps its slot, so passing the same Fn every frame
+// uses one closure. Returns NULL with [error] set when it can't be bound.
+static void* bindFFICallback(WrenVM* vm, FFICallbackType* type, Value fn, const char** error) {
+    if (!IS_CLOSURE(fn)) {
+        *error = "Expected a Fn argument for a callback";
+        return NULL;
+    }
+    if (AS_CLOSURE(fn)->fn->arity > type->argCount) {
+        *error = "Callback Fn takes more parameters than the callback passes";
+        return NULL;
+    }
+    
+    WreniContext* ctx = getWreniContext(vm);
+    if (ctx->callHandles[type->argCount] == NULL) {
+        char signature[64] = "call";
+        if (type->argCount > 0) {
+            strcat(signature, "(");
+            for (int i = 0; i < type->argCount; i++) strcat(signature, i > 0 ? ",_" : "_");
+            strcat(signature, ")");
+        }
+        ctx->callHandles[type->argCount] = wrenMakeCallHandle(vm, signature);
+    }
+    
+    pthread_mutex_lock(&ffiCallbackLock);
+    FFICallbackSlot* unused = NULL;
+    for (int b = 0; b < type->blockCount; b++) {
+        for (int i = 0; i < FFI_CALLBACK_POOL_SIZE; i++) {
+            FFICallbackSlot* slot = &type->blocks[b][i];
+            if (slot->vm == vm && wrenValuesSame(slot->fn->value, fn)) {
+                pthread_mutex_unlock(&ffiCallbackLock);
+                return slot->code;
+            }
+            if (slot->vm == NULL && unused == NULL) unused = slot;
+        }
+    }
+    
+    if (unused == NULL && growFFICallbackPool(type)) {
+        unused = &type->blocks[type->blockCount - 1][0];
+    }
+    if (unused == NULL) {
+        pthread_mutex_unlock(&ffiCallbackLock);
+        *error = "Callback pool exhausted, release callbacks with FFI.releaseCallback";
+        return NULL;
+    }
+    
+    unused->vm = vm;
+    unused->thread = pthread_self();
+    unused->fn = wrenMakeHandle(vm, fn);
+    pthread_mutex_unlock(&ffiCallbackLock);
+    return unused->code;
+}
+
+// Function to release the slots bound to [fn] by a VM, or all of its slots
+// when [fn] is undefined. Returns the number of slots released.
+static int releaseFFICallbacks(WrenVM* vm, Value fn) {
+    int released = 0;
+    pthread_mutex_lock(&ffiStructLock);
+    pthread_mutex_lock(&ffiCallbackLock);
+    for (int t = 0; t < ffiCallbackTypeCount; t++) {
+        FFICallbackType* type = ffiCallbackTypes[t];
+        for (int b = 0; b < type->blockCount; b++) {
+            for (int i = 0; i < FFI_CALLBACK_POOL_SIZE; i++) {
+                FFICallbackSlot* slot = &type->blocks[b][i];
+                if (slot->vm != vm || (!IS_UNDEFINED(fn) && !wrenValuesSame(slot->fn->value, fn))) continue;
+                wrenReleaseHandle(vm, slot->fn);
+                slot->fn = NULL;
+                slot->vm = NULL;
+                released++;
+            }
+        }
+    }
+    pthread_mutex_unlock(&ffiCallbackLock);
+    pthread_mutex_unlock(&ffiStructLock);
+    return released;
+}
+
+// Helpers to store and read one scalar value of the given type in memory
+static void writeFFIScalar(FFITypeTag tag, void* p, double value) {
+    switch (tag) {
+        case FT_I8:   *(int8_t*)p = (int8_t)(int64_t)value; break;
+        case FT_U8:   *(uint8_t*)p = (uint8_t)(int64_t)value; break;
+        case FT_I16:  *(int16_t*)p = (int16_t)(int64_t)value; break;
+        case FT_U16:  *(uint16_t*)p = (uint16_t)(int64_t)value; break;
+        case FT_I32:  *(int32_t*)p = (int32_t)(int64_t)value; break;
+        case FT_U32:  *(uint32_t*)p = (uint32_t)(int64_t)value; break;
+        case FT_I64:  *(int64_t*)p = (int64_t)value; break;
+        case FT_F32:  *(float*)p = (float)value; break;
+        case FT_F64:  *(double*)p = value; break;
+        case FT_BOOL: *(uint8_t*)p = value != 0; break;
+        case FT_PTR:  *(void**)p = (void*)(intptr_t)value; break;
+        default: break;
+    }
+}
+
+static double readFFIScalar(FFITypeTag tag, const void* p) {
+    switch (tag) {
+        case FT_I8:   return *(const int8_t*)p;
+        case FT_U8:   return *(const uint8_t*)p;
+        case FT_I16:  return *(const int16_t*)p;
+        case FT_U16:  return *(const uint16_t*)p;
+        case FT_I32:  return *(const int32_t*)p;
+        case FT_U32:  return *(const uint32_t*)p;
+        case FT_I64:  return (double)*(const int64_t*)p;
+        case FT_F32:  return *(const float*)p;
+        case FT_F64:  return *(const double*)p;
+        case FT_BOOL: return *(const uint8_t*)p;
+        case FT_PTR:  return (double)(intptr_t)*(void* const*)p;
+        default:      return 0;
+    }
+}
+
+// Native memory of ffi Buffers, shared by a buffer and its slices and typed
+// views and freed when the last of them is finalized
+struct FFIBufferBlock {
+    int refCount;
+    size_t size;
+    uint8_t* bytes;        // 32-byte aligned, zero filled
+};
+
+// Foreign data of a Buffer instance: a typed view on a block
+typedef struct {
+    FFIBufferBlock* block;
+    uint8_t* data;         // First element of the view
+    uint32_t count;
+    uint32_t elementSize;
+    FFITypeTag type;
+} FFIBuffer;
+
+// Function to get the Buffer behind a value, NULL if it isn't one
+static inline FFIBuffer* getFFIBuffer(WrenVM* vm, Value value) {
+    ObjClass* bufferClass = getWreniContext(vm)->bufferClass;
+    if (!IS_FOREIGN(value) || bufferClass == NULL ||
+        AS_FOREIGN(value)->obj.classObj != bufferClass) {
+        return NULL;
+    }
+    return (FFIBuffer*)AS_FOREIGN(value)->data;
+}
+
+static void retainFFIBufferBlock(FFIBufferBlock* block) {
+    block->refCount++;
+}
+
+static void releaseFFIBufferBlock(FFIBufferBlock* block) {
+    if (block != NULL && --block->refCount == 0) {
+        free(block->bytes);
+        free(block);
+    }
+}
+
+// Helper function to get the payload slot of an FFI instance, NULL when its
+// class has no payload or it was destroyed
+static inline FFIPayloadSlot* getFFIPayloadSlot(Value value) {
+    return IS_FOREIGN(value) ? *(FFIPayloadSlot**)AS_FOREIGN(value)->data : NULL;
+}
+
+// Function to pack a Wren value into the layout of a struct. A List holds
+// one element per field (nested Lists for struct fields), a Buffer is taken
+// to hold the struct's bytes, so is the payload of an FFI instance declared
+// with #!payload of the same struct. Other foreign objects are refused, their
+// size and layout are unknown. Returns an error or NULL.
+static const char* packFFIStruct(WrenVM* vm, FFIStructType* st, Value value, uint8_t* out) {
+    FFIBuffer* buffer = getFFIBuffer(vm, value);
+    if (buffer != NULL) {
+        if ((size_t)buffer->count * buffer->elementSize < st->type.size) {
+            return "Buffer is smaller than the struct";
+        }
+        memcpy(out, buffer->data, st->type.size);
+        return NULL;
+    }
+    if (IS_FOREIGN(value)) {
+        FFIPayloadSlot* slot = NULL;
+        if (findFFIClassByObject(getWreniContext(vm), AS_FOREIGN(value)->obj.classObj) != NULL) {
+            slot = getFFIPayloadSlot(value);
+        }
+        if (slot == NULL || slot->pool->type != st) {
+            return "Expected a List, a Buffer or an instance with a payload of the struct";
+        }
+        memcpy(out, slot->bytes, st->type.size);
+        return NULL;
+    }
+    
+    if (!IS_LIST(value) || AS_LIST(value)->elements.count != st->fieldCount) {
+        return "Expected a List with one element per struct field";
+    }
+    
+    Value* elements = AS_LIST(value)->elements.data;
+    for (int i = 0; i < st->fieldCount; i++) {
+        uint8_t* field = out + st->offsets[i];
+        Value element = elements[i];
+        switch (st->fieldTags[i]) {
+            case FT_STRUCT: {
+                const char* error = packFFIStruct(vm, st->fieldStructs[i], element, field);
+                if (error != NULL) return error;
+                break;
+            }
+            case FT_BOOL:
+                *field = !IS_FALSE(element) && !IS_NULL(element);
+                break;
+            case FT_PTR:
+                if (IS_NULL(element)) {
+                    *(void**)field = NULL;
+                    break;
+                }
+                // fall through
+            default:
+                if (!IS_NUM(element)) return "Expected a Num struct field";
+                writeFFIScalar(st->fieldTags[i], field, AS_NUM(element));
+                break;
+        }
     }
+    return NULL;
+}
+
+// Function to unpack a struct returned by value into a List of its fields,
+// read straight from the return buffer on the C stack
+static Value unpackFFIStruct(WrenVM* vm, FFIStructType* st, const uint8_t* data) {
+    ObjList* list = wrenNewList(vm, st->fieldCount);
+    for (int i = 0; i < st->fieldCount; i++) {
+        list->elements.data[i] = NULL_VAL;
+    }
+    
+    // Nested structs allocate, keep the outer list reachable meanwhile
+    wrenPushRoot(vm, (Obj*)list);
+    for (int i = 0; i < st->fieldCount; i++) {
+        const uint8_t* field = data + st->offsets[i];
+        switch (st->fieldTags[i]) {
+            case FT_STRUCT: list->elements.data[i] = unpackFFIStruct(vm, st->fieldStructs[i], field); break;
+            case FT_BOOL:   list->elements.data[i] = BOOL_VAL(*field != 0); break;
+            default:        list->elements.data[i] = NUM_VAL(readFFIScalar(st->fieldTags[i], field)); break;
+        }
+    }
+    wrenPopRoot(vm);
+    
+    return OBJ_VAL(list);
+}
+
+// Helper function to find the direct-call thunk for a descriptor, in the
+// shape numbering of tools/gen_thunks.sh. Integer and pointer arguments
+// share one class since they are all passed widened in general registers.
+static FFIThunk ffiThunkFor(FFITypeTag retTag, const FFITypeTag* argTags, int argCount) {
+    if (!FFI_DIRECT_THUNKS || argCount > FFI_THUNK_MAX_ARGS) return NULL;
+    
+    int retClass;
+    switch (retTag) {
+        case FT_VOID: retClass = 0; break;
+        case FT_F32:  retClass = 2; break;
+        case FT_F64:  retClass = 3; break;
+        default:      retClass = 1; break;
+    }
+    
+    // Shapes of lower arities come first: 3^0 + ... + 3^(argCount-1)
+    int index = 0;
+    int shapesBefore = 0;
+    int power = 1;
+    for (int i = 0; i < argCount; i++) {
+        shapesBefore += power;
+        power *= 3;
+        
+        int argClass;
+        switch (argTags[i]) {
+            case FT_F32: argClass = 1; break;
+            case FT_F64: argClass = 2; break;
+            default:     argClass = 0; break;
+        }
+        index = index * 3 + argClass;
+    }
+    
+    return ffiThunks[retClass][shapesBefore + index];
+}
+
+// Helper function to align an offset of the struct scratch buffer for [st]
+static inline size_t alignFFIStructOffset(size_t offset, const FFIStructType* st) {
+    size_t alignment = st->type.alignment;
+    return (offset + alignment - 1) & ~(alignment - 1);
+}
+
+// Call descriptor shared by every method that binds the same function with
+// the same signature, in any VM. Keyed by library, the library's generation
+// so a reopened library gets new ones, symbol and args/ret strings. Methods
+// copy the fields, descriptors are never changed or freed once published.
+typedef struct {
+    char* key;
+    uint32_t hash;
+    void* fnPtr;
+    ffi_cif cif;
+    int argCount;
+    FFITypeTag* argTags;
+    ffi_type** argTypes;
+    FFIStructType** argStructs;
+    FFICallbackType** argCallbacks;
+    FFITypeTag retTag;
+    FFIStructType* retStruct;
+    FFIThunk thunk;
+} FFIDescriptor;
+
+// Process-wide descriptor table, read-mostly: lookups take the read lock,
+// publishing a new descriptor the write lock
+static struct {
+    FFIDescriptor** slots;
+    uint32_t capacity;
+    uint32_t count;
+} ffiDescriptors = {0};
+static pthread_rwlock_t ffiDescriptorLock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Function to find a published descriptor, hold the lock when calling
+static FFIDescriptor* findFFIDescriptor(const char* key, uint32_t hash) {
+    if (ffiDescriptors.count == 0) return NULL;
+    
+    uint32_t mask = ffiDescriptors.capacity - 1;
+    for (uint32_t i = hash & mask; ffiDescriptors.slots[i] != NULL; i = (i + 1) & mask) {
+        FFIDescriptor* descriptor = ffiDescriptors.slots[i];
+        if (descriptor->hash == hash && strcmp(descriptor->key, key) == 0) return descriptor;
+    }
+    return NULL;
+}
+
+// Function to publish a descriptor, returns the one already published for
+// its key if another thread was first
+static FFIDescriptor* publishFFIDescriptor(FFIDescriptor* descriptor) {
+    pthread_rwlock_wrlock(&ffiDescriptorLock);
+    FFIDescriptor* existing = findFFIDescriptor(descriptor->key, descriptor->hash);
+    if (existing != NULL) {
+        pthread_rwlock_unlock(&ffiDescriptorLock);
+        return existing;
+    }
+    
+    if ((ffiDescriptors.count + 1) * 4 > ffiDescriptors.capacity * 3) {
+        uint32_t capacity = ffiDescriptors.capacity == 0 ? FFI_TABLE_MIN_CAPACITY : ffiDescriptors.capacity * 2;
+        FFIDescriptor** slots = calloc(capacity, sizeof(FFIDescriptor*));
+        if (slots == NULL) {
+            // Unpublished, the descriptor then belongs to its method alone
+            pthread_rwlock_unlock(&ffiDescriptorLock);
+            return descriptor;
+        }
+        for (uint32_t i = 0; i < ffiDescriptors.capacity; i++) {
+            if (ffiDescriptors.slots[i] == NULL) continue;
+            uint32_t j = ffiDescriptors.slots[i]->hash & (capacity - 1);
+            while (slots[j] != NULL) j = (j + 1) & (capacity - 1);
+            slots[j] = ffiDescriptors.slots[i];
+        }
+        free(ffiDescriptors.slots);
+        ffiDescriptors.slots = slots;
+        ffiDescriptors.capacity = capacity;
+    }
+    
+    uint32_t mask = ffiDescriptors.capacity - 1;
+    uint32_t i = descriptor->hash & mask;
+    while (ffiDescriptors.slots[i] != NULL) i = (i + 1) & mask;
+    ffiDescriptors.slots[i] = descriptor;
+    ffiDescriptors.count++;
+    pthread_rwlock_unlock(&ffiDescriptorLock);
+    return descriptor;
+}
+
+// Helper function to copy a descriptor into a method, its arrays are shared
+static void applyFFIDescriptor(FFIMethodInfo* methodInfo, const FFIDescriptor* descriptor) {
+    methodInfo->fnPtr = descriptor->fnPtr;
+    methodInfo->cif = descriptor->cif;
+    methodInfo->argCount = descriptor->argCount;
+    methodInfo->argTags = descriptor->argTags;
+    methodInfo->argTypes = descriptor->argTypes;
+    methodInfo->argStructs = descriptor->argStructs;
+    methodInfo->argCallbacks = descriptor->argCallbacks;
+    methodInfo->retTag = descriptor->retTag;
+    methodInfo->retStruct = descriptor->retStruct;
+    methodInfo->thunk = descriptor->thunk;
+    methodInfo->compiled = true;
+}
+
+// Helper function to parse a type name against the shared struct and
+// callback registries, callbacks are only looked up when [callbackType] is set
+static bool parseSharedFFITypeName(const char* name, size_t len, FFITypeTag* tag, FFIStructType** structType,
+                                   FFICallbackType** callbackType) {
+    pthread_mutex_lock(&ffiStructLock);
+    bool parsed = parseFFITypeName(name, len, tag, structType);
+    if (callbackType != NULL) {
+        *callbackType = parsed ? NULL : findFFICallbackType(name, len);
+        if (*callbackType != NULL) {
+            *tag = FT_CALLBACK;
+            parsed = true;
+        }
+    }
+    pthread_mutex_unlock(&ffiStructLock);
+    return parsed;
+}
+
+// Function to compile the call descriptor of an FFI method: loads the DLL,
+// resolves the symbol, parses the args/ret signatures and prepares the cif.
+// This runs once per method, later calls only marshal values and ffi_call.
+// A descriptor compiled by another method or VM is reused as is.
+static bool compileFFIMethod(WrenVM* vm, FFIMethodInfo* methodInfo, int arity, const char** error) {
+    if (methodInfo->dllName == NULL) {
+        fprintf(stderr, "Missing required FFI information for %s: dllName is NULL\n", methodInfo->methodName);
+        *error = "Missing FFI metadata";
+        return false;
+    }
+    
+    // The payload is an argument the Wren method doesn't take
+    if (methodInfo->payloadArg) arity++;
+    
+    // The class holds a reference to the library
+    FFIClassInfo* ffiClass = findFFIClassByObject(getWreniContext(vm), methodInfo->classObj);
+    FFILibrary* library = NULL;
+    if (ffiClass != NULL) {
+        library = getFFIClassLibrary(vm, ffiClass, methodInfo->dllName);
+    } else {
+        // Fallback to a reference that is never released
+        library = acquireFFILibrary(methodInfo->dllName);
+    }
+    
+    if (library == NULL) {
+        fprintf(stderr, "Failed to get DLL handle for %s\n", methodInfo->dllName);
+        *error = "Failed to load dynamic library";
+        return false;
+    }
+    void* handle = library->handle;
+    
+    // Extract clean method name for FFI (remove parameter signature)
+    char ffiFnName[256];
+    size_t nameLen = strcspn(methodInfo->methodName, "(");
+    if (nameLen >= sizeof(ffiFnName)) nameLen = sizeof(ffiFnName) - 1;
+    memcpy(ffiFnName, methodInfo->methodName, nameLen);
+    ffiFnName[nameLen] = '\0';
+    
+    const char* argsSignature = methodInfo->argsSignature;
+    char key[1024];
+    snprintf(key, sizeof(key), "%s#%u:%s(%s)%s", library->name, library->generation, ffiFnName,
+             argsSignature ? argsSignature : "", methodInfo->retSignature ? methodInfo->retSignature : "void");
+    uint32_t keyHash = hashFFILibraryName(key);
+    
+    pthread_rwlock_rdlock(&ffiDescriptorLock);
+    FFIDescriptor* shared = findFFIDescriptor(key, keyHash);
+    pthread_rwlock_unlock(&ffiDescriptorLock);
+    if (shared != NULL) {
+        if (shared->argCount > arity) {
+            fprintf(stderr, "FFI args '%s' of %s expect %d arguments, method takes %d\n",
+                    argsSignature, ffiFnName, shared->argCount, arity);
+            *error = "FFI args signature does not match method arity";
+            return false;
+        }
+        applyFFIDescriptor(methodInfo, shared);
+        return true;
+    }
+    
+    // Eager binding may have looked the symbol up already
+    void* func = methodInfo->fnPtr != NULL ? methodInfo->fnPtr : dlsym(handle, ffiFnName);
+    if (!func) {
+        fprintf(stderr, "Failed to find function %s in %s: %s\n", ffiFnName, methodInfo->dllName, dlerror());
+        *error = "Function not found in library";
+        return false;
+    }
+    
+    // Struct types used below may be declared on any FFI class
+    registerAllFFIStructs(getWreniContext(vm));
+    
+    // Parse return type, void if not specified
+    FFITypeTag retTag = FT_VOID;
+    FFIStructType* retStruct = NULL;
+    if (methodInfo->retSignature != NULL) {
+        if (!parseSharedFFITypeName(methodInfo->retSignature, strlen(methodInfo->retSignature), &retTag, &retStruct, NULL)) {
+            fprintf(stderr, "Unsupported FFI return type '%s' for %s\n", methodInfo->retSignature, ffiFnName);
+            *error = "Unsupported FFI return type";
+            return false;
+        }
+    }
+    
+    // Count arguments by counting commas + 1, no arguments if not specified
+    int argCount = 0;
+    if (argsSignature != NULL && argsSignature[strspn(argsSignature, " ")] != '\0') {
+        argCount = 1;
+        for (const char* p = argsSignature; *p; p++) {
+            if (*p == ',') argCount++;
+        }
+    }
+    
+    if (argCount > arity) {
+        fprintf(stderr, "FFI args '%s' of %s expect %d arguments, method takes %d\n",
+                argsSignature, ffiFnName, argCount, arity);
+        *error = "FFI args signature does not match method arity";
+        return false;
+    }
+    
+    FFITypeTag* argTags = NULL;
+    ffi_type** argTypes = NULL;
+    FFIStructType** argStructs = NULL;
+    FFICallbackType** argCallbacks = NULL;
+    bool hasStructs = retStruct != NULL;
+    size_t structArgsSize = 0;
+    if (argCount > 0) {
+        argTags = malloc(argCount * sizeof(FFITypeTag));
+        argTypes = malloc(argCount * sizeof(ffi_type*));
+        argStructs = malloc(argCount * sizeof(FFIStructType*));
+        argCallbacks = malloc(argCount * sizeof(FFICallbackType*));
+        
+        const char* start = argsSignature;
+        for (int i = 0; i < argCount; i++) {
+            const char* end = strchr(start, ',');
+            if (end == NULL) end = start + strlen(start);
+            
+            if (!parseSharedFFITypeName(start, end - start, &argTags[i], &argStructs[i], &argCallbacks[i]) ||
+                argTags[i] == FT_VOID) {
+                fprintf(stderr, "Unsupported FFI argument type '%.*s' for %s\n", (int)(end - start), start, ffiFnName);
+                free(argTags);
+                free(argTypes);
+                free(argStructs);
+                free(argCallbacks);
+                *error = "Unsupported FFI argument type";
+                return false;
+            }
+            if (argStructs[i] != NULL) {
+                argTypes[i] = &argStructs[i]->type;
+                structArgsSize = alignFFIStructOffset(structArgsSize, argStructs[i]) + argStructs[i]->type.size;
+                hasStructs = true;
+            } else {
+                argTypes[i] = ffiTypeForTag(argTags[i]);
+            }
+            start = end + 1;
+        }
+    }
+    
+    if (structArgsSize > FFI_STRUCT_SCRATCH_SIZE) {
+        fprintf(stderr, "Struct arguments of %s take more than %d bytes\n", ffiFnName, FFI_STRUCT_SCRATCH_SIZE);
+        free(argTags);
+        free(argTypes);
+        free(argStructs);
+        free(argCallbacks);
+        *error = "FFI struct arguments too large";
+        return false;
+    }
+    
+    // Initialize CIF
+    FFIDescriptor* descriptor = calloc(1, sizeof(FFIDescriptor));
+    ffi_type* retType = retStruct != NULL ? &retStruct->type : ffiTypeForTag(retTag);
+    if (descriptor == NULL ||
+        ffi_prep_cif(&descriptor->cif, FFI_DEFAULT_ABI, argCount, retType, argTypes) != FFI_OK) {
+        fprintf(stderr, "FFI prep_cif failed\n");
+        free(descriptor);
+        free(argTags);
+        free(argTypes);
+        free(argStructs);
+        free(argCallbacks);
+        *error = "FFI preparation failed";
+        return false;
+    }
+    
+    descriptor->key = strdup(key);
+    descriptor->hash = keyHash;
+    descriptor->fnPtr = func;
+    descriptor->argCount = argCount;
+    descriptor->argTags = argTags;
+    descriptor->argTypes = argTypes;
+    descriptor->argStructs = argStructs;
+    descriptor->argCallbacks = argCallbacks;
+    descriptor->retTag = retTag;
+    descriptor->retStruct = retStruct;
+    // Thunks only cover scalar shapes, structs always go through ffi_call
+    descriptor->thunk = hasStructs ? NULL : ffiThunkFor(retTag, argTags, argCount);
+    
+    // Another thread may have published the same descriptor meanwhile, the
+    // first one is used by everyone
+    shared = descriptor->key != NULL ? publishFFIDescriptor(descriptor) : descriptor;
+    if (shared != descriptor) {
+        free(descriptor->key);
+        free(descriptor->argTags);
+        free(descriptor->argTypes);
+        free(descriptor->argStructs);
+        free(descriptor->argCallbacks);
+        free(descriptor);
+    }
+    applyFFIDescriptor(methodInfo, shared);
+    
+    fprintf(stderr, "Compiled FFI call descriptor for %s::%s(%s) -> %s%s\n",
+            methodInfo->dllName, ffiFnName,
+            argsSignature ? argsSignature : "",
+            methodInfo->retSignature ? methodInfo->retSignature : "void",
+            methodInfo->thunk ? " (direct)" : "");
+    return true;
+}
+
+// Helper function to grow a batch buffer to hold [needed] bytes
+static bool reserveFFIBatch(void** data, size_t* capacity, size_t needed) {
+    if (needed <= *capacity) return true;
+    size_t newCapacity = *capacity == 0 ? 4096 : *capacity;
+    while (newCapacity < needed) newCapacity *= 2;
+    void* newData = realloc(*data, newCapacity);
+    if (newData == NULL) return false;
+    *data = newData;
+    *capacity = newCapacity;
+    return true;
+}
+
+// Function to make the call of a compiled method with marshalled arguments,
+// directly through the shape's thunk when there is one. Struct arguments
+// hold a pointer to their packed bytes, as libffi expects.
+static inline void callFFIMethod(FFIMethodInfo* methodInfo, FFIValue* args, void* result) {
+    if (methodInfo->thunk != NULL) {
+        methodInfo->thunk(methodInfo->fnPtr, args, result);
+    } else {
+        void* argValues[FFI_MAX_ARGS];
+        for (int i = 0; i < methodInfo->argCount; i++) {
+            argValues[i] = methodInfo->argTags[i] == FT_STRUCT ? args[i].ptr : &args[i];
+        }
+        ffi_call(&methodInfo->cif, FFI_FN(methodInfo->fnPtr), result, argValues);
+    }
+}
+
+// Function to replay all recorded calls in one pass and reset the buffer
+static void replayFFIBatch(FFIBatch* batch) {
+    uint8_t* p = batch->data;
+    uint8_t* end = batch->data + batch->size;
+    FFIValue result;
+    
+    while (p < end) {
+        FFIBatchRecord* record = (FFIBatchRecord*)p;
+        FFIMethodInfo* methodInfo = record->method;
+        
+        // String and struct arguments were stored as offsets into the arena
+        for (int i = 0; i < methodInfo->argCount; i++) {
+            if (methodInfo->argTags[i] == FT_STRING || methodInfo->argTags[i] == FT_STRUCT) {
+                record->args[i].ptr = batch->arena + record->args[i].i64;
+            }
+        }
+        callFFIMethod(methodInfo, record->args, &result);
+        p += sizeof(FFIBatchRecord) + methodInfo->argCount * sizeof(FFIValue);
+    }
+    
+    for (uint32_t i = 0; i < batch->retainedCount; i++) {
+        releaseFFIBufferBlock(batch->retained[i]);
+    }
+    
+    batch->size = 0;
+    batch->arenaSize = 0;
+    batch->retainedCount = 0;
+    batch->count = 0;
+}
+
+// Function to run pending batched calls before a call that can't be deferred
+static inline void flushFFIBatch(WrenVM* vm) {
+    FFIBatch* batch = &getWreniContext(vm)->batch;
+    if (batch->count > 0) {
+        replayFFIBatch(batch);
+    }
+}
+
+// Helper function to run the destructor of a payload, once, and only on a
+// payload that was initialized
+static void destroyFFIPayload(FFIPayloadSlot* slot) {
+    FFIPayloadPool* pool = slot->pool;
+    if (pool->destructor != NULL && slot->initialized) {
+        void* payload = slot->bytes;
+        void* argValues[1] = { pool->byValue ? payload : (void*)&payload };
+        ffi_arg ret;
+        ffi_call(&pool->destructorCif, FFI_FN(pool->destructor), &ret, argValues);
+    }
+    slot->initialized = false;
+}
+
+// Helper function to run the destructor of a payload and put its slot back
+// on the free list
+static void releaseFFIPayloadSlot(FFIPayloadSlot* slot) {
+    FFIPayloadPool* pool = slot->pool;
+    destroyFFIPayload(slot);
+    slot->next = pool->free;
+    pool->free = slot;
+}
+
+// Helper function to store an integer argument. The value is first cut to
+// the argument's width and sign or zero extended, so both paths pass the same
+// number. For the thunks it is then kept widened to 64 bits, which libffi
+// reads the low bytes of on x86_64. Elsewhere it is stored at its own size at
+// the start of the slot, where libffi reads it whatever the byte order, the
+// rest of the slot is zeroed.
+static inline void setFFIIntegerArg(FFIValue* arg, FFITypeTag tag, int64_t value) {
+    switch (tag) {
+        case FT_I8:   value = (int8_t)value; break;
+        case FT_U8:
+        case FT_BOOL: value = (uint8_t)value; break;
+        case FT_I16:  value = (int16_t)value; break;
+        case FT_U16:  value = (uint16_t)value; break;
+        case FT_I32:  value = (int32_t)value; break;
+        case FT_U32:  value = (uint32_t)value; break;
+        default: break;
+    }
+    arg->i64 = value;
+    if (FFI_DIRECT_THUNKS) return;
+    arg->i64 = 0;
+    switch (ffiTypeForTag(tag)->size) {
+        case 1: { int8_t v = (int8_t)value; memcpy(arg, &v, sizeof(v)); break; }
+        case 2: { int16_t v = (int16_t)value; memcpy(arg, &v, sizeof(v)); break; }
+        case 4: { int32_t v = (int32_t)value; memcpy(arg, &v, sizeof(v)); break; }
+        default: arg->i64 = value; break;
+    }
+}
+
+// Function to move argument values from the Wren stack (skip receiver) into
+// [args], struct arguments are packed into [structs]. Aborts the fiber and
+// returns false on a badly typed argument.
+static bool marshalFFIArgs(WrenVM* vm, FFIMethodInfo* methodInfo, FFIValue* args, FFIStructScratch* structs) {
+    size_t structOffset = 0;
+    
+    // The receiver's payload goes first, by address either way: libffi
+    // reads struct arguments through a pointer too
+    int first = 0;
+    if (methodInfo->payloadArg) {
+        FFIPayloadSlot* slot = getFFIPayloadSlot(vm->apiStack[0]);
+        if (slot == NULL) {
+            wrenSetSlotString(vm, 0, "Instance has no payload, was it destroyed?");
+            wrenAbortFiber(vm, 0);
+            return false;
+        }
+        args[0].ptr = slot->bytes;
+        first = 1;
+    }
+    
+    for (int i = first; i < methodInfo->argCount; i++) {
+        Value value = vm->apiStack[i + 1 - first];
+        FFITypeTag tag = methodInfo->argTags[i];
+        
+        if (tag == FT_STRING) {
+            if (!IS_STRING(value)) {
+                wrenSetSlotString(vm, 0, "Expected a String argument");
+                wrenAbortFiber(vm, 0);
+                return false;
+            }
+            args[i].ptr = AS_STRING(value)->value;
+        } else if (tag == FT_STRUCT) {
+            FFIStructType* st = methodInfo->argStructs[i];
+            structOffset = alignFFIStructOffset(structOffset, st);
+            const char* error = packFFIStruct(vm, st, value, structs->bytes + structOffset);
+            if (error != NULL) {
+                wrenSetSlotString(vm, 0, error);
+                wrenAbortFiber(vm, 0);
+                return false;
+            }
+            args[i].ptr = structs->bytes + structOffset;
+            structOffset += st->type.size;
+        } else if (tag == FT_CALLBACK) {
+            const char* error = NULL;
+            args[i].ptr = IS_NULL(value) ? NULL : bindFFICallback(vm, methodInfo->argCallbacks[i], value, &error);
+            if (error != NULL) {
+                wrenSetSlotString(vm, 0, error);
+                wrenAbortFiber(vm, 0);
+                return false;
+            }
+        } else if (tag == FT_BOOL) {
+            setFFIIntegerArg(&args[i], tag, !IS_FALSE(value) && !IS_NULL(value));
+        } else if (tag == FT_PTR && IS_NULL(value)) {
+            args[i].ptr = NULL;
+        } else if (tag == FT_PTR && getFFIBuffer(vm, value) != NULL) {
+            // Buffers are passed by address, the native memory is not copied
+            args[i].ptr = getFFIBuffer(vm, value)->data;
+        } else {
+            if (!IS_NUM(value)) {
+                wrenSetSlotString(vm, 0, "Expected a Num argument");
+                wrenAbortFiber(vm, 0);
+                return false;
+            }
+            // Integers are stored widened so the thunks can pass every
+            // integer slot the same way, see setFFIIntegerArg
+            switch (tag) {
+                case FT_F32: args[i].f32 = (float)AS_NUM(value); break;
+                case FT_F64: args[i].f64 = AS_NUM(value); break;
+                case FT_PTR: args[i].ptr = (void*)(intptr_t)AS_NUM(value); break;
+                case FT_I32: setFFIIntegerArg(&args[i], tag, (int32_t)AS_NUM(value)); break;
+                default:     setFFIIntegerArg(&args[i], tag, (int64_t)AS_NUM(value)); break;
+            }
+        }
+    }
+    return true;
+}
+
+// Helper function to copy [size] bytes into the batch arena, returns the
+// offset of the copy or -1 when out of memory
+static int64_t copyToFFIBatchArena(FFIBatch* batch, const void* bytes, size_t size) {
+    // Keep every copy aligned for struct fields
+    size_t offset = (batch->arenaSize + 15) & ~(size_t)15;
+    if (!reserveFFIBatch((void**)&batch->arena, &batch->arenaCapacity, offset + size)) {
+        return -1;
+    }
+    memcpy(batch->arena + offset, bytes, size);
+    batch->arenaSize = offset + size;
+    return (int64_t)offset;
+}
+
+// Function to append a call to the command buffer instead of running it
+static void recordFFIBatch(WrenVM* vm, FFIMethodInfo* methodInfo) {
+    FFIBatch* batch = &getWreniContext(vm)->batch;
+    size_t recordSize = sizeof(FFIBatchRecord) + methodInfo->argCount * sizeof(FFIValue);
+    if (!reserveFFIBatch((void**)&batch->data, &batch->capacity, batch->size + recordSize)) {
+        wrenSetSlotString(vm, 0, "Out of memory recording FFI batch");
+        wrenAbortFiber(vm, 0);
+        return;
+    }
+    
+    FFIBatchRecord* record = (FFIBatchRecord*)(batch->data + batch->size);
+    FFIStructScratch structs;
+    record->method = methodInfo;
+    if (!marshalFFIArgs(vm, methodInfo, record->args, &structs)) return;
+    
+    for (int i = 0; i < methodInfo->argCount; i++) {
+        int64_t offset;
+        if (methodInfo->argTags[i] == FT_STRING) {
+            ObjString* string = AS_STRING(vm->apiStack[i + 1]);
+            offset = copyToFFIBatchArena(batch, string->value, string->length + 1);
+        } else if (methodInfo->argTags[i] == FT_STRUCT) {
+            offset = copyToFFIBatchArena(batch, record->args[i].ptr, methodInfo->argStructs[i]->type.size);
+        } else if (methodInfo->argTags[i] == FT_PTR && getFFIBuffer(vm, vm->apiStack[i + 1]) != NULL) {
+            // The buffer may be collected before the replay, hold its memory
+            FFIBufferBlock* block = getFFIBuffer(vm, vm->apiStack[i + 1])->block;
+            size_t needed = (batch->retainedCount + 1) * sizeof(FFIBufferBlock*);
+            if (!reserveFFIBatch((void**)&batch->retained, &batch->retainedCapacity, needed)) {
+                offset = -1;
+            } else {
+                retainFFIBufferBlock(block);
+                batch->retained[batch->retainedCount++] = block;
+                continue;
+            }
+        } else {
+            continue;
+        }
+        
+        if (offset < 0) {
+            wrenSetSlotString(vm, 0, "Out of memory recording FFI batch");
+            wrenAbortFiber(vm, 0);
+            return;
+        }
+        record->args[i].i64 = offset;
+    }
+    
+    batch->size += recordSize;
+    batch->count++;
+}
+
+// Function to put the Wren string for a returned C string into slot 0,
+// from the cache when the same pointer returned the same contents before
+static void setFFIStringResult(WrenVM* vm, const char* ptr) {
+    if (ptr == NULL) {
+        wrenSetSlotNull(vm, 0);
+        return;
+    }
+    
+    uint32_t hash = 2166136261u;
+    const char* p = ptr;
+    for (; *p; p++) {
+        hash = (hash ^ (uint8_t)*p) * 16777619u;
+    }
+    uint32_t length = (uint32_t)(p - ptr);
+    
+    FFIStringCache* cache = &getWreniContext(vm)->stringCache;
+    FFIStringCacheEntry* entry = &cache->entries[(hashFFIKey(ptr, 0) ^ hash) & (FFI_STRING_CACHE_SIZE - 1)];
+    if (entry->ptr == ptr && entry->hash == hash && entry->length == length &&
+        memcmp(AS_STRING(entry->string->value)->value, ptr, length) == 0) {
+        cache->hits++;
+        vm->apiStack[0] = entry->string->value;
+        return;
+    }
+    
+    cache->misses++;
+    Value string = wrenNewStringLength(vm, ptr, length);
+    vm->apiStack[0] = string;
+    
+    if (entry->ptr != NULL) {
+        cache->evictions++;
+        wrenReleaseHandle(vm, entry->string);
+    }
+    entry->ptr = ptr;
+    entry->hash = hash;
+    entry->length = length;
+    entry->string = wrenMakeHandle(vm, string);
+}
+
+// Function to put a returned pointer into slot 0, as a Num like ptr arguments
+static inline void setFFIPtrResult(WrenVM* vm, void* ptr) {
+    if (ptr == NULL) {
+        wrenSetSlotNull(vm, 0);
+    } else {
+        wrenSetSlotDouble(vm, 0, (double)(uintptr_t)ptr);
+    }
+}
+
+// Function to release the cached strings, before the VM is freed
+static void clearFFIStringCache(WrenVM* vm) {
+    FFIStringCache* cache = &getWreniContext(vm)->stringCache;
+    for (int i = 0; i < FFI_STRING_CACHE_SIZE; i++) {
+        FFIStringCacheEntry* entry = &cache->entries[i];
+        if (entry->ptr != NULL) {
+            wrenReleaseHandle(vm, entry->string);
+            entry->ptr = NULL;
+            entry->string = NULL;
+        }
+    }
+}
+
+// Function to put the result of a call into slot 0, libffi widens integral
+// returns to a full ffi_arg
+static void setFFIResult(WrenVM* vm, FFIMethodInfo* methodInfo, FFIValue result, FFIStructScratch* structResult) {
+    switch (methodInfo->retTag) {
+        case FT_I8:   wrenSetSlotDouble(vm, 0, (int8_t)result.ret); break;
+        case FT_U8:   wrenSetSlotDouble(vm, 0, (uint8_t)result.ret); break;
+        case FT_I16:  wrenSetSlotDouble(vm, 0, (int16_t)result.ret); break;
+        case FT_U16:  wrenSetSlotDouble(vm, 0, (uint16_t)result.ret); break;
+        case FT_I32:  wrenSetSlotDouble(vm, 0, (int32_t)result.ret); break;
+        case FT_U32:  wrenSetSlotDouble(vm, 0, (uint32_t)result.ret); break;
+        case FT_I64:  wrenSetSlotDouble(vm, 0, (double)result.i64); break;
+        case FT_F32:  wrenSetSlotDouble(vm, 0, (double)result.f32); break;
+        case FT_F64:  wrenSetSlotDouble(vm, 0, result.f64); break;
+        case FT_BOOL: wrenSetSlotBool(vm, 0, (uint8_t)result.ret != 0); break;
+        case FT_STRUCT:
+            vm->apiStack[0] = unpackFFIStruct(vm, methodInfo->retStruct, structResult->bytes);
+            break;
+        case FT_STRING: setFFIStringResult(vm, (const char*)result.ptr); break;
+        case FT_PTR:    setFFIPtrResult(vm, result.ptr); break;
+        case FT_VOID:
+        case FT_CALLBACK:
+            wrenSetSlotNull(vm, 0);
+            break;
+    }
+}
+
+// Function to make the cache of a pure method once its descriptor is
+// compiled. Methods without a result, filling a payload or running on a
+// worker are called every time.
+static void prepareFFIMemo(FFIMethodInfo* methodInfo) {
+    if (methodInfo->retTag == FT_VOID || methodInfo->init || methodInfo->async) {
+        fprintf(stderr, "pure=true ignored for %s, it needs a result and a synchronous call\n",
+                methodInfo->methodName);
+        methodInfo->pure = false;
+        return;
+    }
+    
+    FFIMemoCache* cache = calloc(1, sizeof(FFIMemoCache));
+    if (cache == NULL) {
+        methodInfo->pure = false;
+        return;
+    }
+    for (int i = 0; i < FFI_MEMO_BUCKETS; i++) {
+        cache->buckets[i] = -1;
+    }
+    methodInfo->memo = cache;
+}
+
+// Helper function to write the key of a call of a pure method into [key]:
+// scalars as marshalled, strings up to their terminator, structs and the
+// receiver's payload byte for byte. Buffers and other pointers are keyed on
+// their address. Returns false when the call can't be memoized.
+static bool buildFFIMemoKey(FFIMethodInfo* methodInfo, const FFIValue* args, uint8_t* key, uint32_t* length) {
+    size_t used = 0;
+    for (int i = 0; i < methodInfo->argCount; i++) {
+        FFITypeTag tag = methodInfo->argTags[i];
+        const void* bytes = &args[i];
+        size_t size = tag == FT_F32 ? sizeof(float) : sizeof(int64_t);
+        
+        if (i == 0 && methodInfo->payloadArg) {
+            FFIPayloadSlot* slot = (FFIPayloadSlot*)((uint8_t*)args[0].ptr - offsetof(FFIPayloadSlot, bytes));
+            bytes = slot->bytes;
+            size = slot->pool->type->type.size;
+        } else if (tag == FT_STRING) {
+            bytes = args[i].ptr;
+            size = strlen(args[i].ptr) + 1;
+        } else if (tag == FT_STRUCT) {
+            bytes = args[i].ptr;
+            size = methodInfo->argStructs[i]->type.size;
+        } else if (tag == FT_CALLBACK) {
+            return false;
+        }
+        
+        if (used + size > FFI_MEMO_KEY_SIZE) return false;
+        memcpy(key + used, bytes, size);
+        used += size;
+    }
+    *length = (uint32_t)used;
+    return true;
+}
+
+// Helper function to hash a memo key with FNV-1a
+static uint32_t hashFFIMemoKey(const uint8_t* key, uint32_t length) {
+    uint32_t h = 2166136261u;
+    for (uint32_t i = 0; i < length; i++) {
+        h = (h ^ key[i]) * 16777619u;
+    }
+    return h;
+}
+
+// Function to answer a call of a pure method from its cache. On a hit the
+// result is put into slot 0, struct results are unpacked into a new List
+// each time since Lists can be changed.
+static bool answerFFIMemo(WrenVM* vm, FFIMethodInfo* methodInfo, const uint8_t* key, uint32_t length, uint32_t hash) {
+    FFIMemoCache* cache = methodInfo->memo;
+    for (int i = cache->buckets[hash % FFI_MEMO_BUCKETS]; i >= 0; i = cache->entries[i].next) {
+        FFIMemoEntry* entry = &cache->entries[i];
+        if (entry->hash != hash || entry->keyLength != length || memcmp(entry->key, key, length) != 0) {
+            continue;
+        }
+        entry->lastUse = ++cache->clock;
+        cache->hits++;
+        if (methodInfo->retStruct != NULL) {
+            vm->apiStack[0] = unpackFFIStruct(vm, methodInfo->retStruct, entry->key + ((length + 15) & ~(size_t)15));
+        } else {
+            vm->apiStack[0] = entry->value;
+        }
+        return true;
+    }
+    cache->misses++;
+    return false;
+}
+
+// Helper function to drop an entry from the chain of its bucket and release
+// what it holds
+static void releaseFFIMemoEntry(WrenVM* vm, FFIMemoCache* cache, FFIMemoEntry* entry) {
+    int index = (int)(entry - cache->entries);
+    int* link = &cache->buckets[entry->hash % FFI_MEMO_BUCKETS];
+    while (*link != index) {
+        link = &cache->entries[*link].next;
+    }
+    *link = entry->next;
+    
+    free(entry->key);
+    entry->key = NULL;
+    if (entry->handle != NULL) {
+        wrenReleaseHandle(vm, entry->handle);
+        entry->handle = NULL;
+    }
+}
+
+// Function to remember the result of a call of a pure method, the one in
+// slot 0 or the struct in [structResult]. A full cache gives up its least
+// recently used entry.
+static void storeFFIMemo(WrenVM* vm, FFIMethodInfo* methodInfo, const uint8_t* key, uint32_t length,
+                         uint32_t hash, const FFIStructScratch* structResult) {
+    FFIMemoCache* cache = methodInfo->memo;
+    size_t resultOffset = (length + 15) & ~(size_t)15;
+    size_t resultSize = methodInfo->retStruct != NULL ? methodInfo->retStruct->type.size : 0;
+    uint8_t* copy = malloc(resultOffset + resultSize + 1);
+    if (copy == NULL) return;
+    memcpy(copy, key, length);
+    if (resultSize > 0) memcpy(copy + resultOffset, structResult->bytes, resultSize);
+    
+    FFIMemoEntry* entry;
+    if (cache->count < FFI_MEMO_SIZE) {
+        entry = &cache->entries[cache->count++];
+    } else {
+        entry = &cache->entries[0];
+        for (int i = 1; i < FFI_MEMO_SIZE; i++) {
+            if (cache->entries[i].lastUse < entry->lastUse) entry = &cache->entries[i];
+        }
+        releaseFFIMemoEntry(vm, cache, entry);
+        cache->evictions++;
+    }
+    
+    entry->key = copy;
+    entry->keyLength = length;
+    entry->hash = hash;
+    entry->lastUse = ++cache->clock;
+    entry->value = methodInfo->retStruct != NULL ? NULL_VAL : vm->apiStack[0];
+    entry->handle = IS_OBJ(entry->value) ? wrenMakeHandle(vm, entry->value) : NULL;
+    int* bucket = &cache->buckets[hash % FFI_MEMO_BUCKETS];
+    entry->next = *bucket;
+    *bucket = (int)(entry - cache->entries);
+}
+
+// Function to empty the cache of a pure method, returns the number of
+// results dropped
+static int clearFFIMemo(WrenVM* vm, FFIMemoCache* cache) {
+    int dropped = cache->count;
+    for (int i = 0; i < cache->count; i++) {
+        releaseFFIMemoEntry(vm, cache, &cache->entries[i]);
+    }
+    cache->count = 0;
+    cache->invalidated += dropped;
+    return dropped;
+}
+
+// One call of an async=true method. Everything it reads on the worker is
+// owned by it: String arguments are copied, structs packed into [structArgs]
+// and Buffers passed to it are retained until its result is taken.
+struct FFIAsyncCall {
+    FFIAsyncCall* next;
+    FFIAsyncQueue* queue;
+    FFIMethodInfo* method;
+    uint32_t id;
+    FFIValue args[FFI_MAX_ARGS];
+    FFIValue result;
+    FFIStructScratch structArgs;
+    FFIStructScratch structResult;
+    char* strings;             // Copies of the String arguments, one block
+    FFIBufferBlock* retained[FFI_MAX_ARGS];
+    int retainedCount;
+};
+
+// Worker threads running async calls for every VM, started with the first
+// call. WRENI_ASYNC_THREADS overrides FFI_ASYNC_THREADS.
+#define FFI_ASYNC_THREADS 4
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    FFIAsyncCall* head;
+    FFIAsyncCall* tail;
+    int threadCount;
+} ffiAsyncPool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, 0 };
+static pthread_once_t ffiAsyncPoolOnce = PTHREAD_ONCE_INIT;
+
+// Worker of the async pool, runs calls in submission order and hands them
+// back to the queue of their VM
+static void* runFFIAsyncCalls(void* data) {
+    for (;;) {
+        pthread_mutex_lock(&ffiAsyncPool.lock);
+        while (ffiAsyncPool.head == NULL) {
+            pthread_cond_wait(&ffiAsyncPool.ready, &ffiAsyncPool.lock);
+        }
+        FFIAsyncCall* call = ffiAsyncPool.head;
+        ffiAsyncPool.head = call->next;
+        if (ffiAsyncPool.head == NULL) ffiAsyncPool.tail = NULL;
+        pthread_mutex_unlock(&ffiAsyncPool.lock);
+        
+        FFIMethodInfo* methodInfo = call->method;
+        callFFIMethod(methodInfo, call->args,
+                      methodInfo->retStruct != NULL ? (void*)&call->structResult : (void*)&call->result);
+        
+        FFIAsyncQueue* queue = call->queue;
+        pthread_mutex_lock(&queue->lock);
+        call->next = NULL;
+        if (queue->completedTail != NULL) {
+            queue->completedTail->next = call;
+        } else {
+            queue->completed = call;
+        }
+        queue->completedTail = call;
+        queue->running--;
+        pthread_cond_broadcast(&queue->finished);
+        pthread_mutex_unlock(&queue->lock);
+    }
+    return NULL;
+}
+
+static void startFFIAsyncPool(void) {
+    int threadCount = FFI_ASYNC_THREADS;
+    const char* threads = getenv("WRENI_ASYNC_THREADS");
+    if (threads != NULL && atoi(threads) > 0) threadCount = atoi(threads);
+    
+    for (int i = 0; i < threadCount; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, runFFIAsyncCalls, NULL) != 0) break;
+        pthread_detach(thread);
+        ffiAsyncPool.threadCount++;
+    }
+    fprintf(stderr, "Started %d threads for async FFI calls\n", ffiAsyncPool.threadCount);
+}
+
+// Helper function to free a call that won't be used any more
+static void freeFFIAsyncCall(FFIAsyncCall* call) {
+    for (int i = 0; i < call->retainedCount; i++) {
+        releaseFFIBufferBlock(call->retained[i]);
+    }
+    free(call->strings);
+    free(call);
+}
+
+// Function to hand a call of an async=true method to the worker pool. Slot
+// 0 gets the id of the call, for FFI.await.
+static void submitFFIAsyncCall(WrenVM* vm, FFIMethodInfo* methodInfo) {
+    pthread_once(&ffiAsyncPoolOnce, startFFIAsyncPool);
+    if (ffiAsyncPool.threadCount == 0) {
+        wrenSetSlotString(vm, 0, "No thread available for async FFI calls");
+        wrenAbortFiber(vm, 0);
+        return;
+    }
+    
+    FFIAsyncCall* call = calloc(1, sizeof(FFIAsyncCall));
+    if (call == NULL) {
+        wrenSetSlotString(vm, 0, "Out of memory submitting async FFI call");
+        wrenAbortFiber(vm, 0);
+        return;
+    }
+    
+    if (!marshalFFIArgs(vm, methodInfo, call->args, &call->structArgs)) {
+        free(call);
+        return;
+    }
+    
+    // The Wren objects behind the arguments may be gone before the call runs
+    size_t stringsSize = 0;
+    for (int i = 0; i < methodInfo->argCount; i++) {
+        if (methodInfo->argTags[i] == FT_STRING) {
+            stringsSize += AS_STRING(vm->apiStack[i + 1])->length + 1;
+        }
+    }
+    if (stringsSize > 0 && (call->strings = malloc(stringsSize)) == NULL) {
+        free(call);
+        wrenSetSlotString(vm, 0, "Out of memory submitting async FFI call");
+        wrenAbortFiber(vm, 0);
+        return;
+    }
+    
+    char* string = call->strings;
+    for (int i = 0; i < methodInfo->argCount; i++) {
+        Value value = vm->apiStack[i + 1];
+        if (methodInfo->argTags[i] == FT_STRING) {
+            memcpy(string, AS_STRING(value)->value, AS_STRING(value)->length + 1);
+            call->args[i].ptr = string;
+            string += AS_STRING(value)->length + 1;
+        } else if (methodInfo->argTags[i] == FT_PTR && getFFIBuffer(vm, value) != NULL) {
+            FFIBufferBlock* block = getFFIBuffer(vm, value)->block;
+            retainFFIBufferBlock(block);
+            call->retained[call->retainedCount++] = block;
+        }
+    }
+    
+    WreniContext* ctx = getWreniContext(vm);
+    call->queue = &ctx->async;
+    call->method = methodInfo;
+    call->id = ++ctx->async.nextId;
+    
+    pthread_mutex_lock(&ctx->async.lock);
+    ctx->async.running++;
+    pthread_mutex_unlock(&ctx->async.lock);
+    
+    pthread_mutex_lock(&ffiAsyncPool.lock);
+    if (ffiAsyncPool.tail != NULL) {
+        ffiAsyncPool.tail->next = call;
+    } else {
+        ffiAsyncPool.head = call;
+    }
+    ffiAsyncPool.tail = call;
+    pthread_cond_signal(&ffiAsyncPool.ready);
+    pthread_mutex_unlock(&ffiAsyncPool.lock);
+    
+    wrenSetSlotDouble(vm, 0, call->id);
+}
+
+// Function to wait until every call of a VM has returned, before its
+// methods and queue are freed
+static void waitFFIAsyncCalls(FFIAsyncQueue* queue) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->running > 0) {
+        pthread_cond_wait(&queue->finished, &queue->lock);
+    }
+    pthread_mutex_unlock(&queue->lock);
+}
+
+// Function to free the calls of a VM whose results were never taken
+static void clearFFIAsyncCalls(FFIAsyncQueue* queue) {
+    waitFFIAsyncCalls(queue);
+    FFIAsyncCall* lists[] = { queue->completed, queue->done };
+    for (int i = 0; i < 2; i++) {
+        while (lists[i] != NULL) {
+            FFIAsyncCall* call = lists[i];
+            lists[i] = call->next;
+            freeFFIAsyncCall(call);
+        }
+    }
+    queue->completed = queue->completedTail = queue->done = NULL;
+}
+
+// Function to end the current frame after a call of a frame=true method:
+// runs a collection due at the boundary, then records the frame. The first
+// call only starts the clock, so startup is not counted.
+static void endWreniFrame(WrenVM* vm) {
+    WreniContext* ctx = getWreniContext(vm);
+    WreniGC* gc = &ctx->gc;
+    
+    // In frame mode the collection is run now, at the boundary, when the
+    // next frame growing the heap as much as this one would cross the threshold
+    if (gc->frameMode) {
+        size_t growth = vm->bytesAllocated > gc->frameStartBytes ? vm->bytesAllocated - gc->frameStartBytes : 0;
+        if (vm->bytesAllocated + growth > gc->threshold && gc->held == 0) collectWreniGarbage(vm, true);
+        gc->frameStartBytes = vm->bytesAllocated;
+    }
+    gc->frame++;
+    
+    WreniFrameStats* stats = &ctx->frames;
+    if (!stats->enabled) return;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    
+    if (stats->last.tv_sec != 0 || stats->last.tv_nsec != 0) {
+        if (stats->count == stats->capacity) {
+            int capacity = stats->capacity == 0 ? 1024 : stats->capacity * 2;
+            WreniFrame* frames = realloc(stats->frames, capacity * sizeof(WreniFrame));
+            if (frames == NULL) {
+                stats->enabled = false;
+                return;
+            }
+            stats->frames = frames;
+            stats->capacity = capacity;
+        }
+        WreniFrame* frame = &stats->frames[stats->count++];
+        frame->ns = (uint64_t)(now.tv_sec - stats->last.tv_sec) * 1000000000u + (now.tv_nsec - stats->last.tv_nsec);
+        frame->calls = (uint32_t)stats->calls;
+        frame->allocations = (uint32_t)(ctx->heap.allocations - stats->lastAllocations);
+        frame->collected = gc->managed ? gc->collections != stats->lastCollections
+                                       : vm->bytesAllocated < stats->lastBytes || vm->nextGC != stats->lastNextGC;
+        frame->heapBytes = vm->bytesAllocated;
+    }
+    
+    stats->last = now;
+    stats->calls = 0;
+    stats->lastBytes = vm->bytesAllocated;
+    stats->lastNextGC = vm->nextGC;
+    stats->lastAllocations = ctx->heap.allocations;
+    stats->lastCollections = gc->collections;
+}
+
+// Function to execute an FFI method through its cached call descriptor
+static void executeFFIMethod(WrenVM* vm, FFIMethodInfo* methodInfo)
+{
+    WreniContext* ctx = getWreniContext(vm);
+    ctx->frames.calls++;
+    
+    // Compile the call descriptor on the first call, reuse it afterwards
+    if (!methodInfo->compiled) {
+        // Extract and cache attributes if not already done
+        extractAndStoreFFIAttributes(vm, methodInfo, methodInfo->signature);
+        
+        const char* error = NULL;
+        if (!compileFFIMethod(vm, methodInfo, methodInfo->arity, &error)) {
+            wrenSetSlotString(vm, 0, error);
+            wrenAbortFiber(vm, 0);
+            return;
+        }
+    }
+    if (methodInfo->pure && methodInfo->memo == NULL) prepareFFIMemo(methodInfo);
+    
+    // Calls without a result are recorded when batched, either by attribute
+    // or inside an FFI.batch block. Anything else runs pending calls first,
+    // so does a frame=true call: the frame only ends once it has run.
+    if (methodInfo->retTag == FT_VOID && !methodInfo->async && !methodInfo->payloadArg &&
+        !methodInfo->frame && (methodInfo->batch || ctx->batch.depth > 0)) {
+        recordFFIBatch(vm, methodInfo);
+        return;
+    }
+    flushFFIBatch(vm);
+    
+    if (methodInfo->async) {
+        submitFFIAsyncCall(vm, methodInfo);
+        return;
+    }
+    
+    // Arguments are marshalled into one slot array on the stack and the
+    // return value into a single ffi_arg-sized slot, no heap traffic per call.
+    // Struct arguments and results live in scratch buffers on the stack too.
+    FFIValue args[FFI_MAX_ARGS];
+    FFIStructScratch structArgs;
+    FFIStructScratch structResult;
+    FFIValue result;
+    result.ret = 0;
+    
+    if (!marshalFFIArgs(vm, methodInfo, args, &structArgs)) return;
+    
+    // pure=true methods answer arguments seen before from their cache
+    uint8_t memoKey[FFI_MEMO_KEY_SIZE];
+    uint32_t memoLength = 0;
+    uint32_t memoHash = 0;
+    bool memoize = methodInfo->memo != NULL && buildFFIMemoKey(methodInfo, args, memoKey, &memoLength);
+    if (memoize) {
+        memoHash = hashFFIMemoKey(memoKey, memoLength);
+        if (answerFFIMemo(vm, methodInfo, memoKey, memoLength, memoHash)) {
+            if (methodInfo->frame) endWreniFrame(vm);
+            return;
+        }
+    }
+    
+    // init=true writes the result straight into the receiver's payload and
+    // returns the receiver. A payload filled before is destroyed first.
+    if (methodInfo->init) {
+        FFIPayloadSlot* slot = getFFIPayloadSlot(vm->apiStack[0]);
+        if (slot == NULL || methodInfo->retStruct != slot->pool->type) {
+            wrenSetSlotString(vm, 0, "init=true needs an instance with a payload and ret set to its struct");
+            wrenAbortFiber(vm, 0);
+            return;
+        }
+        destroyFFIPayload(slot);
+        callFFIMethod(methodInfo, args, slot->bytes);
+        slot->initialized = true;
+        return;
+    }
+    
+    callFFIMethod(methodInfo, args, methodInfo->retStruct != NULL ? (void*)&structResult : (void*)&result);
+    if (methodInfo->retTag != FT_VOID) {
+        setFFIResult(vm, methodInfo, result, &structResult);
+    }
+    if (memoize) storeFFIMemo(vm, methodInfo, memoKey, memoLength, memoHash, &structResult);
+    if (methodInfo->frame) endWreniFrame(vm);
+}
+
+// Shared libffi interface of a WrenForeignMethodFn: void fn(WrenVM* vm),
+// prepared once for every VM
+static ffi_cif foreignMethodCif;
+static ffi_type* foreignMethodArgTypes[1] = { &ffi_type_pointer };
+static bool foreignMethodCifReady = false;
+static pthread_once_t foreignMethodCifOnce = PTHREAD_ONCE_INIT;
+
+static void prepareForeignMethodCif(void) {
+    foreignMethodCifReady =
+        ffi_prep_cif(&foreignMethodCif, FFI_DEFAULT_ABI, 1, &ffi_type_void, foreignMethodArgTypes) == FFI_OK;
+}
+
+// Closure handler behind every bound FFI method, [userData] is its FFIMethodInfo
+static void ffiMethodClosureHandler(ffi_cif* cif, void* ret, void** args, void* userData)
+{
+    WrenVM* vm = *(WrenVM**)args[0];
+    executeFFIMethod(vm, (FFIMethodInfo*)userData);
+}
+
+// Helper function to create the per-method entry point returned to Wren, a
+// libffi closure bound to [methodInfo] so dispatch needs no lookup at all
+static WrenForeignMethodFn createFFIMethodEntry(FFIMethodInfo* methodInfo) {
+    pthread_once(&foreignMethodCifOnce, prepareForeignMethodCif);
+    if (!foreignMethodCifReady) {
+        fprintf(stderr, "FFI prep_cif failed for foreign method entry points\n");
+        return NULL;
+    }
+    
+    void* code = NULL;
+    ffi_closure* closure = ffi_closure_alloc(sizeof(ffi_closure), &code);
+    if (closure == NULL) {
+        fprintf(stderr, "Failed to allocate FFI closure for %s\n", methodInfo->signature);
+        return NULL;
+    }
+    
+    if (ffi_prep_closure_loc(closure, &foreignMethodCif, ffiMethodClosureHandler, methodInfo, code) != FFI_OK) {
+        fprintf(stderr, "Failed to prepare FFI closure for %s\n", methodInfo->signature);
+        ffi_closure_free(closure);
+        return NULL;
+    }
+    
+    methodInfo->closure = closure;
+    methodInfo->entry = (WrenForeignMethodFn)code;
+    return methodInfo->entry;
+}
+
+// Symbols are looked up by a worker pool once a resolution has at least
+// FFI_RESOLVE_PARALLEL_MIN methods, dlsym is thread-safe
+#define FFI_RESOLVE_THREADS 4
+#define FFI_RESOLVE_PARALLEL_MIN 64
+
+// One method of an eager resolution, [error] is set when it can't be bound
+typedef struct {
+    FFIMethodInfo* methodInfo;
+    void* handle;
+    const char* error;
+} FFIResolveItem;
+
+typedef struct {
+    FFIResolveItem* items;
+    int count;
+    int first;
+    int stride;
+} FFIResolveJob;
+
+// Worker of resolveFFIBindings, looks up every [stride]th symbol
+static void* resolveFFISymbols(void* data) {
+    FFIResolveJob* job = data;
+    for (int i = job->first; i < job->count; i += job->stride) {
+        FFIResolveItem* item = &job->items[i];
+        if (item->error != NULL) continue;
+        
+        char ffiFnName[256];
+        size_t nameLen = strcspn(item->methodInfo->methodName, "(");
+        if (nameLen >= sizeof(ffiFnName)) nameLen = sizeof(ffiFnName) - 1;
+        memcpy(ffiFnName, item->methodInfo->methodName, nameLen);
+        ffiFnName[nameLen] = '\0';
+        
+        item->methodInfo->fnPtr = dlsym(item->handle, ffiFnName);
+        if (item->methodInfo->fnPtr == NULL) item->error = "Function not found in library";
+    }
+    return NULL;
+}
+
+// Function to resolve every method of the FFI classes stored since the last
+// call: attributes, libraries and symbols, then the call descriptors. The
+// methods that can't be bound are reported together and abort the fiber,
+// so a typo fails at import instead of when its line first runs.
+static void resolveFFIBindings(WrenVM* vm) {
+    WreniContext* ctx = getWreniContext(vm);
+    if (ctx->pendingClassCount == 0) return;
+    
+    // Gather the methods of the pending classes
+    FFIResolveItem* items = malloc(ctx->methods.count * sizeof(FFIResolveItem) + 1);
+    if (items == NULL) {
+        wrenSetSlotString(vm, 0, "Could not allocate FFI binding resolution");
+        wrenAbortFiber(vm, 0);
+        return;
+    }
+    int count = 0;
+    for (uint32_t i = 0; i < ctx->methods.capacity; i++) {
+        FFIMethodInfo* methodInfo = ctx->methods.slots[i].value;
+        if (methodInfo == NULL || methodInfo->compiled) continue;
+        for (int c = 0; c < ctx->pendingClassCount; c++) {
+            if (ctx->pendingClasses[c]->classObj == methodInfo->classObj) {
+                items[count++] = (FFIResolveItem){ methodInfo, NULL, NULL };
+                break;
+            }
+        }
+    }
+    ctx->pendingClassCount = 0;
+    
+    // Attributes live in VM objects and libraries in the class caches, both
+    // are handled on this thread
+    for (int i = 0; i < count; i++) {
+        FFIMethodInfo* methodInfo = items[i].methodInfo;
+        extractAndStoreFFIAttributes(vm, methodInfo, methodInfo->signature);
+        if (methodInfo->dllName == NULL) {
+            items[i].error = "Missing FFI metadata";
+            continue;
+        }
+        
+        items[i].handle = getOrLoadDllHandle(vm, findFFIClassByObject(ctx, methodInfo->classObj), methodInfo->dllName);
+        if (items[i].handle == NULL) items[i].error = "Failed to load dynamic library";
+    }
+    
+    // Symbol lookups are spread over the worker pool for big bindings
+    FFIResolveJob jobs[FFI_RESOLVE_THREADS];
+    pthread_t threads[FFI_RESOLVE_THREADS];
+    bool started[FFI_RESOLVE_THREADS] = { false };
+    int workers = count >= FFI_RESOLVE_PARALLEL_MIN ? FFI_RESOLVE_THREADS : 1;
+    for (int w = 0; w < workers; w++) {
+        jobs[w] = (FFIResolveJob){ items, count, w, workers };
+        if (w > 0) started[w] = pthread_create(&threads[w], NULL, resolveFFISymbols, &jobs[w]) == 0;
+    }
+    resolveFFISymbols(&jobs[0]);
+    for (int w = 1; w < workers; w++) {
+        if (started[w]) {
+            pthread_join(threads[w], NULL);
+        } else {
+            resolveFFISymbols(&jobs[w]);
+        }
+    }
+    
+    // Call descriptors are cheap once the symbols are known
+    int failed = 0;
+    for (int i = 0; i < count; i++) {
+        if (items[i].error == NULL) {
+            compileFFIMethod(vm, items[i].methodInfo, items[i].methodInfo->arity, &items[i].error);
+        }
+        if (items[i].error != NULL) failed++;
+    }
+    fprintf(stderr, "Eagerly resolved %d FFI methods with %d worker(s), %d failed\n", count, workers, failed);
+    
+    if (failed > 0) {
+        // One line per method, the first few also go into the fiber error
+        char message[1024];
+        int used = snprintf(message, sizeof(message), "%d FFI methods could not be bound:", failed);
+        for (int i = 0; i < count; i++) {
+            if (items[i].error == NULL) continue;
+            FFIMethodInfo* methodInfo = items[i].methodInfo;
+            const char* className = methodInfo->classObj->name != NULL ? methodInfo->classObj->name->value : "?";
+            fprintf(stderr, "  %s.%s: %s (%s)\n", className, methodInfo->signature, items[i].error,
+                    methodInfo->dllName != NULL ? methodInfo->dllName : "no #!extern");
+            if (used < (int)sizeof(message)) {
+                used += snprintf(message + used, sizeof(message) - used, " %s.%s (%s)",
+                                 className, methodInfo->signature, items[i].error);
+            }
+        }
+        free(items);
+        wrenSetSlotString(vm, 0, message);
+        wrenAbortFiber(vm, 0);
+        return;
+    }
+    free(items);
+}
+
+// Function to print all stored FFI classes
+void printFFIClasses(WreniContext* ctx) {
+    fprintf(stderr, "=== Stored FFI Classes (%u) ===\n", ctx->classesByName.count);
+    int index = 0;
+    for (uint32_t i = 0; i < ctx->classesByName.capacity; i++) {
+        FFIClassInfo* info = ctx->classesByName.slots[i].info;
+        if (info == NULL) continue;
+        fprintf(stderr, "%d: %s.%s (classObj: %p)\n", 
+                index++, info->moduleName, info->className, 
+                (void*)info->classObj);
+    }
+    fprintf(stderr, "=== End FFI Classes ===\n");
+}
+
+void writeFn(WrenVM* vm, const char* text)
+{
+    printf("%s", text);
+    fflush(stdout);
+}
+
+void errorFn(WrenVM* vm, WrenErrorType type, const char* module, int line,
+    const char* message)
+{
+    fprintf(stderr, "%s.wren:%d: %s\n", module, line, message);
+}
+
+// Directories searched for "<name>.wren", the current directory first then
+// the entries of WRENI_PATH, separated by ':'
+static char** modulePaths = NULL;
+static int modulePathCount = 0;
+static pthread_once_t modulePathsOnce = PTHREAD_ONCE_INIT;
+
+// Function to add a directory to the module search path
+static void addModulePath(const char* path, size_t length) {
+    if (length == 0) return;
+    char** paths = realloc(modulePaths, (modulePathCount + 1) * sizeof(char*));
+    if (paths == NULL) return;
+    modulePaths = paths;
+    modulePaths[modulePathCount] = strndup(path, length);
+    if (modulePaths[modulePathCount] != NULL) modulePathCount++;
+}
+
+// Function to build the search path, run once for every VM by pthread_once
+static void initModulePaths(void) {
+    addModulePath(".", 1);
+    
+    const char* env = getenv("WRENI_PATH");
+    while (env != NULL && *env) {
+        size_t length = strcspn(env, ":");
+        addModulePath(env, length);
+        env += length;
+        if (*env == ':') env++;
+    }
+}
+
+// Source of a module mapped into memory. Wren needs a NUL terminated
+// source, so the mapping is followed by at least one zero byte: the rest
+// of the file's last page, or an anonymous zero page when the size is a
+// multiple of the page size.
+struct MappedModule {
+    char* name;
+    char* source;
+    size_t length;
+    size_t mapSize;
+    uint8_t* cached;           // Compiled module read from the cache, see loadModuleFn
+    size_t cachedSize;
+    char* eagerSource;         // Source ending with the eager binding call, see loadModuleFn
+    struct MappedModule* next;
+};
+
+// Helper function to find the file of a module on the search path, opened
+static int openModuleFile(const char* name, char* path, size_t pathSize) {
+    for (int i = 0; i < modulePathCount; i++) {
+        snprintf(path, pathSize, "%s/%s.wren", modulePaths[i], name);
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) return fd;
+    }
+    return -1;
+}
+
+// Function to map the source of a module, NULL if it isn't found. With
+// [willNeed] the module is prefetched, a name that doesn't resolve is left
+// for the import to report, if it is imported at all.
+static MappedModule* mapModule(const char* name, bool willNeed) {
+    char path[PATH_MAX];
+    int fd = openModuleFile(name, path, sizeof(path));
+    if (fd < 0) {
+        if (!willNeed) fprintf(stderr, "Could not find module \"%s\".\n", name);
+        return NULL;
+    }
+    
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        fprintf(stderr, "Could not determine file size for \"%s\".\n", path);
+        close(fd);
+        return NULL;
+    }
+    
+    // Reserve the file's pages plus the terminator, then map the file over them
+    size_t size = (size_t)info.st_size;
+    size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    size_t mapSize = (size + pageSize) & ~(pageSize - 1);
+    char* source = mmap(NULL, mapSize, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (source != MAP_FAILED && size > 0 &&
+        mmap(source, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(source, mapSize);
+        source = MAP_FAILED;
+    }
+    close(fd);
+    
+    MappedModule* module = source != MAP_FAILED ? malloc(sizeof(MappedModule)) : NULL;
+    if (module == NULL) {
+        fprintf(stderr, "Could not map file \"%s\".\n", path);
+        if (source != MAP_FAILED) munmap(source, mapSize);
+        return NULL;
+    }
+    
+    // Ask the kernel to start reading pages in while other modules compile
+    if (willNeed && size > 0) madvise(source, size, MADV_WILLNEED);
+    
+    module->name = strdup(name);
+    module->source = source;
+    module->length = size;
+    module->mapSize = mapSize;
+    module->cached = NULL;
+    module->cachedSize = 0;
+    module->eagerSource = NULL;
+    module->next = NULL;
+    return module;
+}
+
+static void unmapModule(MappedModule* module) {
+    munmap(module->source, module->mapSize);
+    free(module->cached);
+    free(module->eagerSource);
+    free(module->name);
+    free(module);
+}
+
+// Helper function to check if a module is built in, loaded or prefetched
+static bool isModuleKnown(WrenVM* vm, const char* name, size_t length) {
+    if ((length == 4 && strncmp(name, "meta", 4) == 0) ||
+        (length == 6 && strncmp(name, "random", 6) == 0) ||
+        (length == 3 && strncmp(name, "ffi", 3) == 0)) {
+        return true;
+    }
+    for (MappedModule* module = getWreniContext(vm)->prefetchedModules; module != NULL; module = module->next) {
+        if (strlen(module->name) == length && strncmp(module->name, name, length) == 0) return true;
+    }
+    
+    // Loaded modules are compared in place, no string is made for the lookup
+    ObjMap* modules = vm->modules;
+    for (uint32_t i = 0; i < modules->capacity; i++) {
+        Value key = modules->entries[i].key;
+        if (IS_STRING(key) && AS_STRING(key)->length == length &&
+            memcmp(AS_STRING(key)->value, name, length) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Function to find the `import "name"` statements of a source and map the
+// modules they name with MADV_WILLNEED, so their pages are read in while
+// the importing module compiles. The scan is textual and skips comments
+// and strings, a missed import is just loaded when the compiler asks.
+static void prefetchImports(WrenVM* vm, const char* source) {
+    const char* p = source;
+    bool lineStart = true;
+    
+    while (*p) {
+        if (p[0] == '/' && p[1] == '/') {
+            while (*p && *p != '\n') p++;
+            continue;
+        }
+        if (p[0] == '/' && p[1] == '*') {
+            // Block comments nest in Wren
+            int depth = 0;
+            do {
+                if (p[0] == '/' && p[1] == '*') { depth++; p += 2; }
+                else if (p[0] == '*' && p[1] == '/') { depth--; p += 2; }
+                else p++;
+            } while (*p && depth > 0);
+            continue;
+        }
+        if (*p == '"') {
+            for (p++; *p && *p != '"'; p++) {
+                if (*p == '\\' && p[1]) p++;
+            }
+            if (*p) p++;
+            continue;
+        }
+        if (*p == '\n') {
+            lineStart = true;
+            p++;
+            continue;
+        }
+        if (*p == ' ' || *p == '\t' || *p == '\r') {
+            p++;
+            continue;
+        }
+        
+        if (lineStart && strncmp(p, "import", 6) == 0 && (p[6] == ' ' || p[6] == '\t')) {
+            const char* name = p + 6;
+            while (*name == ' ' || *name == '\t') name++;
+            if (*name == '"') {
+                name++;
+                size_t length = strcspn(name, "\"\n");
+                if (name[length] == '"' && length < 256 && !isModuleKnown(vm, name, length)) {
+                    char moduleName[256];
+                    memcpy(moduleName, name, length);
+                    moduleName[length] = '\0';
+                    
+                    MappedModule* module = mapModule(moduleName, true);
+                    if (module != NULL) {
+                        module->next = getWreniContext(vm)->prefetchedModules;
+                        getWreniContext(vm)->prefetchedModules = module;
+                    }
+                }
+            }
+        }
+        
+        // Skip the rest of the token
+        lineStart = false;
+        while (*p && *p != '\n' && *p != '"' && *p != '/' && *p != ' ' && *p != '\t') p++;
+    }
+}
+
+// On-disk cache of compiled modules. A module compiled from source is
+// serialized right after compilation, before it runs and binds methods,
+// into <cache dir>/<module>.wrenc: its module variables, the method names
+// it uses and its function tree with bytecode, constants and line info.
+// Attributes are built by the module's own bytecode so they come along.
+// The file is keyed by the source hash, the Wren version, Wren's opcode
+// table and the core module variables. On a warm start the compiler is given an empty source
+// and the function of the resulting module closure is swapped for the one
+// rebuilt from the cache, see loadModuleCompleteFn.
+//
+// The cache is off unless WRENI_CACHE=1 turns it on in $XDG_CACHE_HOME/wreni
+// (~/.cache/wreni by default) or WRENI_CACHE_DIR names its directory.
+// WRENI_NO_CACHE=1 turns it off either way.
+
+#define MODULE_CACHE_MAGIC 0x434e5257u    // "WRNC"
+#define MODULE_CACHE_FORMAT 2
+#define MODULE_CACHE_MAX_DEPTH 64
+
+static char moduleCacheUserDir[PATH_MAX];
+static pthread_once_t moduleCacheUserDirOnce = PTHREAD_ONCE_INIT;
+
+// Function to find the user's cache directory, left empty without one
+static void initModuleCacheUserDir(void) {
+    const char* base = getenv("XDG_CACHE_HOME");
+    const char* home = getenv("HOME");
+    if (base != NULL && *base == '/') {
+        snprintf(moduleCacheUserDir, sizeof(moduleCacheUserDir), "%s/wreni", base);
+    } else if (home != NULL && *home) {
+        snprintf(moduleCacheUserDir, sizeof(moduleCacheUserDir), "%s/.cache/wreni", home);
+    }
+}
+
+static const char* moduleCacheDir(void) {
+    const char* noCache = getenv("WRENI_NO_CACHE");
+    if (noCache != NULL && strcmp(noCache, "0") != 0) return NULL;
+    const char* dir = getenv("WRENI_CACHE_DIR");
+    if (dir != NULL && *dir) return dir;
+    const char* cache = getenv("WRENI_CACHE");
+    if (cache == NULL || strcmp(cache, "0") == 0) return NULL;
+    pthread_once(&moduleCacheUserDirOnce, initModuleCacheUserDir);
+    return moduleCacheUserDir[0] != '\0' ? moduleCacheUserDir : NULL;
+}
+
+// Helper function to create the cache directory with its missing parents
+static void makeModuleCacheDir(const char* dir) {
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s", dir) >= (int)sizeof(path)) return;
+    for (char* p = path + 1; *p; p++) {
+        if (*p != '/') continue;
+        *p = '\0';
+        mkdir(path, 0755);
+        *p = '/';
+    }
+    mkdir(path, 0755);
+}
+
+// Helper function to hash bytes with 64-bit FNV-1a
+static uint64_t hashModuleBytes(uint64_t h, const void* data, size_t length) {
+    const uint8_t* p = data;
+    for (size_t i = 0; i < length; i++) {
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+// Names and stack effects of Wren's opcodes, in order. The operand sizes of
+// moduleCacheOperandBytes only hold for the instruction set they were
+// written for, so a build with another one must not read the cache.
+static const char moduleCacheOpcodes[] =
+#define OPCODE(name, effect) #name ":" #effect ";"
+#include "wren/src/vm/wren_opcodes.h"
+#undef OPCODE
+    "";
+
+// Hash of the core module variables every module starts with, the cached
+// module variable indexes are only valid for the same core
+static uint64_t hashCoreModule(WrenVM* vm) {
+    ObjModule* core = AS_MODULE(wrenMapGet(vm->modules, NULL_VAL));
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (int i = 0; i < core->variableNames.count; i++) {
+        h = hashModuleBytes(h, core->variableNames.data[i]->value, core->variableNames.data[i]->length + 1);
+    }
+    return h;
+}
+
+// Helper function to build the cache file path of a module, characters
+// other than letters, digits, '-' and '_' are escaped as %XX
+static bool moduleCachePath(const char* name, char* path, size_t pathSize) {
+    const char* dir = moduleCacheDir();
+    if (dir == NULL) return false;
+    
+    size_t used = (size_t)snprintf(path, pathSize, "%s/", dir);
+    for (const char* p = name; *p && used + 4 < pathSize; p++) {
+        unsigned char c = (unsigned char)*p;
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '_') {
+            path[used++] = (char)c;
+        } else {
+            used += (size_t)snprintf(path + used, pathSize - used, "%%%02X", c);
+        }
+    }
+    return snprintf(path + used, pathSize - used, ".wrenc") < (int)(pathSize - used);
+}
+
+// Number of operand bytes following the instruction at [ip], -1 if the
+// bytecode is malformed. Closures are followed by two bytes per upvalue
+// of the function they create, given by [upvalues] for each constant.
+static int moduleCacheOperandBytes(const uint8_t* code, int count, int ip,
+                                   const int* upvalues, int constantCount) {
+    Code instruction = (Code)code[ip];
+    int bytes;
+    
+    if ((instruction >= CODE_LOAD_LOCAL_0 && instruction <= CODE_LOAD_LOCAL_8) ||
+        instruction == CODE_NULL || instruction == CODE_FALSE || instruction == CODE_TRUE ||
+        instruction == CODE_POP || instruction == CODE_CLOSE_UPVALUE || instruction == CODE_RETURN ||
+        instruction == CODE_CONSTRUCT || instruction == CODE_FOREIGN_CONSTRUCT ||
+        instruction == CODE_FOREIGN_CLASS || instruction == CODE_END_CLASS ||
+        instruction == CODE_END_MODULE || instruction == CODE_END) {
+        bytes = 0;
+    } else if (instruction == CODE_LOAD_LOCAL || instruction == CODE_STORE_LOCAL ||
+               instruction == CODE_LOAD_UPVALUE || instruction == CODE_STORE_UPVALUE ||
+               instruction == CODE_LOAD_FIELD_THIS || instruction == CODE_STORE_FIELD_THIS ||
+               instruction == CODE_LOAD_FIELD || instruction == CODE_STORE_FIELD ||
+               instruction == CODE_CLASS) {
+        bytes = 1;
+    } else if ((instruction >= CODE_CALL_0 && instruction <= CODE_CALL_16) ||
+               instruction == CODE_CONSTANT || instruction == CODE_LOAD_MODULE_VAR ||
+               instruction == CODE_STORE_MODULE_VAR || instruction == CODE_JUMP ||
+               instruction == CODE_LOOP || instruction == CODE_JUMP_IF ||
+               instruction == CODE_AND || instruction == CODE_OR ||
+               instruction == CODE_METHOD_INSTANCE || instruction == CODE_METHOD_STATIC ||
+               instruction == CODE_IMPORT_MODULE || instruction == CODE_IMPORT_VARIABLE) {
+        bytes = 2;
+    } else if (instruction >= CODE_SUPER_0 && instruction <= CODE_SUPER_16) {
+        bytes = 4;
+    } else if (instruction == CODE_CLOSURE) {
+        if (ip + 2 >= count) return -1;
+        int constant = (code[ip + 1] << 8) | code[ip + 2];
+        if (constant >= constantCount || upvalues[constant] < 0) return -1;
+        bytes = 2 + upvalues[constant] * 2;
+    } else {
+        return -1;
+    }
+    
+    return ip + bytes < count ? bytes : -1;
+}
+
+// Helper function to tell if an instruction has a method symbol operand
+static inline bool moduleCacheHasSymbol(Code instruction) {
+    return (instruction >= CODE_CALL_0 && instruction <= CODE_CALL_16) ||
+           (instruction >= CODE_SUPER_0 && instruction <= CODE_SUPER_16) ||
+           instruction == CODE_METHOD_INSTANCE || instruction == CODE_METHOD_STATIC;
+}
+
+// Growable byte buffer a cache file is written into
+typedef struct {
+    uint8_t* data;
+    size_t size;
+    size_t capacity;
+    bool failed;
+} ModuleCacheWriter;
+
+static void writeCacheBytes(ModuleCacheWriter* w, const void* bytes, size_t size) {
+    if (w->failed) return;
+    if (!reserveFFIBatch((void**)&w->data, &w->capacity, w->size + size)) {
+        w->failed = true;
+        return;
+    }
+    memcpy(w->data + w->size, bytes, size);
+    w->size += size;
+}
+
+static void writeCacheU32(ModuleCacheWriter* w, uint32_t value) {
+    writeCacheBytes(w, &value, sizeof(value));
+}
+
+static void writeCacheString(ModuleCacheWriter* w, const char* text, uint32_t length) {
+    writeCacheU32(w, length);
+    writeCacheBytes(w, text, length);
+}
+
+// Method names used by a module, indexed in the order they are first seen
+typedef struct {
+    int* localSymbols;         // VM symbol -> local index, -1 if unused
+    int* vmSymbols;            // Local index -> VM symbol
+    int count;
+} ModuleCacheSymbols;
+
+// Function to write a function and the functions in its constants. Symbol
+// operands in the written bytecode are replaced by local indexes.
+static bool writeCachedFn(WrenVM* vm, ModuleCacheWriter* w, ModuleCacheSymbols* symbols, ObjFn* fn, int depth) {
+    if (depth > MODULE_CACHE_MAX_DEPTH) return false;
+    
+    writeCacheU32(w, (uint32_t)fn->maxSlots);
+    writeCacheU32(w, (uint32_t)fn->numUpvalues);
+    writeCacheU32(w, (uint32_t)fn->arity);
+    const char* debugName = fn->debug != NULL && fn->debug->name != NULL ? fn->debug->name : "";
+    writeCacheString(w, debugName, (uint32_t)strlen(debugName));
+    
+    // Constants come first so the upvalue counts of closures are known when
+    // the bytecode is read back
+    int constantCount = fn->constants.count;
+    int* upvalues = malloc((constantCount + 1) * sizeof(int));
+    if (upvalues == NULL) return false;
+    
+    writeCacheU32(w, (uint32_t)constantCount);
+    for (int i = 0; i < constantCount; i++) {
+        Value constant = fn->constants.data[i];
+        upvalues[i] = -1;
+        if (IS_NULL(constant)) {
+            writeCacheBytes(w, "n", 1);
+        } else if (IS_NUM(constant)) {
+            double num = AS_NUM(constant);
+            writeCacheBytes(w, "d", 1);
+            writeCacheBytes(w, &num, sizeof(num));
+        } else if (IS_STRING(constant)) {
+            writeCacheBytes(w, "s", 1);
+            writeCacheString(w, AS_STRING(constant)->value, AS_STRING(constant)->length);
+        } else if (IS_FN(constant)) {
+            writeCacheBytes(w, "f", 1);
+            upvalues[i] = AS_FN(constant)->numUpvalues;
+            if (!writeCachedFn(vm, w, symbols, AS_FN(constant), depth + 1)) {
+                free(upvalues);
+                return false;
+            }
+        } else {
+            // Not a constant the compiler makes, don't cache this module
+            free(upvalues);
+            return false;
+        }
+    }
+    
+    // Copy the bytecode and renumber method symbols
+    int count = fn->code.count;
+    uint8_t* code = malloc(count > 0 ? count : 1);
+    bool valid = code != NULL;
+    if (valid) memcpy(code, fn->code.data, count);
+    for (int ip = 0; valid && ip < count; ) {
+        int bytes = moduleCacheOperandBytes(code, count, ip, upvalues, constantCount);
+        if (bytes < 0) {
+            valid = false;
+            break;
+        }
+        if (moduleCacheHasSymbol((Code)code[ip])) {
+            int symbol = (code[ip + 1] << 8) | code[ip + 2];
+            if (symbols->localSymbols[symbol] < 0) {
+                symbols->localSymbols[symbol] = symbols->count;
+                symbols->vmSymbols[symbols->count++] = symbol;
+            }
+            code[ip + 1] = (uint8_t)(symbols->localSymbols[symbol] >> 8);
+            code[ip + 2] = (uint8_t)(symbols->localSymbols[symbol] & 0xff);
+        }
+        ip += 1 + bytes;
+    }
+    
+    if (valid) {
+        writeCacheU32(w, (uint32_t)count);
+        writeCacheBytes(w, code, count);
+        
+        // One source line per bytecode byte, for stack traces
+        int lineCount = fn->debug != NULL ? fn->debug->sourceLines.count : 0;
+        writeCacheU32(w, (uint32_t)lineCount);
+        if (lineCount > 0) writeCacheBytes(w, fn->debug->sourceLines.data, lineCount * sizeof(int));
+    }
+    
+    free(code);
+    free(upvalues);
+    return valid && !w->failed;
+}
+
+// Function to write the cache file of a module compiled from source
+static void saveModuleCache(WrenVM* vm, const char* name, uint64_t sourceHash, ObjClosure* closure) {
+    char path[PATH_MAX];
+    if (!moduleCachePath(name, path, sizeof(path))) return;
+    
+    ObjModule* module = closure->fn->module;
+    ObjModule* core = AS_MODULE(wrenMapGet(vm->modules, NULL_VAL));
+    
+    ModuleCacheSymbols symbols = {0};
+    symbols.localSymbols = malloc(vm->methodNames.count * sizeof(int));
+    symbols.vmSymbols = malloc(vm->methodNames.count * sizeof(int));
+    ModuleCacheWriter body = {0};
+    ModuleCacheWriter file = {0};
+    
+    bool valid = symbols.localSymbols != NULL && symbols.vmSymbols != NULL;
+    if (valid) {
+        for (int i = 0; i < vm->methodNames.count; i++) symbols.localSymbols[i] = -1;
+        valid = writeCachedFn(vm, &body, &symbols, closure->fn, 0);
+    }
+    
+    if (valid) {
+        writeCacheU32(&file, MODULE_CACHE_MAGIC);
+        writeCacheU32(&file, MODULE_CACHE_FORMAT);
+        writeCacheU32(&file, WREN_VERSION_NUMBER);
+        uint64_t coreHash = hashCoreModule(vm);
+        uint64_t opcodeHash = hashModuleBytes(0xcbf29ce484222325ULL, moduleCacheOpcodes, sizeof(moduleCacheOpcodes));
+        writeCacheBytes(&file, &sourceHash, sizeof(sourceHash));
+        writeCacheBytes(&file, &coreHash, sizeof(coreHash));
+        writeCacheBytes(&file, &opcodeHash, sizeof(opcodeHash));
+        
+        // Variables the module declares after the ones copied from core
+        writeCacheU32(&file, (uint32_t)(module->variableNames.count - core->variableNames.count));
+        for (int i = core->variableNames.count; i < module->variableNames.count; i++) {
+            writeCacheString(&file, module->variableNames.data[i]->value, module->variableNames.data[i]->length);
+        }
+        
+        writeCacheU32(&file, (uint32_t)symbols.count);
+        for (int i = 0; i < symbols.count; i++) {
+            ObjString* symbol = vm->methodNames.data[symbols.vmSymbols[i]];
+            writeCacheString(&file, symbol->value, symbol->length);
+        }
+        writeCacheBytes(&file, body.data, body.size);
+        
+        // Checksum of everything before it, catches damaged files
+        uint64_t checksum = hashModuleBytes(0xcbf29ce484222325ULL, file.data, file.size);
+        writeCacheBytes(&file, &checksum, sizeof(checksum));
+        valid = !file.failed;
+    }
+    
+    // Written under a temporary name and renamed, readers never see half a file
+    if (valid) {
+        makeModuleCacheDir(moduleCacheDir());
+        char tempPath[PATH_MAX + 32];
+        snprintf(tempPath, sizeof(tempPath), "%s.%d.%lx", path, (int)getpid(), (unsigned long)pthread_self());
+        FILE* out = fopen(tempPath, "wb");
+        valid = out != NULL && fwrite(file.data, 1, file.size, out) == file.size;
+        if (out != NULL && fclose(out) != 0) valid = false;
+        if (valid && rename(tempPath, path) != 0) valid = false;
+        if (!valid) remove(tempPath);
+    }
+    
+    if (valid) {
+        fprintf(stderr, "Cached compiled module '%s' in %s (%zu bytes)\n", name, path, file.size);
+    }
+    free(symbols.localSymbols);
+    free(symbols.vmSymbols);
+    free(body.data);
+    free(file.data);
+}
+
+// Reader over a cache file. Every read is bounds checked, a truncated or
+// corrupt file only sets [failed].
+typedef struct {
+    const uint8_t* p;
+    const uint8_t* end;
+    bool failed;
+} ModuleCacheReader;
+
+static const uint8_t* readCacheBytes(ModuleCacheReader* r, size_t size) {
+    if (r->failed || (size_t)(r->end - r->p) < size) {
+        r->failed = true;
+        return NULL;
+    }
+    const uint8_t* bytes = r->p;
+    r->p += size;
+    return bytes;
+}
+
+static uint32_t readCacheU32(ModuleCacheReader* r) {
+    uint32_t value = 0;
+    const uint8_t* bytes = readCacheBytes(r, sizeof(value));
+    if (bytes != NULL) memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+static const char* readCacheString(ModuleCacheReader* r, uint32_t* length) {
+    *length = readCacheU32(r);
+    return (const char*)readCacheBytes(r, *length);
+}
+
+// Function to read a function written by writeCachedFn. With [vm] NULL the
+// data is only checked, otherwise the ObjFn is rebuilt in [module] and
+// local symbol operands are mapped to the VM's [symbols].
+static bool readCachedFn(ModuleCacheReader* r, WrenVM* vm, ObjModule* module, const int* symbols,
+                         int symbolCount, int variableCount, ObjFn** out, int depth) {
+    if (depth > MODULE_CACHE_MAX_DEPTH) return false;
+    
+    uint32_t maxSlots = readCacheU32(r);
+    uint32_t numUpvalues = readCacheU32(r);
+    uint32_t arity = readCacheU32(r);
+    uint32_t nameLength;
+    const char* debugName = readCacheString(r, &nameLength);
+    uint32_t constantCount = readCacheU32(r);
+    if (r->failed || numUpvalues > 255 || arity > 16 || constantCount > 65536) return false;
+    
+    ObjFn* fn = NULL;
+    if (vm != NULL) {
+        fn = wrenNewFunction(vm, module, (int)maxSlots);
+        fn->numUpvalues = (int)numUpvalues;
+        fn->arity = (int)arity;
+        wrenFunctionBindName(vm, fn, debugName, (int)nameLength);
+    }
+    
+    int* upvalues = malloc((constantCount + 1) * sizeof(int));
+    if (upvalues == NULL) return false;
+    
+    bool valid = true;
+    for (uint32_t i = 0; valid && i < constantCount; i++) {
+        const uint8_t* tag = readCacheBytes(r, 1);
+        Value constant = NULL_VAL;
+        upvalues[i] = -1;
+        
+        if (tag == NULL) {
+            valid = false;
+        } else if (*tag == 'n') {
+            constant = NULL_VAL;
+        } else if (*tag == 'd') {
+            double num = 0;
+            const uint8_t* bytes = readCacheBytes(r, sizeof(num));
+            if (bytes != NULL) memcpy(&num, bytes, sizeof(num));
+            constant = NUM_VAL(num);
+        } else if (*tag == 's') {
+            uint32_t length;
+            const char* text = readCacheString(r, &length);
+            if (text != NULL && vm != NULL) constant = wrenNewStringLength(vm, text, length);
+        } else if (*tag == 'f') {
+            ObjFn* child = NULL;
+            const uint8_t* start = r->p;
+            valid = readCachedFn(r, vm, module, symbols, symbolCount, variableCount, vm != NULL ? &child : NULL, depth + 1);
+            if (valid) {
+                // The upvalue count is the second field of the function
+                uint32_t childUpvalues;
+                memcpy(&childUpvalues, start + sizeof(uint32_t), sizeof(childUpvalues));
+                upvalues[i] = (int)childUpvalues;
+                if (child != NULL) constant = OBJ_VAL(child);
+            }
+        } else {
+            valid = false;
+        }
+        
+        valid = valid && !r->failed;
+        if (valid && fn != NULL) wrenValueBufferWrite(vm, &fn->constants, constant);
+    }
+    
+    uint32_t count = valid ? readCacheU32(r) : 0;
+    const uint8_t* code = valid ? readCacheBytes(r, count) : NULL;
+    valid = valid && code != NULL;
+    
+    // Check every instruction, the VM trusts bytecode completely
+    for (uint32_t ip = 0; valid && ip < count; ) {
+        int bytes = moduleCacheOperandBytes(code, (int)count, (int)ip, upvalues, (int)constantCount);
+        if (bytes < 0) {
+            valid = false;
+            break;
+        }
+        Code instruction = (Code)code[ip];
+        int operand = bytes >= 2 ? (code[ip + 1] << 8) | code[ip + 2] : 0;
+        if (moduleCacheHasSymbol(instruction)) {
+            valid = operand < symbolCount;
+        } else if (instruction == CODE_CONSTANT || instruction == CODE_IMPORT_MODULE ||
+                   instruction == CODE_IMPORT_VARIABLE) {
+            valid = operand < (int)constantCount;
+        } else if (instruction == CODE_LOAD_MODULE_VAR || instruction == CODE_STORE_MODULE_VAR) {
+            valid = operand < variableCount;
+        }
+        if (valid && instruction >= CODE_SUPER_0 && instruction <= CODE_SUPER_16) {
+            valid = ((code[ip + 3] << 8) | code[ip + 4]) < (int)constantCount;
+        }
+        ip += 1 + bytes;
+    }
+    valid = valid && count > 0 && code[count - 1] == CODE_END;
+    
+    uint32_t lineCount = valid ? readCacheU32(r) : 0;
+    const uint8_t* lines = valid ? readCacheBytes(r, (size_t)lineCount * sizeof(int)) : NULL;
+    valid = valid && (lineCount == 0 || lines != NULL) && !r->failed;
+    
+    if (valid && fn != NULL) {
+        wrenByteBufferFill(vm, &fn->code, 0, (int)count);
+        memcpy(fn->code.data, code, count);
+        for (uint32_t ip = 0; ip < count; ) {
+            if (moduleCacheHasSymbol((Code)fn->code.data[ip])) {
+                int symbol = symbols[(fn->code.data[ip + 1] << 8) | fn->code.data[ip + 2]];
+                fn->code.data[ip + 1] = (uint8_t)(symbol >> 8);
+                fn->code.data[ip + 2] = (uint8_t)(symbol & 0xff);
+            }
+            ip += 1 + moduleCacheOperandBytes(fn->code.data, (int)count, (int)ip, upvalues, (int)constantCount);
+        }
+        if (lineCount > 0) {
+            wrenIntBufferFill(vm, &fn->debug->sourceLines, 0, (int)lineCount);
+            memcpy(fn->debug->sourceLines.data, lines, lineCount * sizeof(int));
+        }
+        *out = fn;
+    }
+    
+    free(upvalues);
+    return valid;
+}
+
+// Function to check a cache file against the source and the running VM.
+// The whole function tree is validated here, so the rebuild that follows
+// once the module exists can't fail half way.
+static bool checkModuleCache(WrenVM* vm, const uint8_t* data, size_t size, uint64_t sourceHash) {
+    uint64_t checksum;
+    if (size < sizeof(checksum)) return false;
+    size -= sizeof(checksum);
+    memcpy(&checksum, data + size, sizeof(checksum));
+    if (checksum != hashModuleBytes(0xcbf29ce484222325ULL, data, size)) return false;
+    
+    ModuleCacheReader r = { data, data + size, false };
+    if (readCacheU32(&r) != MODULE_CACHE_MAGIC || readCacheU32(&r) != MODULE_CACHE_FORMAT ||
+        readCacheU32(&r) != WREN_VERSION_NUMBER) {
+        return false;
+    }
+    
+    uint64_t hashes[3];
+    const uint8_t* bytes = readCacheBytes(&r, sizeof(hashes));
+    if (bytes == NULL) return false;
+    memcpy(hashes, bytes, sizeof(hashes));
+    if (hashes[0] != sourceHash || hashes[1] != hashCoreModule(vm) ||
+        hashes[2] != hashModuleBytes(0xcbf29ce484222325ULL, moduleCacheOpcodes, sizeof(moduleCacheOpcodes))) {
+        return false;
+    }
+    
+    ObjModule* core = AS_MODULE(wrenMapGet(vm->modules, NULL_VAL));
+    uint32_t variableCount = readCacheU32(&r);
+    for (uint32_t i = 0; i < variableCount && !r.failed; i++) {
+        uint32_t length;
+        readCacheString(&r, &length);
+    }
+    
+    uint32_t symbolCount = readCacheU32(&r);
+    for (uint32_t i = 0; i < symbolCount && !r.failed; i++) {
+        uint32_t length;
+        readCacheString(&r, &length);
+    }
+    if (r.failed || variableCount > 65536 || symbolCount > 65536) return false;
+    
+    return readCachedFn(&r, NULL, NULL, NULL, (int)symbolCount,
+                        core->variableNames.count + (int)variableCount, NULL, 0) && r.p == r.end;
+}
+
+// Function to rebuild a module from a checked cache file into the module
+// of [closure], which was compiled from an empty source. The module is only
+// changed once the function tree is rebuilt, a failure leaves it empty.
+static bool rebuildModuleFromCache(WrenVM* vm, ObjClosure* closure, const uint8_t* data, size_t size) {
+    ObjModule* module = closure->fn->module;
+    ModuleCacheReader r = { data, data + size - sizeof(uint64_t), false };
+    readCacheBytes(&r, 3 * sizeof(uint32_t) + 3 * sizeof(uint64_t));
+    
+    // Nothing below is reachable by the GC until the closure points to it,
+    // so collection is held off while it is built, both Wren's own and the
+    // one scheduled by the host
+    size_t nextGC = vm->nextGC;
+    vm->nextGC = SIZE_MAX;
+    WreniGC* gc = &getWreniContext(vm)->gc;
+    gc->held++;
+    
+    // Variables are defined after the function tree is read
+    uint32_t variableCount = readCacheU32(&r);
+    const uint8_t* variables = r.p;
+    for (uint32_t i = 0; i < variableCount; i++) {
+        uint32_t length;
+        readCacheString(&r, &length);
+    }
+    
+    uint32_t symbolCount = readCacheU32(&r);
+    int* symbols = malloc((symbolCount + 1) * sizeof(int));
+    bool rebuilt = symbols != NULL;
+    for (uint32_t i = 0; rebuilt && i < symbolCount; i++) {
+        uint32_t length;
+        const char* symbol = readCacheString(&r, &length);
+        symbols[i] = wrenSymbolTableEnsure(vm, &vm->methodNames, symbol, length);
+    }
+    
+    ObjFn* fn = NULL;
+    if (rebuilt) {
+        rebuilt = readCachedFn(&r, vm, module, symbols, (int)symbolCount,
+                               module->variables.count + (int)variableCount, &fn, 0);
+    }
+    if (rebuilt) {
+        ModuleCacheReader names = { variables, r.end, false };
+        for (uint32_t i = 0; i < variableCount; i++) {
+            uint32_t length;
+            const char* variable = readCacheString(&names, &length);
+            wrenDefineVariable(vm, module, variable, length, NULL_VAL, NULL);
+        }
+        closure->fn = fn;
+    }
+    
+    free(symbols);
+    vm->nextGC = nextGC;
+    gc->held--;
+    return rebuilt;
+}
+
+// Helper function to hash the source a module is compiled from
+static uint64_t hashModuleSource(MappedModule* module) {
+    if (module->eagerSource != NULL) {
+        return hashModuleBytes(0xcbf29ce484222325ULL, module->eagerSource, strlen(module->eagerSource));
+    }
+    return hashModuleBytes(0xcbf29ce484222325ULL, module->source, module->length);
+}
+
+// Helper function to read the cache file of a module if it matches the source
+static bool readModuleCache(WrenVM* vm, MappedModule* module) {
+    char path[PATH_MAX];
+    if (!moduleCachePath(module->name, path, sizeof(path))) return false;
+    
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return false;
+    
+    struct stat info;
+    uint8_t* data = NULL;
+    size_t size = 0;
+    if (fstat(fileno(file), &info) == 0 && info.st_size > 0) {
+        size = (size_t)info.st_size;
+        data = malloc(size);
+        if (data != NULL && fread(data, 1, size, file) != size) {
+            free(data);
+            data = NULL;
+        }
+    }
+    fclose(file);
+    
+    if (data == NULL || !checkModuleCache(vm, data, size, hashModuleSource(module))) {
+        free(data);
+        return false;
+    }
+    
+    module->cached = data;
+    module->cachedSize = size;
+    return true;
+}
+
+// Function to drop prefetched modules that were never imported
+static void releasePrefetchedModules(WreniContext* ctx) {
+    while (ctx->prefetchedModules != NULL) {
+        MappedModule* module = ctx->prefetchedModules;
+        ctx->prefetchedModules = module->next;
+        unmapModule(module);
+    }
+}
+
+void loadModuleCompleteFn(WrenVM* vm, const char* name, struct WrenLoadModuleResult result)
+{
+    fprintf(stderr, "Finish loading module '%s'\n", name);
+    
+    MappedModule* module = result.userData;
+    if (module == NULL) return;
+    
+    // The module's closure is the last object the compiler allocated, it
+    // hasn't run yet. Anything else means the compilation failed.
+    ObjClosure* closure = NULL;
+    if (vm->first != NULL && vm->first->type == OBJ_CLOSURE) {
+        closure = (ObjClosure*)vm->first;
+        ObjModule* compiled = closure->fn->module;
+        if (compiled == NULL || compiled->name == NULL || strcmp(compiled->name->value, name) != 0) {
+            closure = NULL;
+        }
+    }
+    
+    if (closure != NULL && module->cached != NULL) {
+        if (rebuildModuleFromCache(vm, closure, module->cached, module->cachedSize)) {
+            fprintf(stderr, "Loaded compiled module '%s' from cache\n", name);
+        } else {
+            // The empty module is left as it was, compile the source into it.
+            // The closure isn't reachable from anywhere yet.
+            fprintf(stderr, "Could not rebuild module '%s' from cache, compiling it\n", name);
+            wrenPushRoot(vm, (Obj*)closure);
+            ObjFn* fn = wrenCompile(vm, closure->fn->module,
+                                    module->eagerSource != NULL ? module->eagerSource : module->source, false, true);
+            if (fn != NULL) closure->fn = fn;
+            wrenPopRoot(vm);
+        }
+    } else if (closure != NULL) {
+        saveModuleCache(vm, name, hashModuleSource(module), closure);
+    }
+    
+    // The compiler is done with the source, drop the mapping
+    unmapModule(module);
+}
+
+WrenLoadModuleResult loadModuleFn(WrenVM* vm, const char* name)
+{
+    WrenLoadModuleResult result = {0};
+
+    // ignore builtin modules "meta" and "random"
+    if (strcmp(name, "meta") == 0 || strcmp(name, "random") == 0) {
+        return result;
+    }
+
+    fprintf(stderr, "Loading module '%s'\n", name);
+    pthread_once(&modulePathsOnce, initModulePaths);
+    
+    // Take the module from the prefetched ones, or map it now
+    MappedModule* module = NULL;
+    for (MappedModule** link = &getWreniContext(vm)->prefetchedModules; *link != NULL; link = &(*link)->next) {
+        if (strcmp((*link)->name, name) == 0) {
+            module = *link;
+            *link = module->next;
+            break;
+        }
+    }
+    if (module == NULL) {
+        module = mapModule(name, false);
+    }
+    
+    if (module != NULL) {
+        prefetchImports(vm, module->source);
+        
+        // With eager binding a module that may declare FFI classes resolves
+        // them when it ends, once their attributes exist
+        static const char eagerCall[] = "\nFFI.resolveBindings_()\n";
+        if (ffiEagerBinding && strstr(module->source, "FFI") != NULL) {
+            module->eagerSource = malloc(module->length + sizeof(eagerCall));
+            if (module->eagerSource != NULL) {
+                memcpy(module->eagerSource, module->source, module->length);
+                memcpy(module->eagerSource + module->length, eagerCall, sizeof(eagerCall));
+            }
+        }
+        
+        // Otherwise the mapping is the source, no copy is made. With a
+        // matching compiled module in the cache only an empty module is
+        // compiled.
+        if (readModuleCache(vm, module)) {
+            result.source = "";
+        } else {
+            result.source = module->eagerSource != NULL ? module->eagerSource : module->source;
+        }
+        result.onComplete = &loadModuleCompleteFn;
+        result.userData = module;
+    }
+    
+    return result;
+}
+
+// Source of the built-in "ffi" module. FFI.batch records the void calls made
+// by [fn] into the native command buffer and replays them in one pass. [fn]
+// runs in a fiber of its own so the batch ends even when it aborts, the
+// error is passed on after.
+// Buffer is a typed view on native memory, passed to ptr arguments as is.
+static const char* ffiModuleSource =
+    "class FFI {\n"
+    "    static batch(fn) {\n"
+    "        beginBatch_()\n"
+    "        var fiber = Fiber.new(fn)\n"
+    "        fiber.try()\n"
+    "        endBatch_()\n"
+    "        if (fiber.error != null) Fiber.abort(fiber.error)\n"
+    "    }\n"
+    "    foreign static beginBatch_()\n"
+    "    foreign static endBatch_()\n"
+    "    foreign static stringCacheStats\n"
+    "    foreign static memoryStats\n"
+    "    foreign static memoStats\n"
+    "    foreign static invalidate()\n"
+    "    foreign static invalidate(cls)\n"
+    "    foreign static resolveBindings_()\n"
+    "    static await(call) {\n"
+    "        if (isDone_(call)) return result_(call)\n"
+    "        if (!canYield_) return wait_(call)\n"
+    "        if (__waiting == null) __waiting = {}\n"
+    "        __waiting[call] = Fiber.current\n"
+    "        while (true) {\n"
+    "            var result = Fiber.yield()\n"
+    "            if (!__waiting.containsKey(call)) return result\n"
+    "        }\n"
+    "    }\n"
+    "    static poll() {\n"
+    "        var resumed = 0\n"
+    "        while (true) {\n"
+    "            var call = completed_()\n"
+    "            if (call == null) return resumed\n"
+    "            if (__waiting != null && __waiting.containsKey(call)) {\n"
+    "                __waiting.remove(call).call(result_(call))\n"
+    "                resumed = resumed + 1\n"
+    "            }\n"
+    "        }\n"
+    "    }\n"
+    "    foreign static completed_()\n"
+    "    foreign static isDone_(call)\n"
+    "    foreign static result_(call)\n"
+    "    foreign static wait_(call)\n"
+    "    foreign static canYield_\n"
+    "    foreign static releaseCallback(fn)\n"
+    "    foreign static destroy(instance)\n"
+    "    foreign static callbackStats\n"
+    "}\n"
+    "\n"
+    "foreign class Buffer is Sequence {\n"
+    "    construct new(type, count) {}\n"
+    "    static fromList(type, list) {\n"
+    "        var buffer = Buffer.new(type, list.count)\n"
+    "        for (i in 0...list.count) buffer[i] = list[i]\n"
+    "        return buffer\n"
+    "    }\n"
+    "    foreign type\n"
+    "    foreign count\n"
+    "    foreign byteSize\n"
+    "    foreign address\n"
+    "    foreign [index]\n"
+    "    foreign [index]=(value)\n"
+    "    foreign slice(start, count)\n"
+    "    foreign as(type)\n"
+    "    foreign fill(value)\n"
+    "    foreign axpy(a, x)\n"
+    "    foreign clamp(min, max)\n"
+    "    foreign add(other)\n"
+    "    foreign mul(other)\n"
+    "    foreign bounce(velocity, min, max)\n"
+    "    foreign sum\n"
+    "    foreign min\n"
+    "    foreign max\n"
+    "    foreign dot(other)\n"
+    "    iterate(iterator) {\n"
+    "        if (iterator == null) return count > 0 ? 0 : false\n"
+    "        return iterator + 1 < count ? iterator + 1 : false\n"
+    "    }\n"
+    "    iteratorValue(iterator) { this[iterator] }\n"
+    "}\n";
+
+static void ffiBeginBatch(WrenVM* vm) {
+    getWreniContext(vm)->batch.depth++;
+}
+
+static void ffiEndBatch(WrenVM* vm) {
+    FFIBatch* batch = &getWreniContext(vm)->batch;
+    if (batch->depth > 0 && --batch->depth == 0) {
+        flushFFIBatch(vm);
+    }
+}
+
+// Function to move the oldest returned async call to the done list, slot 0
+// gets its id or null when no call returned since the last one
+static void ffiAsyncCompleted(WrenVM* vm) {
+    FFIAsyncQueue* queue = &getWreniContext(vm)->async;
+    pthread_mutex_lock(&queue->lock);
+    FFIAsyncCall* call = queue->completed;
+    if (call != NULL) {
+        queue->completed = call->next;
+        if (queue->completed == NULL) queue->completedTail = NULL;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    
+    if (call == NULL) {
+        wrenSetSlotNull(vm, 0);
+        return;
+    }
+    call->next = queue->done;
+    queue->done = call;
+    wrenSetSlotDouble(vm, 0, call->id);
+}
+
+// Helper function to find a done call by id, unlinking it with [take]
+static FFIAsyncCall* findFFIAsyncDone(FFIAsyncQueue* queue, Value id, bool take) {
+    if (!IS_NUM(id)) return NULL;
+    for (FFIAsyncCall** link = &queue->done; *link != NULL; link = &(*link)->next) {
+        FFIAsyncCall* call = *link;
+        if (call->id == (uint32_t)AS_NUM(id)) {
+            if (take) *link = call->next;
+            return call;
+        }
+    }
+    return NULL;
+}
+
+static void ffiAsyncIsDone(WrenVM* vm) {
+    FFIAsyncQueue* queue = &getWreniContext(vm)->async;
+    wrenSetSlotBool(vm, 0, findFFIAsyncDone(queue, vm->apiStack[1], false) != NULL);
+}
+
+// Function to take the result of a done call, which is freed
+static void ffiAsyncResult(WrenVM* vm) {
+    FFIAsyncCall* call = findFFIAsyncDone(&getWreniContext(vm)->async, vm->apiStack[1], true);
+    if (call == NULL) {
+        wrenSetSlotString(vm, 0, "Not a pending async FFI call.");
+        wrenAbortFiber(vm, 0);
+        return;
+    }
+    setFFIResult(vm, call->method, call->result, &call->structResult);
+    freeFFIAsyncCall(call);
+}
+
+// Function to block until a call returns, for fibers that can't yield.
+// Other calls returning meanwhile are polled later as usual.
+static void ffiAsyncWait(WrenVM* vm) {
+    FFIAsyncQueue* queue = &getWreniContext(vm)->async;
+    if (!IS_NUM(vm->apiStack[1])) {
+        wrenSetSlotString(vm, 0, "Not a pending async FFI call.");
+        wrenAbortFiber(vm, 0);
+        return;
+    }
+    uint32_t id = (uint32_t)AS_NUM(vm->apiStack[1]);
+    
+    pthread_mutex_lock(&queue->lock);
+    for (;;) {
+        FFIAsyncCall** link = &queue->completed;
+        FFIAsyncCall* previous = NULL;
+        while (*link != NULL && (*link)->id != id) {
+            previous = *link;
+            link = &(*link)->next;
+        }
+        
+        FFIAsyncCall* call = *link;
+        if (call != NULL) {
+            *link = call->next;
+            if (queue->completedTail == call) queue->completedTail = previous;
+            pthread_mutex_unlock(&queue->lock);
+            call->next = queue->done;
+            queue->done = call;
+            ffiAsyncResult(vm);
+            return;
+        }
+        if (queue->running == 0 || id == 0 || id > queue->nextId) break;
+        pthread_cond_wait(&queue->finished, &queue->lock);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    
+    wrenSetSlotString(vm, 0, "Not a pending async FFI call.");
+    wrenAbortFiber(vm, 0);
+}
+
+// A fiber can wait for a call by yielding when something called it
+static void ffiAsyncCanYield(WrenVM* vm) {
+    wrenSetSlotBool(vm, 0, vm->fiber->caller != NULL);
+}
+
+// Function to run FFI.poll until every async call of the VM has returned
+// and resumed its fiber, once the main module is done
+static WrenInterpretResult drainFFIAsyncCalls(WrenVM* vm) {
+    FFIAsyncQueue* queue = &getWreniContext(vm)->async;
+    if (queue->nextId == 0) return WREN_RESULT_SUCCESS;
+    
+    wrenEnsureSlots(vm, 1);
+    wrenGetVariable(vm, "ffi", "FFI", 0);
+    WrenHandle* ffiClass = wrenGetSlotHandle(vm, 0);
+    WrenHandle* poll = wrenMakeCallHandle(vm, "poll()");
+    WrenInterpretResult result = WREN_RESULT_SUCCESS;
+    
+    for (;;) {
+        pthread_mutex_lock(&queue->lock);
+        while (queue->completed == NULL && queue->running > 0) {
+            pthread_cond_wait(&queue->finished, &queue->lock);
+        }
+        bool idle = queue->completed == NULL;
+        pthread_mutex_unlock(&queue->lock);
+        if (idle) break;
+        
+        wrenEnsureSlots(vm, 1);
+        wrenSetSlotHandle(vm, 0, ffiClass);
+        result = wrenCall(vm, poll);
+        if (result != WREN_RESULT_SUCCESS) break;
+    }
+    
+    wrenReleaseHandle(vm, poll);
+    wrenReleaseHandle(vm, ffiClass);
+    return result;
+}
+
+// Function to release the callback slots bound to a Fn, returns how many
+static void ffiReleaseCallback(WrenVM* vm) {
+    Value fn = vm->apiStack[1];
+    wrenSetSlotDouble(vm, 0, IS_CLOSURE(fn) ? releaseFFICallbacks(vm, fn) : 0);
+}
+
+// Function to run the destructor of an instance's payload now instead of
+// when it is collected, returns false when it had none or was destroyed
+static void ffiDestroy(WrenVM* vm) {
+    Value instance = vm->apiStack[1];
+    FFIPayloadSlot* slot = NULL;
+    if (IS_FOREIGN(instance) && findFFIClassByObject(getWreniContext(vm), AS_FOREIGN(instance)->obj.classObj) != NULL) {
+        slot = getFFIPayloadSlot(instance);
+    }
+    if (slot != NULL) {
+        *(FFIPayloadSlot**)AS_FOREIGN(instance)->data = NULL;
+        releaseFFIPayloadSlot(slot);
+    }
+    wrenSetSlotBool(vm, 0, slot != NULL);
+}
+
+// Function to report the callback pools as a Map: closures allocated and
+// bound over every type, calls, dropped calls and errors, and the mean
+// and worst latency of a call in microseconds
+static void ffiCallbackStats(WrenVM* vm) {
+    uint64_t slots = 0, bound = 0, calls = 0, dropped = 0, errors = 0, totalNs = 0, maxNs = 0;
+    pthread_mutex_lock(&ffiStructLock);
+    pthread_mutex_lock(&ffiCallbackLock);
+    for (int t = 0; t < ffiCallbackTypeCount; t++) {
+        FFICallbackType* type = ffiCallbackTypes[t];
+        for (int b = 0; b < type->blockCount; b++) {
+            for (int i = 0; i < FFI_CALLBACK_POOL_SIZE; i++) {
+                FFICallbackSlot* slot = &type->blocks[b][i];
+                slots++;
+                if (slot->vm != NULL) bound++;
+                calls += slot->calls;
+                dropped += __atomic_load_n(&slot->dropped, __ATOMIC_RELAXED);
+                errors += slot->errors;
+                totalNs += slot->totalNs;
+                if (slot->maxNs > maxNs) maxNs = slot->maxNs;
+            }
+        }
+    }
+    pthread_mutex_unlock(&ffiCallbackLock);
+    pthread_mutex_unlock(&ffiStructLock);
+    
+    const char* names[] = { "slots", "bound", "calls", "dropped", "errors", "meanMicros", "maxMicros" };
+    double values[] = { (double)slots, (double)bound, (double)calls, (double)dropped, (double)errors,
+                        calls > 0 ? totalNs / 1e3 / calls : 0, maxNs / 1e3 };
+    
+    wrenEnsureSlots(vm, 3);
+    wrenSetSlotNewMap(vm, 0);
+    for (int i = 0; i < 7; i++) {
+        wrenSetSlotString(vm, 1, names[i]);
+        wrenSetSlotDouble(vm, 2, values[i]);
+        wrenSetMapValue(vm, 0, 1, 2);
+    }
+}
+
+// Function to report the Wren heap as a Map: live and reserved bytes, blocks
+// allocated and freed and the unused share of the reserved bytes. The
+// counters stay 0 without WRENI_ALLOCATOR=pool unless WRENI_FRAME_STATS
+// counts malloc blocks, bytes are then the VM's own count of live bytes.
+static void ffiMemoryStats(WrenVM* vm) {
+    WreniHeap* heap = &getWreniContext(vm)->heap;
+    const char* names[] = { "live", "reserved", "allocations", "frees", "fragmentation" };
+    double values[] = { heap->enabled ? (double)heap->liveBytes : (double)vm->bytesAllocated,
+                        (double)heap->reservedBytes, (double)heap->allocations, (double)heap->frees,
+                        getWreniHeapFragmentation(heap) };
+    
+    wrenEnsureSlots(vm, 3);
+    wrenSetSlotNewMap(vm, 0);
+    for (int i = 0; i < 5; i++) {
+        wrenSetSlotString(vm, 1, names[i]);
+        wrenSetSlotDouble(vm, 2, values[i]);
+        wrenSetMapValue(vm, 0, 1, 2);
+    }
+}
+
+// Function to report the returned string cache as a Map of counters
+static void ffiStringCacheStats(WrenVM* vm) {
+    FFIStringCache* cache = &getWreniContext(vm)->stringCache;
+    int entries = 0;
+    for (int i = 0; i < FFI_STRING_CACHE_SIZE; i++) {
+        if (cache->entries[i].ptr != NULL) entries++;
+    }
+    
+    const char* names[] = { "hits", "misses", "evictions", "entries" };
+    double values[] = { (double)cache->hits, (double)cache->misses,
+                        (double)cache->evictions, entries };
+    
+    wrenEnsureSlots(vm, 3);
+    wrenSetSlotNewMap(vm, 0);
+    for (int i = 0; i < 4; i++) {
+        wrenSetSlotString(vm, 1, names[i]);
+        wrenSetSlotDouble(vm, 2, values[i]);
+        wrenSetMapValue(vm, 0, 1, 2);
+    }
+}
+
+// Helper function to add up the caches of the pure methods of a VM
+static void sumFFIMemoStats(WreniContext* ctx, uint64_t* hits, uint64_t* misses, uint64_t* evictions,
+                            uint64_t* invalidated, uint64_t* entries) {
+    *hits = *misses = *evictions = *invalidated = *entries = 0;
+    for (uint32_t i = 0; i < ctx->methods.capacity; i++) {
+        FFIMethodInfo* methodInfo = ctx->methods.slots[i].value;
+        if (methodInfo == NULL || methodInfo->memo == NULL) continue;
+        *hits += methodInfo->memo->hits;
+        *misses += methodInfo->memo->misses;
+        *evictions += methodInfo->memo->evictions;
+        *invalidated += methodInfo->memo->invalidated;
+        *entries += methodInfo->memo->count;
+    }
+}
+
+// Function to report the caches of pure=true methods as a Map of counters
+// over every method, with the share of calls answered from them
+static void ffiMemoStats(WrenVM* vm) {
+    uint64_t hits, misses, evictions, invalidated, entries;
+    sumFFIMemoStats(getWreniContext(vm), &hits, &misses, &evictions, &invalidated, &entries);
+    
+    const char* names[] = { "hits", "misses", "evictions", "invalidated", "entries", "hitRate" };
+    double values[] = { (double)hits, (double)misses, (double)evictions, (double)invalidated,
+                        (double)entries, hits + misses > 0 ? (double)hits / (hits + misses) : 0 };
+    
+    wrenEnsureSlots(vm, 3);
+    wrenSetSlotNewMap(vm, 0);
+    for (int i = 0; i < 6; i++) {
+        wrenSetSlotString(vm, 1, names[i]);
+        wrenSetSlotDouble(vm, 2, values[i]);
+        wrenSetMapValue(vm, 0, 1, 2);
+    }
+}
+
+// Function to empty the caches of the pure methods of one class, or of
+// every class without an argument, returns the number of results dropped
+static void ffiInvalidate(WrenVM* vm) {
+    ObjClass* classObj = NULL;
+    if (wrenGetSlotCount(vm) > 1) {
+        if (!IS_CLASS(vm->apiStack[1])) {
+            wrenSetSlotString(vm, 0, "Expected a class");
+            wrenAbortFiber(vm, 0);
+            return;
+        }
+        classObj = AS_CLASS(vm->apiStack[1]);
+    }
+    
+    WreniContext* ctx = getWreniContext(vm);
+    int dropped = 0;
+    for (uint32_t i = 0; i < ctx->methods.capacity; i++) {
+        FFIMethodInfo* methodInfo = ctx->methods.slots[i].value;
+        if (methodInfo == NULL || methodInfo->memo == NULL) continue;
+        if (classObj != NULL && methodInfo->classObj != classObj) continue;
+        dropped += clearFFIMemo(vm, methodInfo->memo);
+    }
+    wrenSetSlotDouble(vm, 0, dropped);
+}
+
+// Helper function to read the element type of a Buffer from a slot
+static bool getFFIBufferType(WrenVM* vm, int slot, FFITypeTag* tag) {
+    if (wrenGetSlotType(vm, slot) == WREN_TYPE_STRING) {
+        const char* name = wrenGetSlotString(vm, slot);
+        if (parseFFIType(name, strlen(name), tag) &&
+            *tag != FT_VOID && *tag != FT_BOOL && *tag != FT_STRING && *tag != FT_PTR) {
+            return true;
+        }
+    }
+    wrenSetSlotString(vm, 0, "Buffer type must be one of i8, u8, i16, u16, i32, u32, i64, f32, f64.");
+    wrenAbortFiber(vm, 0);
+    return false;
+}
+
+// Helper function to read an element index of a Buffer, negative indexes
+// count from the end like List does
+static bool getFFIBufferIndex(WrenVM* vm, FFIBuffer* buffer, int slot, uint32_t* index) {
+    Value value = vm->apiStack[slot];
+    if (!IS_NUM(value) || (double)(int64_t)AS_NUM(value) != AS_NUM(value)) {
+        wrenSetSlotString(vm, 0, "Index must be an integer.");
+        wrenAbortFiber(vm, 0);
+        return false;
+    }
+    
+    int64_t i = (int64_t)AS_NUM(value);
+    if (i < 0) i += buffer->count;
+    if (i < 0 || i >= buffer->count) {
+        wrenSetSlotString(vm, 0, "Index out of bounds.");
+        wrenAbortFiber(vm, 0);
+        return false;
+    }
+    *index = (uint32_t)i;
+    return true;
+}
+
+// Function to allocate a zero filled Buffer: Buffer.new(type, count)
+static void allocateFFIBuffer(WrenVM* vm) {
+    FFITypeTag type;
+    if (!getFFIBufferType(vm, 1, &type)) return;
+    
+    Value countValue = vm->apiStack[2];
+    if (!IS_NUM(countValue) || AS_NUM(countValue) < 0 || AS_NUM(countValue) > UINT32_MAX ||
+        (double)(int64_t)AS_NUM(countValue) != AS_NUM(countValue)) {
+        wrenSetSlotString(vm, 0, "Buffer count must be a non-negative integer.");
+        wrenAbortFiber(vm, 0);
+        return;
+    }
+    
+    uint32_t count = (uint32_t)AS_NUM(countValue);
+    uint32_t elementSize = (uint32_t)ffiTypeForTag(type)->size;
+    
+    // Aligned for the widest vector loads over the buffer
+    FFIBufferBlock* block = malloc(sizeof(FFIBufferBlock));
+    void* bytes = NULL;
+    size_t size = (size_t)count * elementSize;
+    if (block == NULL || posix_memalign(&bytes, 32, size > 0 ? size : 32) != 0) {
+        free(block);
+        wrenSetSlotString(vm, 0, "Out of memory allocating Buffer.");
+        wrenAbortFiber(vm, 0);
+        return;
+    }
+    memset(bytes, 0, size);
+    block->refCount = 1;
+    block->size = size;
+    block->bytes = bytes;
+    
+    getWreniContext(vm)->bufferClass = AS_CLASS(vm->apiStack[0]);
+    FFIBuffer* buffer = wrenSetSlotNewForeign(vm, 0, 0, sizeof(FFIBuffer));
+    buffer->block = block;
+    buffer->data = block->bytes;
+    buffer->count = count;
+    buffer->elementSize = elementSize;
+    buffer->type = type;
+}
+
+static void finalizeFFIBuffer(void* data) {
+    releaseFFIBufferBlock(((FFIBuffer*)data)->block);
+}
+
+// Helper function to return a new view on the memory of [source]
+static void newFFIBufferView(WrenVM* vm, FFIBuffer* source, uint8_t* data, uint32_t count, FFITypeTag type) {
+    ObjForeign* foreign = wrenNewForeign(vm, getWreniContext(vm)->bufferClass, sizeof(FFIBuffer));
+    FFIBuffer* view = (FFIBuffer*)foreign->data;
+    view->block = source->block;
+    view->data = data;
+    view->count = count;
+    view->elementSize = (uint32_t)ffiTypeForTag(type)->size;
+    view->type = type;
+    retainFFIBufferBlock(source->block);
+    vm->apiStack[0] = OBJ_VAL(foreign);
+}
+
+static void ffiBufferType(WrenVM* vm) {
+    FFIBuffer* buffer = wrenGetSlotForeign(vm, 0);
+    for (size_t i = 0; i < sizeof(ffiTypeNames) / sizeof(ffiTypeNames[0]); i++) {
+        if (ffiTypeNames[i].tag == buffer->type) {
+            wrenSetSlotString(vm, 0, ffiTypeNames[i].name);
+            return;
+        }
+    }
+}
+
+static void ffiBufferCount(WrenVM* vm) {
+    FFIBuffer* buffer = wrenGetSlotForeign(vm, 0);
+    wrenSetSlotDouble(vm, 0, buffer->count);
+}
+
+static void ffiBufferByteSize(WrenVM* vm) {
+    FFIBuffer* buffer = wrenGetSlotForeign(vm, 0);
+    wrenSetSlotDouble(vm, 0, (double)buffer->count * buffer->elementSize);
+}
+
+static void ffiBufferAddress(WrenVM* vm) {
+    FFIBuffer* buffer = wrenGetSlotForeign(vm, 0);
+    wrenSetSlotDouble(vm, 0, (double)(uintptr_t)buffer->data);
+}
+
+static void ffiBufferSubscript(WrenVM* vm) {
+    FFIBuffer* buffer = wrenGetSlotForeign(vm, 0);
+    uint32_t index;
+    if (!getFFIBufferIndex(vm, buffer, 1, &index)) return;
+    wrenSetSlotDouble(vm, 0, readFFIScalar(buffer->type, buffer->data + (size_t)index * buffer->elementSize));
+}
+
+static void ffiBufferSubscriptSetter(WrenVM* vm) {
+    FFIBuffer* buffer = wrenGetSlotForeign(vm, 0);
+    uint32_t index;
+    if (!getFFIBufferIndex(vm, buffer, 1, &index)) return;
+    if (!IS_NUM(vm->apiStack[2])) {
+        wrenSetSlotString(vm, 0, "Buffer element must be a Num.");
+        wrenAbortFiber(vm, 0);
+        return;
+    }
+    writeFFIScalar(buffer->type, buffer->data + (size_t)index * buffer->elementSize, AS_NUM(vm->apiStack[2]));
+    vm->apiStack[0] = vm->apiStack[2];
+}
+
+// Function to make a view of [count] elements from [start], sharing memory
+static void ffiBufferSlice(WrenVM* vm) {
+    FFIBuffer* buffer = wrenGetSlotForeign(vm, 0);
+    Value start = vm->apiStack[1];
+    Value count = vm->apiStack[2];
+    if (!IS_NUM(start) || !IS_NUM(count) || AS_NUM(start) < 0 || AS_NUM(count) < 0 ||
+        (double)(int64_t)AS_NUM(start) != AS_NUM(start) ||
+        (double)(int64_t)AS_NUM(count) != AS_NUM(count) ||
+        AS_NUM(start) + AS_NUM(count) > buffer->count) {
+        wrenSetSlotString(vm, 0, "Slice out of bounds.");
+        wrenAbortFiber(vm, 0);
+        return;
+    }
+    
+    uint8_t* data = buffer->data + (size_t)AS_NUM(start) * buffer->elementSize;
+    newFFIBufferView(vm, buffer, data, (uint32_t)AS_NUM(count), buffer->type);
+}
+
+// Function to view the same bytes as elements of another type
+static void ffiBufferAs(WrenVM* vm) {
+    FFIBuffer* buffer = wrenGetSlotForeign(vm, 0);
+    FFITypeTag type;
+    if (!getFFIBufferType(vm, 1, &type)) return;
+    
+    size_t byteSize = (size_t)buffer->count * buffer->elementSize;
+    newFFIBufferView(vm, buffer, buffer->data, (uint32_t)(byteSize / ffiTypeForTag(type)->size), type);
+}
+
+// Bulk operations over a whole f32 Buffer in one call, see ffi_kernels.h
+typedef struct {
+    const char* name;
+    void (*fill)(float* y, size_t n, float value);
+    void (*axpy)(float* y, const float* x, size_t n, float a);
+    void (*clamp)(float* y, size_t n, float lo, float hi);
+    void (*add)(float* y, const float* x, size_t n);
+    void (*mul)(float* y, const float* x, size_t n);
+    void (*addScalar)(float* y, size_t n, float value);
+    void (*mulScalar)(float* y, size_t n, float value);
+    void (*bounce)(float* pos, float* vel, size_t n, float lo, float hi);
+    double (*sum)(const float* x, size_t n);
+    double (*dot)(const float* x, const float* y, size_t n);
+    float (*min)(const float* x, size_t n);
+    float (*max)(const float* x, size_t n);
+} FFIKernels;
+
+#define KERNEL_SUFFIX Scalar
+#define KERNEL_NAME "scalar"
+#define KERNEL_TARGET
+#define KERNEL_LANES 1
+#include "ffi_kernels.h"
+#undef KERNEL_SUFFIX
+#undef KERNEL_NAME
+#undef KERNEL_TARGET
+#undef KERNEL_LANES
+
+#if defined(__x86_64__) || defined(__i386__)
+#define KERNEL_SUFFIX Sse
+#define KERNEL_NAME "sse"
+#define KERNEL_TARGET __attribute__((target("sse2")))
+#define KERNEL_LANES 4
+#include "ffi_kernels.h"
+#undef KERNEL_SUFFIX
+#undef KERNEL_NAME
+#undef KERNEL_TARGET
+#undef KERNEL_LANES
+
+#define KERNEL_SUFFIX Avx2
+#define KERNEL_NAME "avx2"
+#define KERNEL_TARGET __attribute__((target("avx2")))
+#define KERNEL_LANES 8
+#include "ffi_kernels.h"
+#undef KERNEL_SUFFIX
+#undef KERNEL_NAME
+#undef KERNEL_TARGET
+#undef KERNEL_LANES
+#endif
+
+// Function to pick the widest kernels the CPU runs, once. WRENI_KERNELS set
+// to scalar, sse or avx2 forces a narrower set, e.g. for benchmarks.
+static const FFIKernels* selectedFFIKernels = NULL;
+static pthread_once_t ffiKernelsOnce = PTHREAD_ONCE_INIT;
+
+static void selectFFIKernels(void) {
+    const char* forced = getenv("WRENI_KERNELS");
+    const FFIKernels* selected = &ffiKernelsScalar;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    bool scalarOnly = forced != NULL && strcmp(forced, "scalar") == 0;
+    bool sseOnly = forced != NULL && strcmp(forced, "sse") == 0;
+    if (!scalarOnly && !sseOnly && __builtin_cpu_supports("avx2")) {
+        selected = &ffiKernelsAvx2;
+    } else if (!scalarOnly && __builtin_cpu_supports("sse2")) {
+        selected = &ffiKernelsSse;
+    }
+#endif
+    fprintf(stderr, "Using %s bulk kernels\n", selected->name);
+    selectedFFIKernels = selected;
+}
+
+static const FFIKernels* getFFIKernels(void) {
+    pthread_once(&ffiKernelsOnce, selectFFIKernels);
+    return selectedFFIKernels;
+}
+
+// Helper function to get the receiver of a bulk operation, which must be
+// an f32 Buffer
+static FFIBuffer* getFFIBulkBuffer(WrenVM* vm) {
+    FFIBuffer* buffer = wrenGetSlotForeign(vm, 0);
+    if (buffer->type != FT_F32) {
+        wrenSetSlotString(vm, 0, "Bulk operations need an f32 Buffer.");
+        wrenAbortFiber(vm, 0);
+        return NULL;
+    }
+    return buffer;
+}
+
+// Helper function to get an f32 Buffer operand with as many elements as [buffer]
+static FFIBuffer* getFFIBulkOperand(WrenVM* vm, FFIBuffer* buffer, int slot) {
+    FFIBuffer* operand = getFFIBuffer(vm, vm->apiStack[slot]);
+    if (operand == NULL || operand->type != FT_F32 || operand->count != buffer->count) {
+        wrenSetSlotString(vm, 0, "Operand must be an f32 Buffer of the same count.");
+        wrenAbortFiber(vm, 0);
+        return NULL;
+    }
+    return operand;
+}
+
+// Helper function to read a Num operand of a bulk operation
+static bool getFFIBulkNum(WrenVM* vm, int slot, float* value) {
+    if (!IS_NUM(vm->apiStack[slot])) {
+        wrenSetSlotString(vm, 0, "Operand must be a Num.");
+        wrenAbortFiber(vm, 0);
+        return false;
+    }
+    *value = (float)AS_NUM(vm->apiStack[slot]);
+    return true;
+}
+
+static void ffiBufferFill(WrenVM* vm) {
+    FFIBuffer* buffer = getFFIBulkBuffer(vm);
+    float value;
+    if (buffer == NULL || !getFFIBulkNum(vm, 1, &value)) return;
+    getFFIKernels()->fill((float*)buffer->data, buffer->count, value);
+}
+
+// this = a * x + this
+static void ffiBufferAxpy(WrenVM* vm) {
+    FFIBuffer* buffer = getFFIBulkBuffer(vm);
+    float a;
+    if (buffer == NULL || !getFFIBulkNum(vm, 1, &a)) return;
+    FFIBuffer* x = getFFIBulkOperand(vm, buffer, 2);
+    if (x == NULL) return;
+    getFFIKernels()->axpy((float*)buffer->data, (const float*)x->data, buffer->count, a);
+}
+
+static void ffiBufferClamp(WrenVM* vm) {
+    FFIBuffer* buffer = getFFIBulkBuffer(vm);
+    float lo, hi;
+    if (buffer == NULL || !getFFIBulkNum(vm, 1, &lo) || !getFFIBulkNum(vm, 2, &hi)) return;
+    getFFIKernels()->clamp((float*)buffer->data, buffer->count, lo, hi);
+}
+
+// Component-wise with another Buffer, or with the same Num for every element
+static void ffiBufferAdd(WrenVM* vm) {
+    FFIBuffer* buffer = getFFIBulkBuffer(vm);
+    if (buffer == NULL) return;
+    if (IS_NUM(vm->apiStack[1])) {
+        getFFIKernels()->addScalar((float*)buffer->data, buffer->count, (float)AS_NUM(vm->apiStack[1]));
+        return;
+    }
+    FFIBuffer* x = getFFIBulkOperand(vm, buffer, 1);
+    if (x == NULL) return;
+    getFFIKernels()->add((float*)buffer->data, (const float*)x->data, buffer->count);
+}
+
+static void ffiBufferMul(WrenVM* vm) {
+    FFIBuffer* buffer = getFFIBulkBuffer(vm);
+    if (buffer == NULL) return;
+    if (IS_NUM(vm->apiStack[1])) {
+        getFFIKernels()->mulScalar((float*)buffer->data, buffer->count, (float)AS_NUM(vm->apiStack[1]));
+        return;
+    }
+    FFIBuffer* x = getFFIBulkOperand(vm, buffer, 1);
+    if (x == NULL) return;
+    getFFIKernels()->mul((float*)buffer->data, (const float*)x->data, buffer->count);
+}
 
-cleanup:
-    // No cleanup needed since attributes are cached in FFIMethodInfo
+// Reflects positions in this buffer off [min, max], turning [velocity]
+static void ffiBufferBounce(WrenVM* vm) {
+    FFIBuffer* buffer = getFFIBulkBuffer(vm);
+    if (buffer == NULL) return;
+    FFIBuffer* velocity = getFFIBulkOperand(vm, buffer, 1);
+    float lo, hi;
+    if (velocity == NULL || !getFFIBulkNum(vm, 2, &lo) || !getFFIBulkNum(vm, 3, &hi)) return;
+    getFFIKernels()->bounce((float*)buffer->data, (float*)velocity->data, buffer->count, lo, hi);
 }
 
-// Function to print all stored FFI classes
-void printFFIClasses() {
-    fprintf(stderr, "=== Stored FFI Classes (%d) ===\n", ffiClassCount);
-    for (int i = 0; i < ffiClassCount; i++) {
-        fprintf(stderr, "%d: %s.%s (classObj: %p)\n", 
-                i, ffiClasses[i].moduleName, ffiClasses[i].className, 
-                (void*)ffiClasses[i].classObj);
-    }
-    fprintf(stderr, "=== End FFI Classes ===\n");
+static void ffiBufferSum(WrenVM* vm) {
+    FFIBuffer* buffer = getFFIBulkBuffer(vm);
+    if (buffer == NULL) return;
+    wrenSetSlotDouble(vm, 0, getFFIKernels()->sum((const float*)buffer->data, buffer->count));
 }
 
-void writeFn(WrenVM* vm, const char* text)
-{
-    printf("%s", text);
-    fflush(stdout);
+static void ffiBufferDot(WrenVM* vm) {
+    FFIBuffer* buffer = getFFIBulkBuffer(vm);
+    if (buffer == NULL) return;
+    FFIBuffer* x = getFFIBulkOperand(vm, buffer, 1);
+    if (x == NULL) return;
+    wrenSetSlotDouble(vm, 0, getFFIKernels()->dot((const float*)buffer->data, (const float*)x->data, buffer->count));
 }
 
-void errorFn(WrenVM* vm, WrenErrorType type, const char* module, int line,
-    const char* message)
-{
-    fprintf(stderr, "%s.wren:%d: %s\n", module, line, message);
+// min and max of an empty Buffer are null
+static void ffiBufferMin(WrenVM* vm) {
+    FFIBuffer* buffer = getFFIBulkBuffer(vm);
+    if (buffer == NULL) return;
+    if (buffer->count == 0) {
+        wrenSetSlotNull(vm, 0);
+        return;
+    }
+    wrenSetSlotDouble(vm, 0, getFFIKernels()->min((const float*)buffer->data, buffer->count));
 }
 
-uint32_t readFile(char *buffer, uint32_t buf_size, const char* path)
-{
-    FILE* file = fopen(path, "rb");
-    if (file == NULL) {
-        fprintf(stderr, "Could not open file \"%s\".\n", path);
-        return 0;
+static void ffiBufferMax(WrenVM* vm) {
+    FFIBuffer* buffer = getFFIBulkBuffer(vm);
+    if (buffer == NULL) return;
+    if (buffer->count == 0) {
+        wrenSetSlotNull(vm, 0);
+        return;
     }
+    wrenSetSlotDouble(vm, 0, getFFIKernels()->max((const float*)buffer->data, buffer->count));
+}
 
-    // TODO: use fseek to get the file size and check if exceed the buffer size
-    fseek(file, 0, SEEK_END);
-    uint32_t fileSize = ftell(file);
-    fseek(file, 0, SEEK_SET);
-    
-    if (fileSize < 0) {
-        fprintf(stderr, "Could not determine file size for \"%s\".\n", path);
-        fclose(file);
-        return 0;
+// Foreign methods of the built-in "ffi" module
+static const struct {
+    const char* className;
+    bool isStatic;
+    const char* signature;
+    WrenForeignMethodFn fn;
+} ffiModuleMethods[] = {
+    { "FFI",    true,  "beginBatch_()",  &ffiBeginBatch },
+    { "FFI",    true,  "endBatch_()",    &ffiEndBatch },
+    { "FFI",    true,  "stringCacheStats", &ffiStringCacheStats },
+    { "FFI",    true,  "memoryStats",    &ffiMemoryStats },
+    { "FFI",    true,  "memoStats",      &ffiMemoStats },
+    { "FFI",    true,  "invalidate()",   &ffiInvalidate },
+    { "FFI",    true,  "invalidate(_)",  &ffiInvalidate },
+    { "FFI",    true,  "resolveBindings_()", &resolveFFIBindings },
+    { "FFI",    true,  "completed_()",   &ffiAsyncCompleted },
+    { "FFI",    true,  "isDone_(_)",     &ffiAsyncIsDone },
+    { "FFI",    true,  "result_(_)",     &ffiAsyncResult },
+    { "FFI",    true,  "wait_(_)",       &ffiAsyncWait },
+    { "FFI",    true,  "canYield_",      &ffiAsyncCanYield },
+    { "FFI",    true,  "releaseCallback(_)", &ffiReleaseCallback },
+    { "FFI",    true,  "destroy(_)",     &ffiDestroy },
+    { "FFI",    true,  "callbackStats",  &ffiCallbackStats },
+    { "Buffer", false, "type",           &ffiBufferType },
+    { "Buffer", false, "count",          &ffiBufferCount },
+    { "Buffer", false, "byteSize",       &ffiBufferByteSize },
+    { "Buffer", false, "address",        &ffiBufferAddress },
+    { "Buffer", false, "[_]",            &ffiBufferSubscript },
+    { "Buffer", false, "[_]=(_)",        &ffiBufferSubscriptSetter },
+    { "Buffer", false, "slice(_,_)",     &ffiBufferSlice },
+    { "Buffer", false, "as(_)",          &ffiBufferAs },
+    { "Buffer", false, "fill(_)",        &ffiBufferFill },
+    { "Buffer", false, "axpy(_,_)",      &ffiBufferAxpy },
+    { "Buffer", false, "clamp(_,_)",     &ffiBufferClamp },
+    { "Buffer", false, "add(_)",         &ffiBufferAdd },
+    { "Buffer", false, "mul(_)",         &ffiBufferMul },
+    { "Buffer", false, "bounce(_,_,_)",  &ffiBufferBounce },
+    { "Buffer", false, "sum",            &ffiBufferSum },
+    { "Buffer", false, "min",            &ffiBufferMin },
+    { "Buffer", false, "max",            &ffiBufferMax },
+    { "Buffer", false, "dot(_)",         &ffiBufferDot },
+};
+
+// Function to bind the foreign methods of the built-in "ffi" module
+static WrenForeignMethodFn bindFFIModuleMethod(const char* className, bool isStatic,
+                                               const char* signature) {
+    for (size_t i = 0; i < sizeof(ffiModuleMethods) / sizeof(ffiModuleMethods[0]); i++) {
+        if (ffiModuleMethods[i].isStatic == isStatic &&
+            strcmp(ffiModuleMethods[i].signature, signature) == 0 &&
+            strcmp(ffiModuleMethods[i].className, className) == 0) {
+            return ffiModuleMethods[i].fn;
+        }
     }
+    return NULL;
+}
+
+// Function to read the #!payload and #!destructor of a class on its first
+// allocation, once its attributes exist, and bind the destructor
+static void prepareFFIPayload(WrenVM* vm, FFIClassInfo* ffiClass) {
+    FFIPayloadPool* pool = &ffiClass->payload;
+    pool->prepared = true;
+    if (!indexFFIAttributes(ffiClass) || ffiClass->payloadStruct == NULL) return;
     
-    if (fileSize >= buf_size) {
-        fprintf(stderr, "File \"%s\" is too large for buffer.\n", path);
-        fclose(file);
-        return 0;
+    registerAllFFIStructs(getWreniContext(vm));
+    FFITypeTag tag;
+    FFIStructType* type = NULL;
+    if (!parseSharedFFITypeName(ffiClass->payloadStruct, strlen(ffiClass->payloadStruct), &tag, &type, NULL) ||
+        type == NULL) {
+        fprintf(stderr, "Unknown payload struct %s of %s\n", ffiClass->payloadStruct, ffiClass->className);
+        return;
     }
-
-    uint32_t bytesRead = (uint32_t) fread(buffer, sizeof(char), buf_size - 1, file);
+    pool->type = type;
+    pool->stride = (offsetof(FFIPayloadSlot, bytes) + type->type.size + 15) & ~(size_t)15;
+    pool->byValue = ffiClass->payloadByValue;
     
-    if (bytesRead == 0 && ferror(file)) {
-        fprintf(stderr, "Could not read file \"%s\".\n", path);
-        fclose(file);
-        return 0;
+    // With an init=true method, a payload it never filled, for example when
+    // the constructor aborted, is not destroyed
+    for (int i = 0; i < ffiClass->externCount; i++) {
+        if (!ffiClass->externs[i].isStatic && ffiClass->externs[i].init) pool->initRequired = true;
     }
     
-    buffer[bytesRead] = '\0';
-    fclose(file);
-    return bytesRead;
-}
-
-void loadModuleCompleteFn(WrenVM* vm, const char* name, struct WrenLoadModuleResult result)
-{
-    fprintf(stderr, "Finish loading module '%s'\n", name);
-}
-
-WrenLoadModuleResult loadModuleFn(WrenVM* vm, const char* name)
-{
-    WrenLoadModuleResult result = {0};
-
-    // ignore builtin modules "meta" and "random"
-    if (strcmp(name, "meta") == 0 || strcmp(name, "random") == 0) {
-        return result;
+    if (ffiClass->destructorFn == NULL) return;
+    const char* dll = ffiClass->destructorDll != NULL ? ffiClass->destructorDll : ffiClass->classExtern.dll;
+    FFILibrary* library = getFFIClassLibrary(vm, ffiClass, dll);
+    void* fn = library != NULL ? dlsym(library->handle, ffiClass->destructorFn) : NULL;
+    pool->destructorArgTypes[0] = pool->byValue ? &type->type : &ffi_type_pointer;
+    if (fn == NULL ||
+        ffi_prep_cif(&pool->destructorCif, FFI_DEFAULT_ABI, 1, &ffi_type_void, pool->destructorArgTypes) != FFI_OK) {
+        fprintf(stderr, "Failed to bind destructor %s of %s\n", ffiClass->destructorFn, ffiClass->className);
+        return;
     }
+    pool->destructor = fn;
+}
 
-    fprintf(stderr, "Loading module '%s'\n", name);
-    
-    // Create a buffer to hold the module source code
-    char buffer[65536] = {0};
-    char fileName[256] = {0};
-
-    snprintf(fileName, 255, "%s.wren", name);
-    
-    // Try to read the module file
-    uint32_t readLength = readFile(buffer, sizeof(buffer), fileName);
-    if (readLength > 0) {
-        // Allocate memory for the source code that will persist
-        // We need to duplicate the buffer since readFile uses a local buffer
-        char* source = malloc(readLength + 1);
-        if (source != NULL) {
-            strcpy(source, buffer);
-            result.source = source;
-            result.onComplete = &loadModuleCompleteFn;
-            result.userData = NULL;
-        } else {
-            // Memory allocation failed
-            result.source = NULL;
-            result.onComplete = NULL;
-            result.userData = NULL;
+// Helper function to take a zeroed payload slot, a new slab is carved up
+// when the free list is empty. NULL when out of memory.
+static FFIPayloadSlot* takeFFIPayloadSlot(FFIPayloadPool* pool) {
+    if (pool->free == NULL) {
+        uint8_t** slabs = realloc(pool->slabs, (pool->slabCount + 1) * sizeof(uint8_t*));
+        if (slabs == NULL) return NULL;
+        pool->slabs = slabs;
+        uint8_t* slab = malloc(pool->stride * FFI_PAYLOAD_SLAB_SLOTS);
+        if (slab == NULL) return NULL;
+        pool->slabs[pool->slabCount++] = slab;
+        
+        // Slots are handed out in address order
+        for (int i = FFI_PAYLOAD_SLAB_SLOTS - 1; i >= 0; i--) {
+            FFIPayloadSlot* slot = (FFIPayloadSlot*)(slab + i * pool->stride);
+            slot->pool = pool;
+            slot->next = pool->free;
+            pool->free = slot;
         }
-    } else {
-        // Module not found or couldn't be read
-        result.source = NULL;
-        result.onComplete = NULL;
-        result.userData = NULL;
     }
     
-    return result;
+    FFIPayloadSlot* slot = pool->free;
+    pool->free = slot->next;
+    slot->next = NULL;
+    memset(slot->bytes, 0, pool->type->type.size);
+    slot->initialized = !pool->initRequired;
+    return slot;
 }
 
+// Function to allocate an instance of an FFI class. Its foreign data is the
+// address of its payload slot, NULL when the class has no #!payload.
 void allocateForeignClass(WrenVM* vm)
 {
-    fprintf(stderr, "Allocating foreign class\n");
-}
-
-// Finalizer function for FFI classes to unload DLL handles
-static void finalizeFFIClass(void* data) {
-    // Find the FFIClassInfo for this class
-    FFIClassInfo* ffiClass = findFFIClassByObject((ObjClass*)data);
+    FFIClassInfo* ffiClass = findFFIClassByObject(getWreniContext(vm), AS_CLASS(vm->apiStack[0]));
+    FFIPayloadSlot* slot = NULL;
     if (ffiClass != NULL) {
-        fprintf(stderr, "Finalizing FFI class %s - unloading DLL handles\n", ffiClass->className);
-        unloadAllDllHandles(ffiClass);
+        if (!ffiClass->payload.prepared) prepareFFIPayload(vm, ffiClass);
+        if (ffiClass->payload.type != NULL) {
+            slot = takeFFIPayloadSlot(&ffiClass->payload);
+            if (slot == NULL) {
+                wrenSetSlotString(vm, 0, "Out of memory allocating payload.");
+                wrenAbortFiber(vm, 0);
+                return;
+            }
+        }
     }
+    
+    FFIPayloadSlot** data = wrenSetSlotNewForeign(vm, 0, 0, sizeof(FFIPayloadSlot*));
+    *data = slot;
+}
+
+static void finalizeFFIInstance(void* data) {
+    FFIPayloadSlot* slot = *(FFIPayloadSlot**)data;
+    if (slot != NULL) releaseFFIPayloadSlot(slot);
 }
 
 WrenForeignClassMethods bindForeignClassFn(WrenVM* vm, const char* module,
@@ -772,6 +5402,10 @@ WrenForeignClassMethods bindForeignClassFn(WrenVM* vm, const char* module,
         return (WrenForeignClassMethods){0};
     }
     
+    if (strcmp(module, "ffi") == 0 && strcmp(className, "Buffer") == 0) {
+        return (WrenForeignClassMethods){ &allocateFFIBuffer, &finalizeFFIBuffer };
+    }
+    
     WrenForeignClassMethods result = {0};
     result.allocate = NULL;
     result.finalize = NULL;
@@ -798,15 +5432,15 @@ WrenForeignClassMethods bindForeignClassFn(WrenVM* vm, const char* module,
     // Only provide allocate function if class extends from FFI
     if (extendsFFI && classObj != NULL) {
         result.allocate = &allocateForeignClass;
-        result.finalize = &finalizeFFIClass;
+        result.finalize = &finalizeFFIInstance;
         // fprintf(stderr, "Class %s extends FFI - providing allocate function\n", className);
         
         // Store the FFI class information for later use
-        fprintf(stderr, "bindForeignClassFn: storing module='%s', class='%s'\n", module, className);
+        if (wreniDebug) fprintf(stderr, "bindForeignClassFn: storing module='%s', class='%s'\n", module, className);
         storeFFIClass(vm, className, module, classObj);
         
         // Print all stored FFI classes for debugging
-        printFFIClasses();
+        if (wreniDebug) printFFIClasses(getWreniContext(vm));
     } else {
         // fprintf(stderr, "Class %s does not extend FFI - no allocate function\n", className);
     }
@@ -821,6 +5455,98 @@ void loadLibraryFn(WrenVM* vm)
     fprintf(stderr, "Loading library\n");
 }
 
+// Structure of one ahead-of-time compiled binding, see emitAOTBindings
+typedef struct {
+    const char* module;
+    const char* className;
+    bool isStatic;
+    const char* signature;
+    WrenForeignMethodFn fn;
+} AOTBinding;
+
+// Function used by AOT bindings to resolve their C function on the first
+// call into [symbol], a static shared by every VM. VMs running on other
+// threads may race here, only the one storing the pointer keeps a library
+// reference.
+static void* resolveAOTSymbol(WrenVM* vm, void** symbol, const char* module, const char* className,
+                              const char* dllName, const char* fnName) {
+    FFIClassInfo* ffiClass = findFFIClass(getWreniContext(vm), module, className);
+    void* handle = ffiClass != NULL ? getOrLoadDllHandle(vm, ffiClass, dllName) : NULL;
+    void* fn = handle != NULL ? dlsym(handle, fnName) : NULL;
+    if (fn == NULL) {
+        fprintf(stderr, "Failed to resolve %s in %s for %s.%s\n", fnName, dllName, module, className);
+        wrenSetSlotString(vm, 0, handle == NULL ? "Failed to load dynamic library" : "Function not found in library");
+        wrenAbortFiber(vm, 0);
+        return NULL;
+    }
+    
+    // Bindings keep the pointer in a static shared by every VM, so the
+    // library must outlive the class that loaded it
+    void* stored = NULL;
+    if (!__atomic_compare_exchange_n(symbol, &stored, fn, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return stored;
+    }
+    acquireFFILibrary(dllName);
+    return fn;
+}
+
+// Helper function for AOT bindings to report a badly typed argument
+static void abortAOTArgument(WrenVM* vm, const char* message) {
+    wrenSetSlotString(vm, 0, message);
+    wrenAbortFiber(vm, 0);
+}
+
+// Helpers for AOT bindings checking and reading bool and ptr arguments like
+// the dynamic path
+static inline bool getAOTSlotBool(WrenVM* vm, int slot) {
+    WrenType type = wrenGetSlotType(vm, slot);
+    return !(type == WREN_TYPE_NULL || (type == WREN_TYPE_BOOL && !wrenGetSlotBool(vm, slot)));
+}
+
+// Function to take a void AOT binding called inside FFI.batch to the
+// dynamic path, which records the call
+static void recordAOTCall(WrenVM* vm, int index) {
+    WreniContext* ctx = getWreniContext(vm);
+    if (ctx->aotMethods == NULL || ctx->aotMethods[index] == NULL) {
+        wrenSetSlotString(vm, 0, "AOT binding has no method to record");
+        wrenAbortFiber(vm, 0);
+        return;
+    }
+    executeFFIMethod(vm, ctx->aotMethods[index]);
+}
+
+// Helper function to check a ptr argument: null, a Num or a Buffer
+static inline bool isAOTSlotPtr(WrenVM* vm, int slot) {
+    WrenType type = wrenGetSlotType(vm, slot);
+    return type == WREN_TYPE_NULL || type == WREN_TYPE_NUM || getFFIBuffer(vm, vm->apiStack[slot]) != NULL;
+}
+
+static inline void* getAOTSlotPtr(WrenVM* vm, int slot) {
+    FFIBuffer* buffer = getFFIBuffer(vm, vm->apiStack[slot]);
+    if (buffer != NULL) return buffer->data;
+    return wrenGetSlotType(vm, slot) == WREN_TYPE_NUM ? (void*)(intptr_t)wrenGetSlotDouble(vm, slot) : NULL;
+}
+
+#ifdef WRENI_AOT_BINDINGS
+// Bindings generated by `wreni --aot`, see the aot target of the Makefile
+#include WRENI_AOT_BINDINGS
+
+// Function to find the index of an AOT binding, -1 if the method is bound
+// dynamically
+static int findAOTBinding(const char* module, const char* className,
+                          bool isStatic, const char* signature) {
+    for (const AOTBinding* binding = aotBindings; binding->fn != NULL; binding++) {
+        if (binding->isStatic == isStatic &&
+            strcmp(binding->signature, signature) == 0 &&
+            strcmp(binding->className, className) == 0 &&
+            strcmp(binding->module, module) == 0) {
+            return (int)(binding - aotBindings);
+        }
+    }
+    return -1;
+}
+#endif
+
 
 WrenForeignMethodFn bindForeignMethodFn(WrenVM* vm, const char* module,
     const char* className, bool isStatic, const char* signature)
@@ -828,17 +5554,21 @@ WrenForeignMethodFn bindForeignMethodFn(WrenVM* vm, const char* module,
     if (strcmp(module, "meta") == 0 || strcmp(module, "random") == 0) {
         return NULL;
     }
+    
+    if (strcmp(module, "ffi") == 0) {
+        return bindFFIModuleMethod(className, isStatic, signature);
+    }
 
     // fprintf(stderr, "Binding foreign method %s.%s.%s\n", module, className, signature);
     
     // Check if this class is in our stored FFI classes list
-    FFIClassInfo* ffiClass = findFFIClass(module, className);
+    WreniContext* ctx = getWreniContext(vm);
+    FFIClassInfo* ffiClass = findFFIClass(ctx, module, className);
     if (ffiClass == NULL) {
         return NULL;
     }
     
     // fprintf(stderr, "Found FFI class %s.%s in storage - providing foreign method\n", module, className);
-    // fprintf(stderr, "Binding foreign method %p\n", executeForeignFn);
     
     ObjClass* cls = AS_CLASS(vm->fiber->stackTop[-1]);
     // fprintf(stderr, "Class: %s\n", cls->name->value);
@@ -854,71 +5584,647 @@ WrenForeignMethodFn bindForeignMethodFn(WrenVM* vm, const char* module,
         *paren = '\0';
     }
     
-    // Try to find the symbol in the VM's methodNames table
-    uint16_t symbol = 0;
-    bool foundSymbol = false;
+    // The signature is already interned in the VM's methodNames table
+    int symbol = wrenSymbolTableFind(&vm->methodNames, signature, strlen(signature));
     
-    // fprintf(stderr, "Binding foreign method %s.%s.%s\n", module, className, signature);
+    FFIMethodInfo* methodInfo = addFFIMethod(ctx, methodName, signature, cls, symbol < 0 ? 0 : (uint16_t)symbol, isStatic);
+    if (methodInfo == NULL) {
+        return NULL;
+    }
     
-    // Look through the VM's methodNames to find the matching name
-    for (int i = 0; i < vm->methodNames.count; i++) {
-        ObjString* name = vm->methodNames.data[i];
-        if (name != NULL) {
-            // Strip parentheses from VM method name for comparison
-            char vmMethodName[256];
-            strncpy(vmMethodName, name->value, sizeof(vmMethodName) - 1);
-            vmMethodName[sizeof(vmMethodName) - 1] = '\0';
-            
-            char* paren = strchr(vmMethodName, '(');
-            if (paren != NULL) {
-                *paren = '\0';
+#ifdef WRENI_AOT_BINDINGS
+    // Methods compiled ahead of time bypass the dynamic libffi path. They
+    // are registered all the same, batched calls of void ones go through it.
+    int aotIndex = findAOTBinding(module, className, isStatic, signature);
+    if (aotIndex >= 0) {
+        if (ctx->aotMethods == NULL) {
+            ctx->aotMethods = calloc(sizeof(aotBindings) / sizeof(aotBindings[0]), sizeof(FFIMethodInfo*));
+        }
+        if (ctx->aotMethods != NULL) ctx->aotMethods[aotIndex] = methodInfo;
+        return aotBindings[aotIndex].fn;
+    }
+#endif
+
+    // Return an entry point that already knows its FFIMethodInfo
+    return createFFIMethodEntry(methodInfo);
+}
+
+// Helper function to create a VM with the wreni host configuration and the
+// FFI base class visible from every module, NULL when out of memory
+static WrenVM* newWreniVM(void) {
+    WreniContext* ctx = calloc(1, sizeof(WreniContext));
+    if (ctx == NULL) return NULL;
+    pthread_mutex_init(&ctx->async.lock, NULL);
+    pthread_cond_init(&ctx->async.finished, NULL);
+    
+    WrenConfiguration config;
+    wrenInitConfiguration(&config);
+    config.userData = ctx;
+    config.writeFn = &writeFn;
+    config.errorFn = &errorFn;
+    config.loadModuleFn = &loadModuleFn;
+    config.bindForeignClassFn = &bindForeignClassFn;
+    config.bindForeignMethodFn = &bindForeignMethodFn;
+    if (wreniGCOptions.initialHeapSize > 0) config.initialHeapSize = wreniGCOptions.initialHeapSize;
+    if (wreniGCOptions.minHeapSize > 0) config.minHeapSize = wreniGCOptions.minHeapSize;
+    if (wreniGCOptions.heapGrowthPercent > 0) config.heapGrowthPercent = wreniGCOptions.heapGrowthPercent;
+    ctx->heap.enabled = wreniPoolAllocator;
+    ctx->frames.enabled = wreniFrameStats;
+    ctx->gc.frameMode = wreniGCOptions.frameMode;
+    ctx->gc.managed = wreniGCOptions.frameMode || wreniGCOptions.stats || wreniGCOptions.logPath != NULL;
+    if (ctx->heap.enabled || ctx->gc.managed || ctx->frames.enabled) {
+        config.reallocateFn = &reallocateWreni;
+    }
+    
+    WrenVM* vm = wrenNewVM(&config);
+    if (ctx->gc.managed) {
+        ctx->gc.threshold = vm->nextGC;
+        vm->nextGC = SIZE_MAX;
+        ctx->gc.vm = vm;
+    }
+    
+    // FFI lives in the built-in "ffi" module, importing it from the core
+    // module makes it visible to every script as before
+    wrenInterpret(vm, "ffi", ffiModuleSource);
+    wrenInterpret(vm, NULL, "import \"ffi\" for FFI\n");
+    return vm;
+}
+
+// Function to free a VM made by newWreniVM with its host state. Libraries
+// held by its classes are released, the call descriptors its methods used
+// stay shared.
+static void freeWreniVM(WrenVM* vm) {
+    WreniContext* ctx = getWreniContext(vm);
+    clearFFIAsyncCalls(&ctx->async);
+    clearFFIStringCache(vm);
+    releaseFFICallbacks(vm, UNDEFINED_VAL);
+    for (int i = 0; i <= FFI_MAX_ARGS; i++) {
+        if (ctx->callHandles[i] != NULL) wrenReleaseHandle(vm, ctx->callHandles[i]);
+    }
+    for (uint32_t i = 0; i < ctx->methods.capacity; i++) {
+        FFIMethodInfo* methodInfo = ctx->methods.slots[i].value;
+        if (methodInfo != NULL && methodInfo->memo != NULL) clearFFIMemo(vm, methodInfo->memo);
+    }
+    releasePrefetchedModules(ctx);
+    ctx->gc.vm = NULL;
+    wrenFreeVM(vm);
+    
+    for (uint32_t i = 0; i < ctx->methods.capacity; i++) {
+        FFIMethodInfo* methodInfo = ctx->methods.slots[i].value;
+        if (methodInfo == NULL) continue;
+        if (methodInfo->closure != NULL) ffi_closure_free(methodInfo->closure);
+        free(methodInfo->memo);
+        free(methodInfo->methodName);
+        free(methodInfo->signature);
+        free(methodInfo);
+    }
+    
+    for (uint32_t i = 0; i < ctx->classesByName.capacity; i++) {
+        FFIClassInfo* ffiClass = ctx->classesByName.slots[i].info;
+        if (ffiClass == NULL) continue;
+        unloadAllDllHandles(ffiClass);
+        for (int j = 0; j < ffiClass->payload.slabCount; j++) {
+            free(ffiClass->payload.slabs[j]);
+        }
+        free(ffiClass->payload.slabs);
+        free(ffiClass->libraries);
+        free(ffiClass->externArena);
+        free(ffiClass->className);
+        free(ffiClass->moduleName);
+        free(ffiClass);
+    }
+    
+    free(ctx->methods.slots);
+    free(ctx->classesByName.slots);
+    free(ctx->classesByObject.slots);
+    free(ctx->pendingClasses);
+    free(ctx->aotMethods);
+    free(ctx->batch.data);
+    free(ctx->batch.arena);
+    free(ctx->batch.retained);
+    free(ctx->frames.frames);
+    free(ctx->gc.pauses);
+    freeWreniHeap(&ctx->heap);
+    pthread_mutex_destroy(&ctx->async.lock);
+    pthread_cond_destroy(&ctx->async.finished);
+    free(ctx);
+}
+
+// Helper function to order frame times for qsort
+static int compareFrameNs(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Function to report the frames recorded by a VM on stderr and, unless
+// [path] is "1", as JSON to [path]
+static void reportWreniFrames(WrenVM* vm, const char* path) {
+    WreniFrameStats* stats = &getWreniContext(vm)->frames;
+    if (stats->count == 0) {
+        fprintf(stderr, "Frame stats: no frames, is a method marked frame=true?\n");
+        return;
+    }
+    
+    uint64_t* ns = malloc(stats->count * sizeof(uint64_t));
+    if (ns == NULL) return;
+    uint64_t calls = 0;
+    uint64_t allocations = 0;
+    int collections = 0;
+    size_t heapMax = 0;
+    for (int i = 0; i < stats->count; i++) {
+        ns[i] = stats->frames[i].ns;
+        calls += stats->frames[i].calls;
+        allocations += stats->frames[i].allocations;
+        if (stats->frames[i].collected) collections++;
+        if (stats->frames[i].heapBytes > heapMax) heapMax = stats->frames[i].heapBytes;
+    }
+    qsort(ns, stats->count, sizeof(uint64_t), compareFrameNs);
+    
+    // Nearest-rank percentiles
+    double p50 = ns[(stats->count * 50 + 99) / 100 - 1] / 1e6;
+    double p99 = ns[(stats->count * 99 + 99) / 100 - 1] / 1e6;
+    double max = ns[stats->count - 1] / 1e6;
+    double callsPerFrame = (double)calls / stats->count;
+    double gcPerFrame = (double)collections / stats->count;
+    free(ns);
+    
+    // Allocations are counted by the pool allocator and, with frame
+    // statistics on, for malloc too
+    WreniHeap* heap = &getWreniContext(vm)->heap;
+    const char* allocator = heap->enabled ? "pool" : "malloc";
+    double allocationsPerFrame = (double)allocations / stats->count;
+    
+    // Calls of pure=true methods answered without calling the library
+    uint64_t memoHits, memoMisses, memoEvictions, memoInvalidated, memoEntries;
+    sumFFIMemoStats(getWreniContext(vm), &memoHits, &memoMisses, &memoEvictions, &memoInvalidated, &memoEntries);
+    double memoHitRate = memoHits + memoMisses > 0 ? (double)memoHits / (memoHits + memoMisses) : 0;
+    
+    fprintf(stderr, "Frame stats: %d frames, p50 %.3f ms, p99 %.3f ms, max %.3f ms, "
+                    "%.1f FFI calls/frame, %.3f GCs/frame, heap max %zu KB, %s allocator",
+            stats->count, p50, p99, max, callsPerFrame, gcPerFrame, heapMax / 1024, allocator);
+    fprintf(stderr, ", %.1f allocations/frame", allocationsPerFrame);
+    if (heap->enabled) {
+        fprintf(stderr, ", %.1f%% fragmentation", getWreniHeapFragmentation(heap) * 100);
+    }
+    if (memoHits + memoMisses > 0) {
+        fprintf(stderr, ", %.1f%% pure call hit rate", memoHitRate * 100);
+    }
+    fprintf(stderr, "\n");
+    
+    if (strcmp(path, "1") == 0) return;
+    FILE* out = fopen(path, "w");
+    if (out == NULL) {
+        fprintf(stderr, "Could not write frame stats to %s\n", path);
+        return;
+    }
+    fprintf(out, "{\"frames\": %d, \"p50_ms\": %.4f, \"p99_ms\": %.4f, \"max_ms\": %.4f, "
+                 "\"calls_per_frame\": %.2f, \"gc_per_frame\": %.4f, \"heap_max_kb\": %zu, "
+                 "\"allocator\": \"%s\", \"allocs_per_frame\": %.2f, \"pure_hit_rate\": %.4f}\n",
+            stats->count, p50, p99, max, callsPerFrame, gcPerFrame, heapMax / 1024,
+            allocator, allocationsPerFrame, memoHitRate);
+    fclose(out);
+}
+
+// Function to report the collections of a VM with --gc-stats, and to write
+// each pause as one JSON line to the file of --gc-log
+static void reportWreniGC(WrenVM* vm) {
+    WreniGC* gc = &getWreniContext(vm)->gc;
+    
+    if (wreniGCOptions.logPath != NULL) {
+        FILE* out = fopen(wreniGCOptions.logPath, "w");
+        if (out == NULL) {
+            fprintf(stderr, "Could not write collection pauses to %s\n", wreniGCOptions.logPath);
+        } else {
+            for (int i = 0; i < gc->pauseCount; i++) {
+                WreniGCPause* pause = &gc->pauses[i];
+                fprintf(out, "{\"frame\": %u, \"at_boundary\": %s, \"pause_ms\": %.4f, "
+                             "\"heap_before\": %zu, \"heap_after\": %zu, \"freed\": %zu}\n",
+                        pause->frame, pause->atBoundary ? "true" : "false", pause->ns / 1e6,
+                        pause->before, pause->after,
+                        pause->before > pause->after ? pause->before - pause->after : 0);
             }
-            
-            if (strcmp(vmMethodName, methodName) == 0) {
-                symbol = (uint16_t)i;
-                foundSymbol = true;
-                break;
+            fclose(out);
+        }
+    }
+    
+    if (!wreniGCOptions.stats) return;
+    if (gc->pauseCount == 0) {
+        fprintf(stderr, "GC stats: no collections\n");
+        return;
+    }
+    
+    uint64_t* ns = malloc(gc->pauseCount * sizeof(uint64_t));
+    if (ns == NULL) return;
+    int atBoundary = 0;
+    size_t freed = 0;
+    for (int i = 0; i < gc->pauseCount; i++) {
+        ns[i] = gc->pauses[i].ns;
+        if (gc->pauses[i].atBoundary) atBoundary++;
+        if (gc->pauses[i].before > gc->pauses[i].after) freed += gc->pauses[i].before - gc->pauses[i].after;
+    }
+    qsort(ns, gc->pauseCount, sizeof(uint64_t), compareFrameNs);
+    
+    fprintf(stderr, "GC stats: %d collections, %d at frame boundaries, %d mid-frame, "
+                    "pause p50 %.3f ms, p99 %.3f ms, max %.3f ms, %.1f MB freed\n",
+            gc->pauseCount, atBoundary, gc->pauseCount - atBoundary,
+            ns[(gc->pauseCount * 50 + 99) / 100 - 1] / 1e6, ns[(gc->pauseCount * 99 + 99) / 100 - 1] / 1e6,
+            ns[gc->pauseCount - 1] / 1e6, freed / (1024.0 * 1024.0));
+    free(ns);
+}
+
+// Structure of the parallel runner: scripts are taken in order by the
+// first idle worker, each runs in its own VM
+typedef struct {
+    char** modules;
+    int moduleCount;
+    int next;
+    int failed;
+    pthread_mutex_t lock;
+} WreniRunner;
+
+// Function to run one module in a fresh VM, returns its interpret result
+static WrenInterpretResult runWreniModule(const char* module) {
+    WrenVM* vm = newWreniVM();
+    if (vm == NULL) return WREN_RESULT_RUNTIME_ERROR;
+    
+    char importStatement[512];
+    snprintf(importStatement, sizeof(importStatement), "import \"%s\"", module);
+    WrenInterpretResult result = wrenInterpret(vm, NULL, importStatement);
+    
+    // Calls recorded by batch=true methods outside FFI.batch still run
+    getWreniContext(vm)->batch.depth = 0;
+    flushFFIBatch(vm);
+    
+    // Fibers waiting for async calls are resumed before the VM goes
+    if (result == WREN_RESULT_SUCCESS) result = drainFFIAsyncCalls(vm);
+    
+    freeWreniVM(vm);
+    return result;
+}
+
+// Worker of the parallel runner
+static void* runWreniWorker(void* data) {
+    WreniRunner* runner = data;
+    for (;;) {
+        pthread_mutex_lock(&runner->lock);
+        int index = runner->next++;
+        pthread_mutex_unlock(&runner->lock);
+        if (index >= runner->moduleCount) break;
+        
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        WrenInterpretResult result = runWreniModule(runner->modules[index]);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+        
+        fprintf(stderr, "%s: %s in %.1f ms\n", runner->modules[index],
+                result == WREN_RESULT_SUCCESS ? "ok" :
+                result == WREN_RESULT_COMPILE_ERROR ? "compile error" : "runtime error", ms);
+        if (result != WREN_RESULT_SUCCESS) {
+            pthread_mutex_lock(&runner->lock);
+            runner->failed++;
+            pthread_mutex_unlock(&runner->lock);
+        }
+    }
+    return NULL;
+}
+
+// Function to run every module in its own VM on a pool of [threadCount]
+// threads, one per core by default, see `wreni --parallel`
+static int runWreniParallel(int threadCount, int moduleCount, char** modules) {
+    if (threadCount <= 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        threadCount = cores > 0 ? (int)cores : 1;
+    }
+    if (threadCount > moduleCount) threadCount = moduleCount;
+    
+    WreniRunner runner = { modules, moduleCount, 0, 0 };
+    pthread_mutex_init(&runner.lock, NULL);
+    pthread_t* threads = malloc(threadCount * sizeof(pthread_t));
+    if (threads == NULL) return 1;
+    
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int started = 0;
+    for (; started < threadCount; started++) {
+        if (pthread_create(&threads[started], NULL, runWreniWorker, &runner) != 0) break;
+    }
+    // Without any worker the scripts run on this thread
+    if (started == 0) runWreniWorker(&runner);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    
+    double ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+    fprintf(stderr, "%d scripts on %d threads in %.1f ms\n", moduleCount, started > 0 ? started : 1, ms);
+    free(threads);
+    pthread_mutex_destroy(&runner.lock);
+    return runner.failed > 0 ? 1 : 0;
+}
+
+// C spelling of an FFI type in generated AOT bindings, NULL if unsupported
+static const char* aotCType(FFITypeTag tag) {
+    switch (tag) {
+        case FT_VOID:   return "void";
+        case FT_I32:    return "int32_t";
+        case FT_I64:    return "int64_t";
+        case FT_F32:    return "float";
+        case FT_F64:    return "double";
+        case FT_BOOL:   return "bool";
+        case FT_STRING: return "const char*";
+        case FT_PTR:    return "void*";
+        case FT_I8:     return "int8_t";
+        case FT_U8:     return "uint8_t";
+        case FT_I16:    return "int16_t";
+        case FT_U16:    return "uint16_t";
+        case FT_U32:    return "uint32_t";
+        default:        return NULL;
+    }
+}
+
+// Order of methods in generated bindings, so output does not depend on hashing
+static int compareAOTMethods(const void* a, const void* b) {
+    const FFIMethodInfo* x = *(FFIMethodInfo* const*)a;
+    const FFIMethodInfo* y = *(FFIMethodInfo* const*)b;
+    int order = strcmp(x->classObj->name->value, y->classObj->name->value);
+    if (order == 0) order = (int)x->isStatic - (int)y->isStatic;
+    if (order == 0) order = strcmp(x->signature, y->signature);
+    return order;
+}
+
+// Helper function to write the AOT binding of one method, false if its
+// signature can't be compiled ahead of time and stays on the dynamic path
+static bool emitAOTBinding(FILE* out, int index, const char* module, FFIMethodInfo* m) {
+    FFITypeTag argTags[FFI_MAX_ARGS];
+    FFITypeTag retTag = FT_VOID;
+    int argCount = 0;
+    
+    if (m->dllName == NULL || m->batch || m->async || m->frame || m->payloadArg || m->init || m->pure) return false;
+    if (m->retSignature != NULL && !parseFFIType(m->retSignature, strlen(m->retSignature), &retTag)) {
+        return false;
+    }
+    
+    const char* args = m->argsSignature;
+    if (args != NULL && args[strspn(args, " ")] != '\0') {
+        for (const char* start = args; ; ) {
+            const char* end = strchr(start, ',');
+            if (end == NULL) end = start + strlen(start);
+            if (argCount >= m->arity ||
+                !parseFFIType(start, end - start, &argTags[argCount]) ||
+                argTags[argCount] == FT_VOID || aotCType(argTags[argCount]) == NULL) {
+                return false;
             }
+            argCount++;
+            if (*end == '\0') break;
+            start = end + 1;
         }
     }
     
-    if (foundSymbol) {
-        addFFIMethod(methodName, signature, cls, symbol);
-    } else {
-        // fprintf(stderr, "Warning: Could not find symbol for method %s, storing without symbol\n", methodName);
-        addFFIMethod(methodName, signature, cls, 0); // Store with symbol 0 as placeholder
+    // C prototype of the function pointer, e.g. "void (*)(int32_t, float)"
+    char params[512] = "void";
+    size_t used = 0;
+    for (int i = 0; i < argCount; i++) {
+        used += snprintf(params + used, sizeof(params) - used, "%s%s", i ? ", " : "", aotCType(argTags[i]));
+    }
+    
+    char fnName[256];
+    size_t nameLen = strcspn(m->methodName, "(");
+    snprintf(fnName, sizeof(fnName), "%.*s", (int)nameLen, m->methodName);
+    
+    const char* className = m->classObj->name->value;
+    fprintf(out, "// %s%s.%s -> %s::%s(%s) -> %s\n", m->isStatic ? "static " : "", className, m->signature,
+            m->dllName, fnName, args ? args : "", m->retSignature ? m->retSignature : "void");
+    fprintf(out, "static void aotBinding%d(WrenVM* vm)\n{\n", index);
+    fprintf(out, "    static void* symbol = NULL;\n");
+    fprintf(out, "    %s (*fn)(%s) = (%s (*)(%s))__atomic_load_n(&symbol, __ATOMIC_ACQUIRE);\n",
+            aotCType(retTag), params, aotCType(retTag), params);
+    fprintf(out, "    if (fn == NULL) {\n");
+    fprintf(out, "        fn = (%s (*)(%s))resolveAOTSymbol(vm, &symbol, \"%s\", \"%s\", \"%s\", \"%s\");\n",
+            aotCType(retTag), params, module, className, m->dllName, fnName);
+    fprintf(out, "        if (fn == NULL) return;\n    }\n");
+    
+    // Inside FFI.batch void calls are recorded by the dynamic path
+    if (retTag == FT_VOID) {
+        fprintf(out, "    if (getWreniContext(vm)->batch.depth > 0) { recordAOTCall(vm, %d); return; }\n", index);
+    }
+    
+    for (int i = 0; i < argCount; i++) {
+        if (argTags[i] == FT_STRING) {
+            fprintf(out, "    if (wrenGetSlotType(vm, %d) != WREN_TYPE_STRING) { abortAOTArgument(vm, \"Expected a String argument\"); return; }\n", i + 1);
+        } else if (argTags[i] == FT_PTR) {
+            fprintf(out, "    if (!isAOTSlotPtr(vm, %d)) { abortAOTArgument(vm, \"Expected a Num argument\"); return; }\n", i + 1);
+        } else if (argTags[i] != FT_BOOL) {
+            fprintf(out, "    if (wrenGetSlotType(vm, %d) != WREN_TYPE_NUM) { abortAOTArgument(vm, \"Expected a Num argument\"); return; }\n", i + 1);
+        }
+    }
+    
+    // Recorded calls must run before this one to keep the call order
+    fprintf(out, "    flushFFIBatch(vm);\n");
+    fprintf(out, "    ");
+    switch (retTag) {
+        case FT_VOID:   break;
+        case FT_BOOL:   fprintf(out, "wrenSetSlotBool(vm, 0, "); break;
+        case FT_STRING: fprintf(out, "setFFIStringResult(vm, "); break;
+        case FT_PTR:    fprintf(out, "setFFIPtrResult(vm, "); break;
+        default:        fprintf(out, "wrenSetSlotDouble(vm, 0, (double)"); break;
     }
+    fprintf(out, "fn(");
+    for (int i = 0; i < argCount; i++) {
+        if (i > 0) fprintf(out, ", ");
+        switch (argTags[i]) {
+            case FT_STRING: fprintf(out, "wrenGetSlotString(vm, %d)", i + 1); break;
+            case FT_BOOL:   fprintf(out, "getAOTSlotBool(vm, %d)", i + 1); break;
+            case FT_PTR:    fprintf(out, "getAOTSlotPtr(vm, %d)", i + 1); break;
+            case FT_F32:
+            case FT_F64:    fprintf(out, "(%s)wrenGetSlotDouble(vm, %d)", aotCType(argTags[i]), i + 1); break;
+            // Through int64_t like the dynamic path, so negative numbers
+            // wrap to unsigned types instead of being undefined
+            default:        fprintf(out, "(%s)(int64_t)wrenGetSlotDouble(vm, %d)", aotCType(argTags[i]), i + 1); break;
+        }
+    }
+    fprintf(out, retTag == FT_VOID ? ");\n}\n\n" : "));\n}\n\n");
+    return true;
+}
 
-    // Return the standard foreign function (we'll use VM symbol table to find the method)
-    return executeForeignFn;
+// Function to compile the #!extern methods of FFI classes in [modules] into
+// a C source with one direct WrenForeignMethodFn per method, see the aot
+// target of the Makefile. Methods it can't handle keep the dynamic path.
+static int emitAOTBindings(const char* outPath, int moduleCount, char** modules) {
+    WrenVM* vm = newWreniVM();
+    
+    // Running a binding module only defines its classes and binds methods
+    for (int i = 0; i < moduleCount; i++) {
+        char importStatement[512];
+        snprintf(importStatement, sizeof(importStatement), "import \"%s\"", modules[i]);
+        if (wrenInterpret(vm, NULL, importStatement) != WREN_RESULT_SUCCESS) {
+            fprintf(stderr, "Could not load module '%s' for AOT bindings\n", modules[i]);
+            return 1;
+        }
+    }
+    
+    FILE* out = fopen(outPath, "w");
+    if (out == NULL) {
+        fprintf(stderr, "Could not open \"%s\" for writing.\n", outPath);
+        return 1;
+    }
+    
+    fprintf(out, "// Generated by `wreni --aot`, do not edit.\n");
+    fprintf(out, "// Ahead-of-time FFI bindings for modules:");
+    for (int i = 0; i < moduleCount; i++) fprintf(out, " %s", modules[i]);
+    fprintf(out, "\n\n");
+    
+    WreniContext* ctx = getWreniContext(vm);
+    FFIMethodInfo** methods = malloc((ctx->methods.count + 1) * sizeof(FFIMethodInfo*));
+    const char** methodModules = malloc((ctx->methods.count + 1) * sizeof(char*));
+    int emitted = 0;
+    
+    for (int i = 0; i < moduleCount; i++) {
+        int count = 0;
+        for (uint32_t j = 0; j < ctx->methods.capacity; j++) {
+            FFIMethodInfo* m = ctx->methods.slots[j].value;
+            if (m == NULL) continue;
+            FFIClassInfo* ffiClass = findFFIClassByObject(ctx, m->classObj);
+            if (ffiClass != NULL && strcmp(ffiClass->moduleName, modules[i]) == 0) {
+                methods[emitted + count++] = m;
+            }
+        }
+        qsort(methods + emitted, count, sizeof(FFIMethodInfo*), compareAOTMethods);
+        
+        for (int j = emitted; j < emitted + count; j++) {
+            FFIMethodInfo* m = methods[j];
+            extractAndStoreFFIAttributes(vm, m, m->signature);
+            if (emitAOTBinding(out, emitted, modules[i], m)) {
+                methods[emitted] = m;
+                methodModules[emitted++] = modules[i];
+            } else {
+                fprintf(stderr, "Skipping %s.%s, its signature stays on the dynamic path\n",
+                        m->classObj->name->value, m->signature);
+            }
+        }
+    }
+    
+    fprintf(out, "static const AOTBinding aotBindings[] = {\n");
+    for (int i = 0; i < emitted; i++) {
+        fprintf(out, "    { \"%s\", \"%s\", %s, \"%s\", aotBinding%d },\n", methodModules[i],
+                methods[i]->classObj->name->value, methods[i]->isStatic ? "true" : "false",
+                methods[i]->signature, i);
+    }
+    fprintf(out, "    { NULL, NULL, false, NULL, NULL }\n};\n");
+    fclose(out);
+    
+    fprintf(stderr, "Wrote %d AOT bindings to %s\n", emitted, outPath);
+    free(methods);
+    free(methodModules);
+    freeWreniVM(vm);
+    return 0;
 }
 
 int main(int argc, char* argv[])
 {
+    // Resolve every FFI method when its class is defined instead of on its
+    // first call
+    const char* eager = getenv("WRENI_EAGER");
+    ffiEagerBinding = eager != NULL && strcmp(eager, "0") != 0;
+    
+    const char* debug = getenv("WRENI_DEBUG");
+    wreniDebug = debug != NULL && strcmp(debug, "0") != 0;
+    
+    // Size-class pooling allocator for the Wren heap instead of realloc
+    const char* allocator = getenv("WRENI_ALLOCATOR");
+    wreniPoolAllocator = allocator != NULL && strcmp(allocator, "pool") == 0;
+    
+    // Options before the module name, each shifted out of argv
+    while (argc >= 2 && strncmp(argv[1], "--", 2) == 0) {
+        int used = 1;
+        if (strcmp(argv[1], "--eager") == 0) {
+            ffiEagerBinding = true;
+        } else if (strcmp(argv[1], "--gc-frame") == 0) {
+            wreniGCOptions.frameMode = true;
+        } else if (strcmp(argv[1], "--gc-stats") == 0) {
+            wreniGCOptions.stats = true;
+        } else if (argc >= 3 && strcmp(argv[1], "--gc-log") == 0) {
+            wreniGCOptions.logPath = argv[2];
+            used = 2;
+        } else if (argc >= 3 && strcmp(argv[1], "--initial-heap") == 0) {
+            wreniGCOptions.initialHeapSize = parseWreniSize(argv[2]);
+            used = 2;
+        } else if (argc >= 3 && strcmp(argv[1], "--min-heap") == 0) {
+            wreniGCOptions.minHeapSize = parseWreniSize(argv[2]);
+            used = 2;
+        } else if (argc >= 3 && strcmp(argv[1], "--heap-growth") == 0) {
+            wreniGCOptions.heapGrowthPercent = atoi(argv[2]);
+            used = 2;
+        } else {
+            break;
+        }
+        argv[used] = argv[0];
+        argc -= used;
+        argv += used;
+    }
+    
     if (argc < 2) {
-        fprintf(stderr, "Usage: %s <wren_module_name>\n", argv[0]);
+        fprintf(stderr, "Usage: %s [options] <wren_module_name>\n", argv[0]);
+        fprintf(stderr, "       %s --aot <output.c> <wren_module_name>...\n", argv[0]);
+        fprintf(stderr, "       %s [options] --parallel [-j <threads>] <wren_module_name>...\n", argv[0]);
+        fprintf(stderr, "Options:\n"
+                        "  --eager                 bind FFI methods when their class is defined\n"
+                        "  --initial-heap <size>   heap size of the first collection, e.g. 4M\n"
+                        "  --min-heap <size>       smallest heap size a collection aims for\n"
+                        "  --heap-growth <percent> heap growth allowed after a collection\n"
+                        "  --gc-frame              move collections to frame boundaries\n"
+                        "  --gc-stats              report collection pauses on exit\n"
+                        "  --gc-log <file>         write every collection pause as a JSON line\n");
         fprintf(stderr, "Example: %s main\n"
                         "         for loading and eval 'main.wren'\n", argv[0]);
         return 0;
     }
     
-    WrenConfiguration config;
-    wrenInitConfiguration(&config);
-    config.writeFn = &writeFn;
-    config.errorFn = &errorFn;
-    config.loadModuleFn = &loadModuleFn;
-    config.bindForeignClassFn = &bindForeignClassFn;
-    config.bindForeignMethodFn = &bindForeignMethodFn;
+    if (strcmp(argv[1], "--aot") == 0) {
+        if (argc < 4) {
+            fprintf(stderr, "Usage: %s --aot <output.c> <wren_module_name>...\n", argv[0]);
+            return 1;
+        }
+        return emitAOTBindings(argv[2], argc - 3, argv + 3);
+    }
     
-    WrenVM* vm = wrenNewVM(&config);
+    if (strcmp(argv[1], "--parallel") == 0) {
+        int threadCount = 0;
+        int first = 2;
+        if (argc >= 4 && strcmp(argv[2], "-j") == 0) {
+            threadCount = atoi(argv[3]);
+            first = 4;
+        }
+        if (first >= argc) {
+            fprintf(stderr, "Usage: %s --parallel [-j <threads>] <wren_module_name>...\n", argv[0]);
+            return 1;
+        }
+        return runWreniParallel(threadCount, argc - first, argv + first);
+    }
+    
+    // Frame statistics, reported when the script is done
+    const char* frameStats = getenv("WRENI_FRAME_STATS");
+    wreniFrameStats = frameStats != NULL && strcmp(frameStats, "0") != 0;
+    
+    WrenVM* vm = newWreniVM();
+    if (vm == NULL) {
+        fprintf(stderr, "Could not create the VM.\n");
+        return 1;
+    }
     WrenInterpretResult result;
 
-    result = wrenInterpret(vm, NULL, "class FFI {}\n");
-
     char importStatement[512];
     snprintf(importStatement, sizeof(importStatement), "import \"%s\"", argv[1]);
     result = wrenInterpret(vm, NULL, importStatement);
     
+    // Calls recorded by batch=true methods outside FFI.batch still run
+    getWreniContext(vm)->batch.depth = 0;
+    flushFFIBatch(vm);
+    
+    // Fibers waiting for async calls are resumed before the VM goes
+    if (result == WREN_RESULT_SUCCESS) result = drainFFIAsyncCalls(vm);
+    
     if (result == WREN_RESULT_COMPILE_ERROR) {
         fprintf(stderr, "Compile error!\n");
         return 1;
@@ -927,7 +6233,15 @@ int main(int argc, char* argv[])
         return 1;
     }
     
-    wrenFreeVM(vm);
+    FFIStringCache* cache = &getWreniContext(vm)->stringCache;
+    if (cache->hits + cache->misses > 0) {
+        fprintf(stderr, "FFI string cache: %llu hits, %llu misses, %llu evictions\n",
+                (unsigned long long)cache->hits, (unsigned long long)cache->misses,
+                (unsigned long long)cache->evictions);
+    }
+    if (getWreniContext(vm)->frames.enabled) reportWreniFrames(vm, frameStats);
+    if (getWreniContext(vm)->gc.managed) reportWreniGC(vm);
+    freeWreniVM(vm);
     
     return 0;
 }
@@ -0,0 +1,68 @@
+#!/bin/sh
+# Generates the direct-call thunks used by main.c for FFI calls, one per
+# signature shape of up to MAX scalar arguments (default 5).
+#
+# Arguments are grouped by how the x86_64 SysV ABI passes them: I (any
+# integer or pointer, widened to 64 bits), F (float) and D (double). Return
+# values are V (void), I, F or D. Shapes are numbered per arity with the
+# first argument as the most significant base-3 digit, see ffiThunkFor().
+# main.c only uses them on x86_64 SysV targets, elsewhere calls go through
+# ffi_call.
+#
+# Usage: sh tools/gen_thunks.sh [MAX] > build/ffi_thunks.h
+
+MAX=${1:-5}
+
+awk -v max="$MAX" '
+BEGIN {
+    letter[0] = "I"; ctype[0] = "int64_t"; member[0] = "i64"
+    letter[1] = "F"; ctype[1] = "float";   member[1] = "f32"
+    letter[2] = "D"; ctype[2] = "double";  member[2] = "f64"
+
+    nrets = split("V I F D", rets, " ")
+    rtype["V"] = "void"; rtype["I"] = "int64_t"; rtype["F"] = "float"; rtype["D"] = "double"
+    rmember["I"] = "i64"; rmember["F"] = "f32"; rmember["D"] = "f64"
+
+    print "// Generated by tools/gen_thunks.sh, do not edit."
+    print ""
+    print "#define FFI_THUNK_MAX_ARGS " max
+    print ""
+
+    shapes = 0
+    for (n = 0; n <= max; n++) {
+        count = 3 ^ n
+        for (code = 0; code < count; code++) {
+            c = code
+            for (i = n - 1; i >= 0; i--) { digit[i] = c % 3; c = int(c / 3) }
+
+            suffix = ""; params = ""; values = ""
+            for (i = 0; i < n; i++) {
+                suffix = suffix letter[digit[i]]
+                params = params (i ? ", " : "") ctype[digit[i]]
+                values = values (i ? ", " : "") "a[" i "]." member[digit[i]]
+            }
+            if (n == 0) params = "void"
+
+            for (k = 1; k <= nrets; k++) {
+                r = rets[k]
+                name = "ffiThunk_" r (n ? "_" suffix : "")
+                store = (r == "V") ? "" : "r->" rmember[r] " = "
+                printf "static void %s(void* fn, const FFIValue* a, FFIValue* r) { %s((%s (*)(%s))fn)(%s); }\n", \
+                       name, store, rtype[r], params, values
+                names[k, shapes] = name
+            }
+            shapes++
+        }
+    }
+
+    print ""
+    print "#define FFI_THUNK_SHAPES " shapes
+    print ""
+    print "static const FFIThunk ffiThunks[" nrets "][FFI_THUNK_SHAPES] = {"
+    for (k = 1; k <= nrets; k++) {
+        print "    {"
+        for (s = 0; s < shapes; s++) print "        " names[k, s] ","
+        print "    },"
+    }
+    print "};"
+}'